@@ -0,0 +1,112 @@
+#!/bin/sh
+#
+# findif-bench.sh: Time the lookup mechanisms of findif on synthetic
+#	routing tables, and check that they give the same answers
+#
+#	findif-bench.sh [findif [findif_routegen]]
+#
+#	For each size, findif_routegen makes a table and addresses to look
+#	up, and each mechanism which can read a table of findif -p looks
+#	them all up with -f, timed by findif -t. load_ms is the time of the
+#	first address, which reads the table (and builds the index), and
+#	lookup_ns that of each of the others; the best of $REPEAT runs is
+#	taken. The answers of each mechanism are compared with those of
+#	the first one; mismatch is the number of addresses answered
+#	differently.
+#
+#	The result is one line of key=value pairs per table and mechanism.
+#
+#	Environment:
+#		SIZES		numbers of routes (1000 10000 100000 1000000)
+#		FAMILIES	4 and/or 6 (4 6)
+#		LOOKUPS		addresses looked up (2000)
+#		MECHANISMS	(proc index)
+#		REPEAT		runs of each, the best is taken (3)
+#		TMPDIR		where the tables go (/tmp)
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+FINDIF=${1:-./findif}
+ROUTEGEN=${2:-./findif_routegen}
+SIZES=${SIZES:-"1000 10000 100000 1000000"}
+FAMILIES=${FAMILIES:-"4 6"}
+LOOKUPS=${LOOKUPS:-2000}
+MECHANISMS=${MECHANISMS:-"proc index"}
+REPEAT=${REPEAT:-3}
+
+dir=`mktemp -d ${TMPDIR:-/tmp}/findif-bench.XXXXXX` || exit 1
+trap 'rm -rf "$dir"' 0
+trap 'exit 1' 1 2 15
+
+# findif -t -m $1 on the table, output in $2; the best times of the runs
+# are left in first_us and lookup_ns
+run_best() {
+	best_first=
+	best_lookup=
+	i=0
+	while [ $i -lt $REPEAT ]; do
+		"$FINDIF" -t -p "$dir/table" -m "$1" -f "$dir/table/addresses" \
+			>"$2" 2>"$dir/times" || return 1
+		eval `tail -1 "$dir/times"`
+		if [ -z "$best_first" ] || [ $first_us -lt $best_first ]; then
+			best_first=$first_us
+		fi
+		if [ -z "$best_lookup" ] || [ $lookup_ns -lt $best_lookup ]; then
+			best_lookup=$lookup_ns
+		fi
+		i=$((i + 1))
+	done
+	first_us=$best_first
+	lookup_ns=$best_lookup
+}
+
+rc=0
+for family in $FAMILIES; do
+	case $family in
+	4)	gen_opt= name=inet;;
+	6)	gen_opt=-6 name=inet6;;
+	*)	echo "unknown family $family" >&2; exit 2;;
+	esac
+	for size in $SIZES; do
+		rm -rf "$dir/table"
+		"$ROUTEGEN" $gen_opt -n $size -q $LOOKUPS "$dir/table" \
+			>/dev/null || exit 1
+		first=
+		for mech in $MECHANISMS; do
+			run_best $mech "$dir/out.$mech" || exit 1
+			if grep -q "is not available" "$dir/out.$mech"; then
+				echo "family=$name routes=$size mechanism=$mech" \
+					"not available"
+				continue
+			fi
+			if [ -z "$first" ]; then
+				first=$mech
+				mismatch=0
+			else
+				mismatch=`diff "$dir/out.$first" "$dir/out.$mech" \
+					| grep -c '^>'`
+				[ $mismatch -eq 0 ] || rc=1
+			fi
+			[ $lookup_ns -gt 0 ] || lookup_ns=1
+			echo "family=$name routes=$size mechanism=$mech" \
+				"load_ms=$((first_us / 1000))" \
+				"lookups=$LOOKUPS lookup_ns=$lookup_ns" \
+				"lookups_per_sec=$((1000000000 / lookup_ns))" \
+				"mismatch=$mismatch"
+		done
+	done
+done
+exit $rc
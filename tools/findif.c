@@ -3,8 +3,8 @@
  *
  *	It's really simple to write in C, but hard to write in the shell...
  *
- *	This code is dependent on IPV4 addressing conventions...
- *		Sorry.
+ *	IPv4 and IPv6 addresses are handled; see FindIF6() for the output
+ *	for an IPv6 address.
  *
  * Copyright (C) 2000 Alan Robertson <alanr@unix.sh>
  * Copyright (C) 2001 Matt Soffen <matt@soffen.com>
@@ -43,6 +43,36 @@
  *	If the interface is omitted, we choose the interface associated with
  *	the route we selected.
  *
+ *	With -f <file> (- for stdin) findif reads one address per line
+ *	instead, as
+ *
+ *		ip[/cidr_netmask] [nic [broadcast]]
+ *
+ *	where "-" leaves a field out, and prints one line per address:
+ *
+ *		ip	0	<the output as above>
+ *		ip	<exit code>	<error message>
+ *
+ *	The routes are read and the sockets opened once for all of them.
+ *	Empty lines and lines starting with '#' are skipped. A line
+ *	"generation" is answered with the generation of the route index
+ *	(see -m index below), which changes whenever a route, an address
+ *	or an interface does, so that the answers may be cached until then.
+ *
+ *	-m index looks the addresses up in an index of the main routing
+ *	table (findif_index.c) loaded from netlink. With -f, the changes
+ *	the kernel reports are applied before each line, so a findif
+ *	reading a pipe keeps answering from the current tables.
+ *
+ *	-p <dir> reads the routes from <dir>/net/route and
+ *	<dir>/net/ipv6_route, in the format of /proc, instead of the
+ *	kernel. The proc and index mechanisms then use those tables and
+ *	the others are not available, so the two can be compared, and
+ *	timed, on tables made by findif_routegen.
+ *
+ *	-t prints to stderr, after the last line of -f, how long the first
+ *	address took, which reads the tables, and the others on average.
+ *
  *
  *	See http://www.doom.net/docs/netmask.html for a table explaining
  *	CIDR address format and their relationship to life, the universe
@@ -57,6 +87,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <time.h>
 #include <sys/types.h>
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
@@ -78,12 +109,18 @@
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
 #include <agent_config.h>
 #include <config.h>
+#include "findif_index.h"
 
 #define DEBUG 0
 #define	EOS			'\0'
 #define	PROCROUTE	"/proc/net/route"
+#define	PROCROUTE6	"/proc/net/ipv6_route"
 #define ROUTEPARM	"-n get"
 
 #ifndef HAVE_STRNLEN
@@ -109,6 +146,9 @@
 #endif
 
 static int OutputInCIDR=0;
+static int BatchMode=0;
+static const char *RouteDir=NULL;	/* -p */
+static int TimeBatch=0;			/* -t */
 
 
 /*
@@ -128,21 +168,60 @@ typedef int SearchRoute (char *address, struct in_addr *in
 ,        unsigned long *best_netmask, char *errmsg
 ,	int errmsglen);
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+static SearchRoute SearchUsingNetlink;
+static SearchRoute SearchUsingIndex;
+#endif
 static SearchRoute SearchUsingProcRoute;
 static SearchRoute SearchUsingRouteCmd;
 
-static SearchRoute *search_mechs[] = {
-	&SearchUsingProcRoute,
-	&SearchUsingRouteCmd,
-	NULL
+/* tried in this order; -m selects one of them */
+static struct {
+	const char	*name;
+	SearchRoute	*search;
+} search_mechs[] = {
+#ifdef HAVE_LINUX_RTNETLINK_H
+	{"netlink",	&SearchUsingNetlink},
+	{"index",	&SearchUsingIndex},
+#endif
+	{"proc",	&SearchUsingProcRoute},
+	{"route",	&SearchUsingRouteCmd},
+	{NULL,		NULL}
+};
+
+/*
+ * The same for IPv6, with the prefix length for the netmask. oif, if not
+ * 0, is the interface the route must go out of.
+ */
+typedef int SearchRoute6 (char *address, struct in6_addr *in6, int oif
+,	char *best_if, size_t best_iflen, int *best_prefixlen
+,	char *errmsg, int errmsglen);
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+static SearchRoute6 SearchUsingNetlink6;
+static SearchRoute6 SearchUsingIndex6;
+#endif
+static SearchRoute6 SearchUsingProcRoute6;
+
+static struct {
+	const char	*name;
+	SearchRoute6	*search;
+} search6_mechs[] = {
+#ifdef HAVE_LINUX_RTNETLINK_H
+	{"netlink",	&SearchUsingNetlink6},
+	{"index",	&SearchUsingIndex6},
+#endif
+	{"proc",	&SearchUsingProcRoute6},
+	{NULL,		NULL}
 };
 
 void GetAddress (char **address, char **netmaskbits
 ,	 char **bcast_arg, char **if_specified);
 
-void ValidateNetmaskBits (char *netmaskbits, unsigned long *netmask);
+int ValidateNetmaskBits (char *netmaskbits, unsigned long *netmask);
 
-int ValidateIFName (const char *ifname, struct ifreq *ifr);
+int ValidateIFName (const char *ifname, struct ifreq *ifr
+,	char *errmsg, int errmsglen);
 
 int netmask_bits (unsigned long netmask);
 
@@ -162,72 +241,994 @@ static const char *cmdname = "findif";
 #define OCF_ERR_CONFIGURED      6
 #define OCF_NOT_RUNNING         7
 void usage(int ec);
+static int config_error(const char *errmsg);
 
 #define PATH_PROC_NET_DEV "/proc/net/dev"
 #define DELIM	'/'
 #define	BAD_BROADCAST	(0L)
 #define	MAXSTR	128
 
+/* whether the first plen bits of a and b are the same */
+static int
+prefix_match(const void *a, const void *b, int plen)
+{
+	const unsigned char	*p = a, *q = b;
+	int	bytes = plen / 8, bits = plen % 8;
+
+	if (memcmp(p, q, bytes) != 0) {
+		return 0;
+	}
+	return bits == 0
+	||	((p[bytes] ^ q[bytes]) & (0xff << (8 - bits)) & 0xff) == 0;
+}
+
+/*
+ * The interfaces
+ *
+ * Questions about one interface are ioctls on a single socket kept open
+ * for the run, not a socket per question as if_nametoindex() and
+ * if_indextoname() open. The addresses, which a local address needs
+ * all of, are one netlink dump for the run.
+ */
+static int ifreq_fd = -1;
+
+/* the socket for the ioctls, or -1 with errno */
+static int
+ifreq_socket(void)
+{
+	if (ifreq_fd == -1) {
+		ifreq_fd = socket(PF_INET, SOCK_DGRAM, 0);
+	}
+	return ifreq_fd;
+}
+
+/* as if_indextoname() */
+static char *
+findif_indextoname(int ifindex, char *ifname)
+{
+#if defined(__linux__) && defined(SIOCGIFNAME)
+	struct ifreq	ifr;
+
+	if (ifreq_socket() == -1) {
+		return NULL;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_ifindex = ifindex;
+	if (ioctl(ifreq_fd, SIOCGIFNAME, &ifr) < 0) {
+		return NULL;
+	}
+	strncpy(ifname, ifr.ifr_name, IF_NAMESIZE);
+	ifname[IF_NAMESIZE - 1] = '\0';
+	return ifname;
+#else
+	return if_indextoname(ifindex, ifname);
+#endif
+}
+
+/* as if_nametoindex() */
+static int
+findif_nametoindex(const char *ifname)
+{
+#if defined(__linux__) && defined(SIOCGIFINDEX)
+	struct ifreq	ifr;
+
+	if (ifreq_socket() == -1) {
+		return 0;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	if (ioctl(ifreq_fd, SIOCGIFINDEX, &ifr) < 0) {
+		return 0;
+	}
+	return ifr.ifr_ifindex;
+#else
+	return if_nametoindex(ifname);
+#endif
+}
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+/*
+ * Netlink
+ *
+ * The kernel is asked for the route of the address with one RTM_GETROUTE
+ * request, so the size of the routing table does not matter, and policy
+ * routing and all tables are taken into account as for the packets
+ * themselves. RTM_F_FIB_MATCH (Linux 4.13) makes the kernel return the
+ * matching route with its prefix length rather than a host route; older
+ * kernels ignore it and mark the reply RTM_F_CLONED, and we fall back to
+ * /proc/net/route.
+ */
+#ifndef RTM_F_FIB_MATCH
+#define RTM_F_FIB_MATCH	0x2000
+#endif
+
+typedef int NetlinkCallback (struct nlmsghdr *nh, void *arg);
+
+/* append an attribute to a request of bufsize bytes */
+static void
+netlink_add_attr(struct nlmsghdr *nh, size_t bufsize, int type
+,	const void *data, int len)
+{
+	struct rtattr	*rta = (struct rtattr *)
+		((char *)nh + NLMSG_ALIGN(nh->nlmsg_len));
+
+	if (NLMSG_ALIGN(nh->nlmsg_len) + RTA_LENGTH(len) > bufsize) {
+		return;
+	}
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_LENGTH(len);
+}
+
+static int netlink_fd = -1;
+static unsigned	netlink_seq;
+
+/*
+ * netlink_query --- send a request and pass each message of the reply
+ * to fn, until the end of a dump or fn returns non-zero
+ *
+ * The socket is kept open for the next address. Replies left over from
+ * an earlier request are told apart by the sequence number.
+ *
+ * Return code: 0, or a negative errno, which may come from the kernel.
+ */
+static int
+netlink_query(struct nlmsghdr *req, NetlinkCallback *fn, void *arg)
+{
+	struct sockaddr_nl	sa;
+	char	buf[32768];
+	int	rc = 0, done = 0;
+
+	if (netlink_fd == -1) {
+		netlink_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+		if (netlink_fd == -1) {
+			return -errno;
+		}
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	req->nlmsg_seq = ++netlink_seq;
+	if (sendto(netlink_fd, req, req->nlmsg_len, 0
+	,	(struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		return -errno;
+	}
+
+	while (!done) {
+		struct nlmsghdr	*nh;
+		ssize_t		len = recv(netlink_fd, buf, sizeof(buf), 0);
+
+		if (len == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			rc = -errno;
+			break;
+		}
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len)
+		;	nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_seq != req->nlmsg_seq) {
+				continue;
+			}
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				done = 1;
+				break;
+			}
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nh);
+
+				rc = err->error;
+				done = 1;
+				break;
+			}
+			if (fn(nh, arg) != 0
+			||	!(nh->nlmsg_flags & NLM_F_MULTI)) {
+				done = 1;
+				break;
+			}
+		}
+	}
+	return rc;
+}
+
+struct netlink_route {
+	int		type;
+	unsigned	flags;
+	int		prefixlen;
+	int		oif;
+};
+
+static int
+netlink_route_cb(struct nlmsghdr *nh, void *arg)
+{
+	struct netlink_route	*r = arg;
+	struct rtmsg	*rtm = NLMSG_DATA(nh);
+	struct rtattr	*rta = RTM_RTA(rtm);
+	int		len = RTM_PAYLOAD(nh);
+
+	if (nh->nlmsg_type != RTM_NEWROUTE) {
+		return 0;
+	}
+	r->type = rtm->rtm_type;
+	r->flags = rtm->rtm_flags;
+	r->prefixlen = rtm->rtm_dst_len;
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == RTA_OIF) {
+			r->oif = *(int *)RTA_DATA(rta);
+		}else if (rta->rta_type == RTA_MULTIPATH && r->oif == 0
+		&&	RTA_PAYLOAD(rta) >= sizeof(struct rtnexthop)) {
+			/* the first nexthop of a multipath route */
+			struct rtnexthop *nhp = RTA_DATA(rta);
+			r->oif = nhp->rtnh_ifindex;
+		}
+	}
+	return 1;
+}
+
+/*
+ * The addresses of the interfaces, from one RTM_GETADDR dump kept for
+ * the run. An address which is not in it makes it be dumped again, as
+ * one added since; the route index drops it when the tables change.
+ * In batch mode, an address whose prefix or interface changes is still
+ * in it, so the dump is dropped on the address events of if_addrs_fd,
+ * or on every lookup if they cannot be had.
+ */
+struct netlink_addr {
+	int		family;
+	int		prefixlen;
+	int		ifindex;
+	unsigned char	addr[16];
+};
+static struct netlink_addr *if_addrs;
+static int	n_if_addrs = -1, if_addrs_size;
+static int	if_addrs_fd = -1;
+
+/*
+ * Host addresses (/32, /128) have no route of their own in the main
+ * table, and among equal prefixes the interface of the route wins.
+ */
+#define NETLINK_PREFIX_RANK(maxlen, len, ifindex, oif) \
+	(((len) == (maxlen) ? 0 : ((len) + 1) * 2) + ((ifindex) == (oif)))
+
+static void
+if_addrs_clear(void)
+{
+	free(if_addrs);
+	if_addrs = NULL;
+	n_if_addrs = -1;
+	if_addrs_size = 0;
+}
+
+static int
+netlink_addr_cb(struct nlmsghdr *nh, void *arg)
+{
+	struct ifaddrmsg	*ifa = NLMSG_DATA(nh);
+	struct rtattr		*rta = IFA_RTA(ifa);
+	int			len = IFA_PAYLOAD(nh);
+
+	if (nh->nlmsg_type != RTM_NEWADDR
+	||	(ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)) {
+		return 0;
+	}
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		struct netlink_addr	*a;
+
+		/* IPv6 has no IFA_LOCAL; IFA_ADDRESS is the address */
+		if (rta->rta_type != IFA_LOCAL && (ifa->ifa_family != AF_INET6
+		||	rta->rta_type != IFA_ADDRESS)) {
+			continue;
+		}
+		if (n_if_addrs == if_addrs_size) {
+			int	size = if_addrs_size ? if_addrs_size * 2 : 64;
+			void	*p = realloc(if_addrs, size * sizeof(*if_addrs));
+
+			if (p == NULL) {
+				n_if_addrs = -1;
+				return 1;
+			}
+			if_addrs = p;
+			if_addrs_size = size;
+		}
+		a = &if_addrs[n_if_addrs++];
+		memset(a, 0, sizeof(*a));
+		a->family = ifa->ifa_family;
+		a->prefixlen = ifa->ifa_prefixlen;
+		a->ifindex = ifa->ifa_index;
+		memcpy(a->addr, RTA_DATA(rta)
+		,	ifa->ifa_family == AF_INET6 ? 16 : 4);
+	}
+	return 0;
+}
+
+/* whether the addresses may have changed since if_addrs was dumped */
+static int
+if_addrs_changed(void)
+{
+	char	buf[8192];
+	int	changed = 0;
+
+	if (!BatchMode) {
+		return 0;
+	}
+	if (if_addrs_fd == -1) {
+		return 1;
+	}
+	for (;;) {
+		ssize_t	len = recv(if_addrs_fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+		if (len == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			/* ENOBUFS: events were lost */
+			changed = 1;
+			if (errno != ENOBUFS) {
+				close(if_addrs_fd);
+				if_addrs_fd = -1;
+				break;
+			}
+			continue;
+		}
+		if (len > 0) {
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+/* subscribe to the address events, before the dump not to miss one */
+static void
+if_addrs_subscribe(void)
+{
+	struct sockaddr_nl	sa;
+
+	if (!BatchMode || if_addrs_fd != -1) {
+		return;
+	}
+	if_addrs_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (if_addrs_fd == -1) {
+		return;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind(if_addrs_fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		close(if_addrs_fd);
+		if_addrs_fd = -1;
+	}
+}
+
+/* dump the addresses of all families into if_addrs */
+static int
+load_if_addrs(void)
+{
+	struct {
+		struct nlmsghdr	nh;
+		struct ifaddrmsg ifa;
+	} req;
+	int	rc;
+
+	if_addrs_clear();
+	if_addrs_subscribe();
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifa));
+	req.nh.nlmsg_type = RTM_GETADDR;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.ifa.ifa_family = AF_UNSPEC;
+	n_if_addrs = 0;
+	if ((rc = netlink_query(&req.nh, netlink_addr_cb, NULL)) < 0
+	||	n_if_addrs < 0) {
+		if_addrs_clear();
+		return rc < 0 ? rc : -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * if_addr_prefix --- the prefix length and interface of addr, an
+ * address of this host, as /proc/net/route would show its route
+ *
+ * oif is the interface of the route the kernel chose, if known.
+ *
+ * Return code: 0, or -1 if addr is not on an interface.
+ */
+static int
+if_addr_prefix(int family, const void *addr, int oif, int *prefixlen
+,	int *ifindex)
+{
+	int	maxlen = family == AF_INET6 ? 128 : 32;
+	int	i, best, loaded = 0;
+
+	if (n_if_addrs >= 0 && if_addrs_changed()) {
+		if_addrs_clear();
+	}
+	for (;;) {
+		if (n_if_addrs < 0) {
+			if (load_if_addrs() < 0) {
+				return -1;
+			}
+			loaded = 1;
+		}
+		best = -1;
+		for (i = 0; i < n_if_addrs; i++) {
+			const struct netlink_addr *a = &if_addrs[i];
+
+			if (a->family != family
+			||	!prefix_match(a->addr, addr, a->prefixlen)) {
+				continue;
+			}
+			if (best < 0
+			||	NETLINK_PREFIX_RANK(maxlen, a->prefixlen
+				,	a->ifindex, oif)
+			>	NETLINK_PREFIX_RANK(maxlen
+				,	if_addrs[best].prefixlen
+				,	if_addrs[best].ifindex, oif)) {
+				best = i;
+			}
+		}
+		if (best >= 0) {
+			*prefixlen = if_addrs[best].prefixlen;
+			*ifindex = if_addrs[best].ifindex;
+			return 0;
+		}
+		if (loaded) {
+			return -1;
+		}
+		if_addrs_clear();
+	}
+}
+
+/*
+ * netlink_find_route --- the interface and prefix length of the route
+ * of addr, an address of family
+ *
+ * oif, if not 0, is the interface the route must go out of; link-local
+ * IPv6 addresses need one.
+ *
+ * Return code: as SearchRoute.
+ */
+static int
+netlink_find_route(int family, const void *addr, int oif, char *address
+,	char *best_if, size_t best_iflen, int *prefixlen
+,	char *errmsg, int errmsglen)
+{
+	struct {
+		struct nlmsghdr	nh;
+		struct rtmsg	rtm;
+		char		attrs[64];
+	} req;
+	struct netlink_route	route;
+	int	addrlen = family == AF_INET6 ? 16 : 4;
+	char	ifname[IF_NAMESIZE];
+	int	rc;
+
+	if (RouteDir != NULL) {
+		/* the kernel does not have the tables of -p */
+		return(-1);
+	}
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rtm));
+	req.nh.nlmsg_type = RTM_GETROUTE;
+	req.nh.nlmsg_flags = NLM_F_REQUEST;
+	req.rtm.rtm_family = family;
+	req.rtm.rtm_dst_len = addrlen * 8;
+	req.rtm.rtm_flags = RTM_F_FIB_MATCH;
+	netlink_add_attr((struct nlmsghdr *)&req, sizeof(req)
+	,	RTA_DST, addr, addrlen);
+	if (oif != 0) {
+		netlink_add_attr((struct nlmsghdr *)&req, sizeof(req)
+		,	RTA_OIF, &oif, sizeof(oif));
+	}
+
+	memset(&route, 0, sizeof(route));
+	rc = netlink_query(&req.nh, netlink_route_cb, &route);
+	/* unreachable, prohibit and blackhole routes */
+	if (rc == -ENETUNREACH || rc == -EHOSTUNREACH || rc == -EACCES
+	||	rc == -EINVAL) {
+		snprintf(errmsg, errmsglen, "No route to %s\n", address);
+		return(OCF_ERR_GENERIC);
+	}
+	if (rc < 0 || route.type == 0 || (route.flags & RTM_F_CLONED)) {
+		/* no netlink, or no RTM_F_FIB_MATCH */
+		return(-1);
+	}
+
+	switch (route.type) {
+	case RTN_UNICAST:
+		break;
+	case RTN_LOCAL:
+	case RTN_BROADCAST:
+	case RTN_ANYCAST:
+	{
+		/*
+		 * The address is on this host already, as it is while
+		 * the resource runs, and the route of the local table is
+		 * a host route. The prefix of the address on the
+		 * interface is what /proc/net/route has.
+		 */
+		int	plen, ifindex;
+
+		if (if_addr_prefix(family, addr, oif ? oif : route.oif
+		,	&plen, &ifindex) == 0) {
+			route.prefixlen = plen;
+			route.oif = ifindex;
+		}
+		break;
+	}
+	default:
+		/* blackhole, unreachable, prohibit, ... */
+		snprintf(errmsg, errmsglen, "No route to %s\n", address);
+		return(OCF_ERR_GENERIC);
+	}
+
+	if (route.oif == 0 || findif_indextoname(route.oif, ifname) == NULL) {
+		snprintf(errmsg, errmsglen, "No interface found.");
+		return(OCF_ERR_GENERIC);
+	}
+	strncpy(best_if, ifname, best_iflen);
+	*prefixlen = route.prefixlen;
+	return(OCF_SUCCESS);
+}
+
+static int
+SearchUsingNetlink (char *address, struct in_addr *in
+,	struct in_addr *addr_out, char *best_if, size_t best_iflen
+,	unsigned long *best_netmask
+,	char *errmsg, int errmsglen)
+{
+	int	prefixlen, rc;
+
+	rc = netlink_find_route(AF_INET, in, 0, address, best_if, best_iflen
+	,	&prefixlen, errmsg, errmsglen);
+	if (rc == OCF_SUCCESS) {
+		*best_netmask = prefixlen == 0 ? 0
+		:	htonl(0xffffffffUL << (32 - prefixlen));
+	}
+	return(rc);
+}
+
+static int
+SearchUsingNetlink6 (char *address, struct in6_addr *in6, int oif
+,	char *best_if, size_t best_iflen, int *best_prefixlen
+,	char *errmsg, int errmsglen)
+{
+	return netlink_find_route(AF_INET6, in6, oif, address, best_if
+	,	best_iflen, best_prefixlen, errmsg, errmsglen);
+}
+
+/*
+ * The route index
+ *
+ * It is loaded on the first lookup, which costs a dump of the routing
+ * table, and looked up in O(prefix length) after that. In batch mode it
+ * follows the changes of the kernel tables from netlink events.
+ */
+static struct rt_index *route_index;
+
+static int index_load_tables(struct rt_index *idx);
+
+/* the index, current, or NULL if it cannot be loaded */
+static struct rt_index *
+get_route_index(void)
+{
+	if (route_index == NULL) {
+		int	rc;
+
+		if ((route_index = rt_index_new()) == NULL) {
+			return NULL;
+		}
+		if (RouteDir != NULL) {
+			rc = index_load_tables(route_index);
+		}else{
+			/*
+			 * Without the events, the index would be as old as
+			 * the run: then it is not available, and the next
+			 * mechanism answers.
+			 */
+			rc = BatchMode ? rt_index_subscribe(route_index) : 0;
+			if (rc >= 0) {
+				rc = rt_index_load(route_index);
+			}
+		}
+		if (rc < 0) {
+			rt_index_free(route_index);
+			route_index = NULL;
+		}
+	}else if (RouteDir == NULL) {
+		int	rc = rt_index_update(route_index);
+
+		if (rc < 0) {
+			rt_index_free(route_index);
+			route_index = NULL;
+			return get_route_index();
+		}
+		if (rc > 0) {
+			/* the addresses may have changed too */
+			if_addrs_clear();
+		}
+	}
+	return route_index;
+}
+
+static int
+index_find_route(int family, const void *addr, int oif, char *address
+,	char *best_if, size_t best_iflen, int *prefixlen
+,	char *errmsg, int errmsglen)
+{
+	struct rt_index	*idx = get_route_index();
+	struct rt_match	m;
+	const char	*ifname;
+
+	if (idx == NULL) {
+		return(-1);
+	}
+	if (rt_index_lookup(idx, family, addr, oif, &m) < 0
+	||	(m.type != RTN_UNICAST && m.type != RTN_LOCAL)) {
+		/* no route, or blackhole, unreachable, prohibit, ... */
+		snprintf(errmsg, errmsglen, "No route to %s\n", address);
+		return(OCF_ERR_GENERIC);
+	}
+	if ((ifname = rt_index_ifname(idx, m.ifindex)) == NULL) {
+		snprintf(errmsg, errmsglen, "No interface found.");
+		return(OCF_ERR_GENERIC);
+	}
+	strncpy(best_if, ifname, best_iflen);
+	*prefixlen = m.prefixlen;
+	return(OCF_SUCCESS);
+}
+
+static int
+SearchUsingIndex (char *address, struct in_addr *in
+,	struct in_addr *addr_out, char *best_if, size_t best_iflen
+,	unsigned long *best_netmask
+,	char *errmsg, int errmsglen)
+{
+	int	prefixlen, rc;
+
+	rc = index_find_route(AF_INET, in, 0, address, best_if, best_iflen
+	,	&prefixlen, errmsg, errmsglen);
+	if (rc == OCF_SUCCESS) {
+		*best_netmask = prefixlen == 0 ? 0
+		:	htonl(0xffffffffUL << (32 - prefixlen));
+	}
+	return(rc);
+}
+
+static int
+SearchUsingIndex6 (char *address, struct in6_addr *in6, int oif
+,	char *best_if, size_t best_iflen, int *best_prefixlen
+,	char *errmsg, int errmsglen)
+{
+	return index_find_route(AF_INET6, in6, oif, address, best_if
+	,	best_iflen, best_prefixlen, errmsg, errmsglen);
+}
+#endif /* HAVE_LINUX_RTNETLINK_H */
+
+/* path, a file of /proc/net, or the same file under the -p directory */
+static const char *
+route_table(const char *path)
+{
+	static char	buf[PATH_MAX];
+
+	if (RouteDir == NULL) {
+		return path;
+	}
+	snprintf(buf, sizeof(buf), "%s%s", RouteDir, path + strlen("/proc"));
+	return buf;
+}
+
+/*
+ * The routes of /proc/net/route, read on the first lookup and kept for
+ * the following addresses.
+ */
+struct proc_route {
+	char		ifname[IF_NAMESIZE];
+	unsigned long	dest;
+	unsigned long	mask;
+	long		metric;
+};
+static struct proc_route *proc_routes;
+static int	n_proc_routes = -1;
+
+static int
+load_proc_routes(char *errmsg, int errmsglen)
+{
+	unsigned long	flags, refcnt, use, gw;
+	struct proc_route	r;
+	int		size = 0, n = 0;
+	int		rc = OCF_SUCCESS;
+	char	buf[2048];
+	char	interface[MAXSTR];
+	const char	*path = route_table(PROCROUTE);
+	FILE *routefd = NULL;
+
+	if ((routefd = fopen(path, "r")) == NULL) {
+		snprintf(errmsg, errmsglen
+		,	"Cannot open %s for reading"
+		,	path);
+		return(OCF_ERR_GENERIC);
+	}
+
+	/* Skip first (header) line */
+	if (fgets(buf, sizeof(buf), routefd) == NULL) {
+		snprintf(errmsg, errmsglen
+		,	"Cannot skip first line from %s"
+		,	path);
+		rc = OCF_ERR_GENERIC; goto out;
+	}
+	while (fgets(buf, sizeof(buf), routefd) != NULL) {
+		if (sscanf(buf, "%[^\t]\t%lx%lx%lx%lx%lx%lx%lx"
+		,	interface, &r.dest, &gw, &flags, &refcnt, &use
+		,	&r.metric, &r.mask)
+		!= 8) {
+			snprintf(errmsg, errmsglen, "Bad line in %s: %s"
+			,	path, buf);
+			rc = OCF_ERR_GENERIC; goto out;
+		}
+		strncpy(r.ifname, interface, sizeof(r.ifname));
+		r.ifname[sizeof(r.ifname) - 1] = EOS;
+		if (n == size) {
+			struct proc_route *p;
+
+			size = size ? size * 2 : 64;
+			p = realloc(proc_routes, size * sizeof(*p));
+			if (p == NULL) {
+				snprintf(errmsg, errmsglen, "%s", strerror(errno));
+				rc = OCF_ERR_GENERIC; goto out;
+			}
+			proc_routes = p;
+		}
+		proc_routes[n++] = r;
+	}
+	n_proc_routes = n;
+
+  out:
+	fclose(routefd);
+	return(rc);
+}
+
+static int
+SearchUsingProcRoute (char *address, struct in_addr *in
+, 	struct in_addr *addr_out, char *best_if, size_t best_iflen
+,	unsigned long *best_netmask
+,	char *errmsg, int errmsglen)
+{
+	long		best_metric = LONG_MAX;
+	int		i, rc;
+
+	if (n_proc_routes < 0
+	&&	(rc = load_proc_routes(errmsg, errmsglen)) != OCF_SUCCESS) {
+		return(rc);
+	}
+
+	*best_netmask = 0;
+	for (i = 0; i < n_proc_routes; i++) {
+		struct proc_route *r = &proc_routes[i];
+
+		/* the longest prefix, and the lowest metric among those */
+		if ( (in->s_addr&r->mask) == (in_addr_t)(r->dest&r->mask)
+		&&	(best_metric == LONG_MAX || r->mask > *best_netmask
+		||	(r->mask == *best_netmask && r->metric <= best_metric))) {
+			best_metric = r->metric;
+			*best_netmask = r->mask;
+			strncpy(best_if, r->ifname, best_iflen);
+		}
+	}
+
+	if (best_metric == LONG_MAX) {
+		snprintf(errmsg, errmsglen, "No route to %s\n", address);
+		return(OCF_ERR_GENERIC);
+	}
+	return(OCF_SUCCESS);
+}
+
+/*
+ * SearchUsingProcRoute6 --- the longest prefix of /proc/net/ipv6_route
+ *
+ * Each line is
+ *	<dest> <plen> <src> <src plen> <nexthop> <metric> <refcnt> <use>
+ *	<flags> <ifname>
+ * with the addresses in 32 hex digits. The routes of the local table
+ * (RTF_LOCAL) are skipped, as /proc/net/route does not have them, and a
+ * host route (/128) of an address is taken only if nothing else
+ * matches, as with netlink.
+ */
+#define	FINDIF_RTF_REJECT	0x0200
+#define	FINDIF_RTF_LOCAL	0x80000000
+#define	FINDIF_PREFIX_RANK(len)	((len) == 128 ? 0 : (len) + 1)
+
+struct proc_route6 {
+	char		ifname[IF_NAMESIZE];
+	struct in6_addr	dest;
+	int		plen;
+	unsigned long	metric;
+	unsigned long	flags;
+};
+static struct proc_route6 *proc_routes6;
+static int	n_proc_routes6 = -1;
+
+/* Return code: as SearchRoute */
+static int
+load_proc_routes6(char *errmsg, int errmsglen)
+{
+	char	buf[512];
+	char	dest[33], interface[MAXSTR];
+	struct proc_route6	r;
+	int	size = 0, n = 0;
+	int	rc = OCF_SUCCESS;
+	const char	*path = route_table(PROCROUTE6);
+	FILE *routefd = NULL;
+
+	if ((routefd = fopen(path, "r")) == NULL) {
+		snprintf(errmsg, errmsglen
+		,	"Cannot open %s for reading"
+		,	path);
+		return(-1);
+	}
+
+	while (fgets(buf, sizeof(buf), routefd) != NULL) {
+		int		i;
+
+		if (sscanf(buf, "%32s %x %*s %*s %*s %lx %*s %*s %lx %127s"
+		,	dest, &r.plen, &r.metric, &r.flags, interface) != 5
+		||	strlen(dest) != 32) {
+			snprintf(errmsg, errmsglen, "Bad line in %s: %s"
+			,	path, buf);
+			rc = OCF_ERR_GENERIC; goto out;
+		}
+		for (i = 0; i < 16; i++) {
+			unsigned int	byte;
+
+			sscanf(dest + i * 2, "%2x", &byte);
+			r.dest.s6_addr[i] = byte;
+		}
+		strncpy(r.ifname, interface, sizeof(r.ifname));
+		r.ifname[sizeof(r.ifname) - 1] = EOS;
+		if (n == size) {
+			struct proc_route6 *p;
+
+			size = size ? size * 2 : 64;
+			p = realloc(proc_routes6, size * sizeof(*p));
+			if (p == NULL) {
+				snprintf(errmsg, errmsglen, "%s", strerror(errno));
+				rc = OCF_ERR_GENERIC; goto out;
+			}
+			proc_routes6 = p;
+		}
+		proc_routes6[n++] = r;
+	}
+	n_proc_routes6 = n;
+
+  out:
+	fclose(routefd);
+	return(rc);
+}
+
+static int
+SearchUsingProcRoute6 (char *address, struct in6_addr *in6, int oif
+,	char *best_if, size_t best_iflen, int *best_prefixlen
+,	char *errmsg, int errmsglen)
+{
+	char	oifname[IF_NAMESIZE] = "";
+	unsigned long	best_metric = 0, best_flags = 0;
+	int	i, best_plen = -1;
+	int	rc;
+
+	if (oif != 0 && findif_indextoname(oif, oifname) == NULL) {
+		snprintf(errmsg, errmsglen, "No interface found.");
+		return(OCF_ERR_GENERIC);
+	}
+	if (n_proc_routes6 < 0
+	&&	(rc = load_proc_routes6(errmsg, errmsglen)) != OCF_SUCCESS) {
+		return(rc);
+	}
+
+	for (i = 0; i < n_proc_routes6; i++) {
+		struct proc_route6 *r = &proc_routes6[i];
+
+		if ((r->flags & FINDIF_RTF_LOCAL)
+		||	(oif != 0 && strcmp(r->ifname, oifname) != 0)
+		||	!prefix_match(&r->dest, in6, r->plen)) {
+			continue;
+		}
+		if (best_plen < 0
+		||	FINDIF_PREFIX_RANK(r->plen) > FINDIF_PREFIX_RANK(best_plen)
+		||	(r->plen == best_plen && r->metric < best_metric)) {
+			best_plen = r->plen;
+			best_metric = r->metric;
+			best_flags = r->flags;
+			strncpy(best_if, r->ifname, best_iflen);
+		}
+	}
+
+	*best_prefixlen = best_plen;
+	if (best_plen < 0 || (best_flags & FINDIF_RTF_REJECT)) {
+		snprintf(errmsg, errmsglen, "No route to %s\n", address);
+		return(OCF_ERR_GENERIC);
+	}
+	return(OCF_SUCCESS);
+}
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+/* the index of ifname in idx, which is given one if it has none */
 static int
-SearchUsingProcRoute (char *address, struct in_addr *in
-, 	struct in_addr *addr_out, char *best_if, size_t best_iflen
-,	unsigned long *best_netmask
-,	char *errmsg, int errmsglen)
+index_table_link(struct rt_index *idx, const char *ifname)
 {
-	unsigned long	flags, refcnt, use, gw, mask;
-	unsigned long   dest;
-	long		metric = LONG_MAX;
-	long		best_metric = LONG_MAX;
-	int		rc = OCF_SUCCESS;
-	
-	char	buf[2048];
-	char	interface[MAXSTR];
-	FILE *routefd = NULL;
+	int	i;
+	const char	*name;
 
-	if ((routefd = fopen(PROCROUTE, "r")) == NULL) {
-		snprintf(errmsg, errmsglen
-		,	"Cannot open %s for reading"
-		,	PROCROUTE);
-		rc = OCF_ERR_GENERIC; goto out;
+	for (i = 1; (name = rt_index_ifname(idx, i)) != NULL; i++) {
+		if (strcmp(name, ifname) == 0) {
+			return i;
+		}
 	}
+	return rt_index_set_link(idx, i, ifname, IFF_UP) < 0 ? -1 : i;
+}
 
-	/* Skip first (header) line */
-	if (fgets(buf, sizeof(buf), routefd) == NULL) {
-		snprintf(errmsg, errmsglen
-		,	"Cannot skip first line from %s"
-		,	PROCROUTE);
-		rc = OCF_ERR_GENERIC; goto out;
+/*
+ * index_load_tables --- fill the route index from the tables of -p,
+ * as the proc mechanism reads them, so that both answer from the same
+ * routes
+ *
+ * The IPv6 table may be left out. Return code: 0, or -1.
+ */
+static int
+index_load_tables(struct rt_index *idx)
+{
+	char	errmsg[MAXSTR];
+	int	i, ifindex = -1;
+	const char	*ifname = NULL;
+
+	if (n_proc_routes < 0
+	&&	load_proc_routes(errmsg, sizeof(errmsg)) != OCF_SUCCESS) {
+		return -1;
 	}
-	*best_netmask = 0;
-	while (fgets(buf, sizeof(buf), routefd) != NULL) {
-		if (sscanf(buf, "%[^\t]\t%lx%lx%lx%lx%lx%lx%lx"
-		,	interface, &dest, &gw, &flags, &refcnt, &use
-		,	&metric, &mask)
-		!= 8) {
-			snprintf(errmsg, errmsglen, "Bad line in %s: %s"
-			,	PROCROUTE, buf);
-			rc = OCF_ERR_GENERIC; goto out;
+	for (i = 0; i < n_proc_routes; i++) {
+		struct proc_route *r = &proc_routes[i];
+		in_addr_t	dest = r->dest & r->mask;
+
+		/* the routes of an interface come together */
+		if (ifname == NULL || strcmp(ifname, r->ifname) != 0) {
+			ifname = r->ifname;
+			ifindex = index_table_link(idx, ifname);
 		}
-		if ( (in->s_addr&mask) == (in_addr_t)(dest&mask)
-		&&	metric <= best_metric && mask >= *best_netmask) {
-			best_metric = metric;
-			*best_netmask = mask;
-			strncpy(best_if, interface, best_iflen);
+		if (ifindex < 0
+		||	rt_index_add_route(idx, AF_INET, &dest
+			,	netmask_bits(ntohl(r->mask)), RTN_UNICAST
+			,	ifindex, r->metric) < 0) {
+			return -1;
 		}
 	}
 
-	if (best_metric == LONG_MAX) {
-		snprintf(errmsg, errmsglen, "No route to %s\n", address);
-		rc = OCF_ERR_GENERIC; 
+	if (n_proc_routes6 < 0
+	&&	load_proc_routes6(errmsg, sizeof(errmsg)) != OCF_SUCCESS) {
+		return 0;
 	}
+	ifname = NULL;
+	for (i = 0; i < n_proc_routes6; i++) {
+		struct proc_route6 *r = &proc_routes6[i];
 
-  out:
-	if (routefd) {
-		fclose(routefd);
+		if (r->flags & FINDIF_RTF_LOCAL) {
+			continue;
+		}
+		if (ifname == NULL || strcmp(ifname, r->ifname) != 0) {
+			ifname = r->ifname;
+			ifindex = index_table_link(idx, ifname);
+		}
+		if (ifindex < 0
+		||	rt_index_add_route(idx, AF_INET6, &r->dest, r->plen
+			,	(r->flags & FINDIF_RTF_REJECT) ? RTN_UNREACHABLE
+				:	RTN_UNICAST
+			,	ifindex, r->metric) < 0) {
+			return -1;
+		}
 	}
-
-	return(rc);
+	return 0;
 }
+#endif /* HAVE_LINUX_RTNETLINK_H */
 
 static int
 SearchUsingRouteCmd (char *address, struct in_addr *in
@@ -245,6 +1246,10 @@ SearchUsingRouteCmd (char *address, struct in_addr *in
 	FILE *routefd = NULL;
 	uint32_t maskbits;
 
+	if (RouteDir != NULL) {
+		/* route asks the kernel, which does not have the tables of -p */
+		return(-1);
+	}
 	
 	/* Open route and get the information */
 	snprintf (routecmd, sizeof(routecmd), "%s %s %s"
@@ -271,7 +1276,8 @@ SearchUsingRouteCmd (char *address, struct in_addr *in
 			/*strsep(&cp, ":");cp++;*/
 			cp = strtok(buf, ":");
 			cp = strtok(NULL, ":");cp++;
-			strncpy(mask, cp, sizeof(mask));
+			strncpy(mask, cp, sizeof(mask) - 1);
+			mask[sizeof(mask) - 1] = EOS;
                   	done++;
 		}
 
@@ -279,11 +1285,12 @@ SearchUsingRouteCmd (char *address, struct in_addr *in
 			/*strsep(&cp, ":");cp++;*/
 			cp = strtok(buf, ":");
 			cp = strtok(NULL, ":");cp++;
-			strncpy(interface, cp, sizeof(interface));
+			strncpy(interface, cp, sizeof(interface) - 1);
+			interface[sizeof(interface) - 1] = EOS;
                   	done++;
 		}
 	}
-	fclose(routefd);
+	pclose(routefd);
 
 	/*
 	 * Check to see if mask isn't available.  It may not be
@@ -371,7 +1378,10 @@ GetAddress (char **address, char **netmaskbits
 	*if_specified = getenv("OCF_RESKEY_nic");
 }
 
-void
+/*
+ * Return code: 0, or -1 if netmaskbits is not a valid netmask
+ */
+int
 ValidateNetmaskBits (char *netmaskbits, unsigned long *netmask)
 {
 	if (netmaskbits != NULL && *netmaskbits != EOS) {
@@ -381,20 +1391,12 @@ ValidateNetmaskBits (char *netmaskbits, unsigned long *netmask)
 
 		if (nmblen > 2 || nmblen == 0
 		||	(strspn(netmaskbits, "0123456789") != nmblen)) {
-			fprintf(stderr, "Invalid netmask specification"
-			" [%s]", netmaskbits);
-			usage(OCF_ERR_CONFIGURED);
-			/*not reached */
+			return -1;
 		}else{
 			unsigned long	bits = atoi(netmaskbits);
 
 			if (bits < 1 || bits > 32) {
-				fprintf(stderr
-				,	"Invalid netmask specification [%s]"
-				,	netmaskbits);
-				usage(OCF_ERR_CONFIGURED);
-				/*not reached */
-				exit(1);
+				return -1;
 			}
 
 			bits = 32 - bits;
@@ -403,16 +1405,17 @@ ValidateNetmaskBits (char *netmaskbits, unsigned long *netmask)
 			*netmask = htonl(*netmask);
 		}
 	}
+	return 0;
 }
 
 int
-ValidateIFName(const char *ifname, struct ifreq *ifr) 
+ValidateIFName(const char *ifname, struct ifreq *ifr
+,	char *errmsg, int errmsglen)
 {
- 	int skfd = -1;
 	char *colonptr;
 
- 	if ( (skfd = socket(PF_INET, SOCK_DGRAM, 0)) == -1 ) {
- 		fprintf(stderr, "%s\n", strerror(errno));
+ 	if (ifreq_socket() == -1) {
+ 		snprintf(errmsg, errmsglen, "%s\n", strerror(errno));
  		return -2;
  	}
  
@@ -424,14 +1427,12 @@ ValidateIFName(const char *ifname, struct ifreq *ifr)
 		  ifr->ifr_name);
 	}
  
- 	if (ioctl(skfd, SIOCGIFFLAGS, ifr) < 0) {
- 		fprintf(stderr, "%s: unknown interface: %s\n"
+ 	if (ioctl(ifreq_fd, SIOCGIFFLAGS, ifr) < 0) {
+ 		snprintf(errmsg, errmsglen, "%s: unknown interface: %s\n"
  			, ifr->ifr_name, strerror(errno));
- 		close(skfd);
 		/* return -1 only if ifname is known to be invalid */
 		return -1;
  	}
- 	close(skfd);
  	return 0;
 } 
 
@@ -463,6 +1464,15 @@ get_first_loopback_netdev(char * output)
 		goto out;
 	}
 
+	/*
+	 * Linux gives the loopback device the index 1 in every namespace,
+	 * so two ioctls find it without reading the list.
+	 */
+	if (findif_indextoname(1, buf) != NULL && is_loopback_interface(buf)) {
+		strncpy(output, buf, IFNAMSIZ - 1);
+		output[IFNAMSIZ - 1] = '\0';
+		return output;
+	}
 	fd = fopen(PATH_PROC_NET_DEV, "r");
 	if (!fd) {
 		fprintf(stderr, "Warning: cannot open %s (%s).\n",
@@ -501,8 +1511,9 @@ int
 is_loopback_interface(char * ifname)
 {
 	struct ifreq ifr;
+	char errmsg[MAXSTR];
 	memset(&ifr, 0, sizeof(ifr));
-	if (ValidateIFName(ifname, &ifr) < 0)
+	if (ValidateIFName(ifname, &ifr, errmsg, sizeof(errmsg)) < 0)
 		return 0;
 
 	if (ifr.ifr_flags & IFF_LOOPBACK) {
@@ -557,61 +1568,52 @@ int ConvertQuadToInt(char *dest)
         return (bits);
 }
 
-int
-main(int argc, char ** argv) {
+/*
+ * config_error --- a parameter of the address is wrong
+ *
+ * Out of batch mode this ends findif with errmsg and the usage, as it
+ * always did.
+ */
+static int
+config_error(const char *errmsg)
+{
+	if (!BatchMode) {
+		fprintf(stderr, "%s", errmsg);
+		usage(OCF_ERR_CONFIGURED);
+		/* not reached */
+	}
+	return(OCF_ERR_CONFIGURED);
+}
 
-	char *	address = NULL;
-	char *	bcast_arg = NULL;
-	char *	netmaskbits = NULL;
+/*
+ * FindIF --- find the interface, netmask and broadcast address of an
+ * IPv4 address
+ *
+ * The output line, without a newline, goes to result and, on an error,
+ * the message to errmsg. The return code is the exit code of findif.
+ */
+static int
+FindIF(char *address, char *netmaskbits, char *bcast_arg
+,	char *if_specified, const char *mechanism
+,	char *result, int resultlen, char *errmsg, int errmsglen)
+{
 	struct in_addr	in;
 	struct in_addr	addr_out;
 	unsigned long	netmask;
 	char	best_if[MAXSTR];
-	char *	if_specified = NULL;
 	struct ifreq	ifr;
 	unsigned long	best_netmask = INT_MAX;
-	int		argerrs	= 0;
-
-	cmdname=argv[0];
-
 
 	memset(&addr_out, 0, sizeof(addr_out));
 	memset(&in, 0, sizeof(in));
 	memset(&ifr, 0, sizeof(ifr));
 
-	switch (argc) {
-	case 1:	/* No -C argument */
-		break;
-	case 2: /* Hopefully a -C argument */
-		if (strncmp(argv[1], "-C", sizeof("-C")) != 0) {
-			argerrs=1;
-		}
-		OutputInCIDR=1;
-		break;
-	default:
-		argerrs=1;
-		break;
-	}
-	if (argerrs) {
-		usage(OCF_ERR_ARGS);
-		/* not reached */
-		return(1);
-	}
-
-	GetAddress (&address, &netmaskbits, &bcast_arg
-	,	 &if_specified);
-	if (address == NULL || *address == EOS) {
-		fprintf(stderr, "ERROR: IP address parameter is mandatory.");
-		usage(OCF_ERR_CONFIGURED);
-		/* not reached */
-	}
-
 	/* Is the IP address we're supposed to find valid? */
 	 
 	if (inet_pton(AF_INET, address, (void *)&in) <= 0) {
-		fprintf(stderr, "IP address [%s] not valid.", address);
-		usage(OCF_ERR_CONFIGURED);
-		/* not reached */
+		snprintf(errmsg, errmsglen, "IP address [%s] not valid."
+		,	address);
+		return config_error(errmsg);
 	}
 
 	if(netmaskbits != NULL && *netmaskbits != EOS
@@ -622,36 +1624,44 @@ main(int argc, char ** argv) {
 	}
 	
 	/* Validate the netmaskbits field */
-	ValidateNetmaskBits (netmaskbits, &netmask);
+	if (ValidateNetmaskBits (netmaskbits, &netmask) < 0) {
+		snprintf(errmsg, errmsglen, "Invalid netmask specification"
+		" [%s]", netmaskbits);
+		return config_error(errmsg);
+	}
 
 	if (if_specified != NULL && *if_specified != EOS) {
-		if(ValidateIFName(if_specified, &ifr) < 0) {
-			usage(OCF_ERR_CONFIGURED);
-			/* not reached */
+		if(ValidateIFName(if_specified, &ifr, errmsg, errmsglen) < 0) {
+			return config_error(errmsg);
 		}
 		strncpy(best_if, if_specified, sizeof(best_if));
 		*(best_if + sizeof(best_if) - 1) = '\0';
 	}else{
-		SearchRoute **sr = search_mechs;
-		char errmsg[MAXSTR] = "No valid mecahnisms";
+		int i;
 		int rc = OCF_ERR_GENERIC;
 
+		snprintf(errmsg, errmsglen, "No valid mecahnisms");
 		strcpy(best_if, "UNKNOWN");
 
-		while (*sr) {
+		for (i = 0; search_mechs[i].name != NULL; i++) {
+			if (mechanism != NULL
+			&&	strcmp(search_mechs[i].name, mechanism) != 0) {
+				continue;
+			}
 			errmsg[0] = '\0';
-			rc = (*sr) (address, &in, &addr_out, best_if
-			,	sizeof(best_if)
-			,	&best_netmask, errmsg, sizeof(errmsg));
+			rc = search_mechs[i].search (address, &in, &addr_out
+			,	best_if, sizeof(best_if)
+			,	&best_netmask, errmsg, errmsglen);
 			if (!rc) {		/* Mechanism worked */
 				break;
 			}
-			sr++;
+		}
+		if (rc < 0) {
+			snprintf(errmsg, errmsglen, "%s is not available.\n"
+			,	mechanism ? mechanism : "No mechanism");
+			rc = OCF_ERR_GENERIC;
 		}
 		if (rc != 0) {	/* No route, or all mechanisms failed */
-			if (*errmsg) {
-				fprintf(stderr, "%s", errmsg);
-			}
 			return(rc);
 		}
 	}
@@ -668,11 +1678,12 @@ main(int argc, char ** argv) {
 			if (NULL != get_first_loopback_netdev(best_if)) {
 				best_netmask = 0x000000ff;
 			} else {
-				fprintf(stderr, "No loopback interface found.\n");
+				snprintf(errmsg, errmsglen
+				,	"No loopback interface found.\n");
 				return(OCF_ERR_GENERIC);
 			}
 		} else {
-			fprintf(stderr
+			snprintf(errmsg, errmsglen
 			,	"ERROR: Cannot use default route w/o netmask [%s]\n"
 			,	 address);
 			return(OCF_ERR_GENERIC);
@@ -687,14 +1698,15 @@ main(int argc, char ** argv) {
 		 */
  		struct in_addr bcast_addr;
  		if (inet_pton(AF_INET, bcast_arg, (void *)&bcast_addr) <= 0) {
- 			fprintf(stderr, "Invalid broadcast address [%s].", bcast_arg);
- 			usage(OCF_ERR_CONFIGURED);
-			/* not reached */
+ 			snprintf(errmsg, errmsglen
+			,	"Invalid broadcast address [%s].", bcast_arg);
+			return config_error(errmsg);
  		}
 
 		best_netmask = htonl(best_netmask);
 		if (!OutputInCIDR) {
-			printf("%s\tnetmask %d.%d.%d.%d\tbroadcast %s\n"
+			snprintf(result, resultlen
+			,	"%s\tnetmask %d.%d.%d.%d\tbroadcast %s"
 			,	best_if
                 	,       (int)((best_netmask>>24) & 0xff)
                 	,       (int)((best_netmask>>16) & 0xff)
@@ -702,7 +1714,8 @@ main(int argc, char ** argv) {
                 	,       (int)(best_netmask & 0xff)
 			,	bcast_arg);
 		}else{
-			printf("%s\tnetmask %d\tbroadcast %s\n"
+			snprintf(result, resultlen
+			,	"%s\tnetmask %d\tbroadcast %s"
 			,	best_if
 			,	netmask_bits(best_netmask)
 			,	bcast_arg);
@@ -722,7 +1735,8 @@ main(int argc, char ** argv) {
 		best_netmask = htonl(best_netmask);
 		def_bcast = htonl(def_bcast);
 		if (!OutputInCIDR) {
-			printf("%s\tnetmask %d.%d.%d.%d\tbroadcast %d.%d.%d.%d\n"
+			snprintf(result, resultlen
+			,	"%s\tnetmask %d.%d.%d.%d\tbroadcast %d.%d.%d.%d"
 			,       best_if
 			,       (int)((best_netmask>>24) & 0xff)
 			,       (int)((best_netmask>>16) & 0xff)
@@ -733,7 +1747,8 @@ main(int argc, char ** argv) {
 			,       (int)((def_bcast>>8) & 0xff)
 			,       (int)(def_bcast & 0xff));
 		}else{
-			printf("%s\tnetmask %d\tbroadcast %d.%d.%d.%d\n"
+			snprintf(result, resultlen
+			,	"%s\tnetmask %d\tbroadcast %d.%d.%d.%d"
 			,       best_if
 			,	netmask_bits(best_netmask)
 			,       (int)((def_bcast>>24) & 0xff)
@@ -745,18 +1760,376 @@ main(int argc, char ** argv) {
 	return(0);
 }
 
+/*
+ * FindIF6 --- find the interface and prefix length of an IPv6 address
+ *
+ * The output is
+ *	<interface>	netmask <prefix length>	scope <scope>
+ * whether -C is given or not, and there is no broadcast address. A
+ * link-local address needs the interface. result and errmsg as FindIF.
+ */
+static int
+FindIF6(char *address, char *netmaskbits, char *bcast_arg
+,	char *if_specified, const char *mechanism
+,	char *result, int resultlen, char *errmsg, int errmsglen)
+{
+	struct in6_addr	in6;
+	char	best_if[MAXSTR];
+	int	prefixlen = -1;
+	int	oif = 0;
+	const char *scope;
+
+	if (inet_pton(AF_INET6, address, (void *)&in6) <= 0) {
+		snprintf(errmsg, errmsglen, "IP address [%s] not valid."
+		,	address);
+		return config_error(errmsg);
+	}
+	if (netmaskbits != NULL && *netmaskbits != EOS) {
+		size_t	nmblen = strnlen(netmaskbits, 4);
+
+		/* Maximum prefix length is 128 */
+		if (nmblen > 3 || strspn(netmaskbits, "0123456789") != nmblen
+		||	atoi(netmaskbits) < 1 || atoi(netmaskbits) > 128) {
+			snprintf(errmsg, errmsglen, "Invalid netmask"
+			" specification [%s]", netmaskbits);
+			return config_error(errmsg);
+		}
+		prefixlen = atoi(netmaskbits);
+	}
+	if (bcast_arg != NULL && *bcast_arg != EOS) {
+		fprintf(stderr, "Broadcast address [%s] ignored for IPv6.\n"
+		,	bcast_arg);
+	}
+
+	if (IN6_IS_ADDR_LOOPBACK(&in6)) {
+		scope = "host";
+	}else if (IN6_IS_ADDR_LINKLOCAL(&in6)) {
+		scope = "link";
+	}else if (IN6_IS_ADDR_SITELOCAL(&in6)) {
+		scope = "site";
+	}else{
+		scope = "global";
+	}
+
+	if (if_specified != NULL && *if_specified != EOS) {
+		struct ifreq	ifr;
+
+		memset(&ifr, 0, sizeof(ifr));
+		if (ValidateIFName(if_specified, &ifr, errmsg, errmsglen) < 0) {
+			return config_error(errmsg);
+		}
+		oif = findif_nametoindex(if_specified);
+		strncpy(best_if, if_specified, sizeof(best_if));
+		*(best_if + sizeof(best_if) - 1) = '\0';
+	}else if (IN6_IS_ADDR_LINKLOCAL(&in6)) {
+		snprintf(errmsg, errmsglen, "Link-local address [%s] needs"
+		" OCF_RESKEY_nic.\n", address);
+		return(OCF_ERR_CONFIGURED);
+	}
+
+	if (prefixlen < 0) {
+		char	found_if[MAXSTR] = "UNKNOWN";
+		int	i, rc = -1;
+
+		for (i = 0; search6_mechs[i].name != NULL; i++) {
+			if (mechanism != NULL
+			&&	strcmp(search6_mechs[i].name, mechanism) != 0) {
+				continue;
+			}
+			errmsg[0] = '\0';
+			rc = search6_mechs[i].search (address, &in6, oif
+			,	found_if, sizeof(found_if)
+			,	&prefixlen, errmsg, errmsglen);
+			if (!rc) {		/* Mechanism worked */
+				break;
+			}
+		}
+		if (rc < 0) {
+			snprintf(errmsg, errmsglen, "%s is not available.\n"
+			,	mechanism ? mechanism : "No mechanism");
+			rc = OCF_ERR_GENERIC;
+		}
+		if (rc != 0) {	/* No route, or all mechanisms failed */
+			return(rc);
+		}
+		if (oif == 0) {
+			strncpy(best_if, found_if, sizeof(best_if));
+			*(best_if + sizeof(best_if) - 1) = '\0';
+		}
+		if (prefixlen == 0 && IN6_IS_ADDR_LOOPBACK(&in6)) {
+			/* as for 127.x.x.x without a loopback route */
+			if (get_first_loopback_netdev(best_if) == NULL) {
+				snprintf(errmsg, errmsglen
+				,	"No loopback interface found.\n");
+				return(OCF_ERR_GENERIC);
+			}
+			prefixlen = 128;
+		}else if (prefixlen == 0) {
+			snprintf(errmsg, errmsglen
+			,	"ERROR: Cannot use default route w/o netmask [%s]\n"
+			,	 address);
+			return(OCF_ERR_GENERIC);
+		}
+	}
+
+	snprintf(result, resultlen, "%s\tnetmask %d\tscope %s"
+	,	best_if, prefixlen, scope);
+	return(0);
+}
+
+static int
+FindAddress(char *address, char *netmaskbits, char *bcast_arg
+,	char *if_specified, const char *mechanism
+,	char *result, int resultlen, char *errmsg, int errmsglen)
+{
+	*result = EOS;
+	*errmsg = EOS;
+	if (strchr(address, ':') != NULL) {
+		return FindIF6(address, netmaskbits, bcast_arg, if_specified
+		,	mechanism, result, resultlen, errmsg, errmsglen);
+	}
+	return FindIF(address, netmaskbits, bcast_arg, if_specified
+	,	mechanism, result, resultlen, errmsg, errmsglen);
+}
+
+/* for -t */
+static double
+now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * FindBatch --- look up each address of a file, as described at the top
+ *
+ * Return code: 0 when the whole file was read
+ */
+static int
+FindBatch(const char *file, const char *mechanism)
+{
+	FILE	*fp;
+	char	buf[1024];
+	char	result[MAXSTR*2];
+	char	errmsg[MAXSTR*2];
+	int	lineno = 0, naddrs = 0;
+	double	first_ns = 0, rest_ns = 0;
+
+	if (strcmp(file, "-") == 0) {
+		fp = stdin;
+	}else if ((fp = fopen(file, "r")) == NULL) {
+		fprintf(stderr, "Cannot open %s for reading: %s\n"
+		,	file, strerror(errno));
+		return(OCF_ERR_ARGS);
+	}
+	/* the caller may be waiting for each answer on a pipe */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		char	*address, *netmaskbits, *if_specified, *bcast_arg;
+		char	*cp;
+		int	rc;
+
+		++lineno;
+		if (strchr(buf, '\n') == NULL && !feof(fp)) {
+			int	ch;
+
+			while ((ch = getc(fp)) != EOF && ch != '\n') {
+				;
+			}
+			printf("-\t%d\tLine %d too long\n"
+			,	OCF_ERR_CONFIGURED, lineno);
+			continue;
+		}
+		address = strtok(buf, " \t\r\n");
+		if (address == NULL || *address == '#') {
+			continue;
+		}
+		if_specified = strtok(NULL, " \t\r\n");
+		bcast_arg = strtok(NULL, " \t\r\n");
+		if (if_specified != NULL && strcmp(if_specified, "-") == 0) {
+			if_specified = NULL;
+		}
+		if (bcast_arg != NULL && strcmp(bcast_arg, "-") == 0) {
+			bcast_arg = NULL;
+		}
+		if (strtok(NULL, " \t\r\n") != NULL) {
+			printf("%s\t%d\tToo many fields in line %d\n"
+			,	address, OCF_ERR_CONFIGURED, lineno);
+			continue;
+		}
+		if (strcmp(address, "generation") == 0) {
+#ifdef HAVE_LINUX_RTNETLINK_H
+			struct rt_index	*idx = get_route_index();
+
+			if (idx != NULL) {
+				printf("%s\t0\t%lu\n", address
+				,	rt_index_generation(idx));
+				continue;
+			}
+#endif
+			printf("%s\t%d\tindex is not available.\n"
+			,	address, OCF_ERR_GENERIC);
+			continue;
+		}
+		if ((netmaskbits = strchr(address, DELIM)) != NULL) {
+			*netmaskbits++ = EOS;
+		}
+
+		if (TimeBatch) {
+			double	t = now_ns();
+
+			rc = FindAddress(address, netmaskbits, bcast_arg
+			,	if_specified, mechanism, result, sizeof(result)
+			,	errmsg, sizeof(errmsg));
+			t = now_ns() - t;
+			if (naddrs++ == 0) {
+				first_ns = t;
+			}else{
+				rest_ns += t;
+			}
+		}else{
+			rc = FindAddress(address, netmaskbits, bcast_arg
+			,	if_specified, mechanism, result, sizeof(result)
+			,	errmsg, sizeof(errmsg));
+		}
+		if (rc == 0) {
+			printf("%s\t0\t%s\n", address, result);
+			continue;
+		}
+		/* one line, without the trailing newline */
+		for (cp = errmsg; *cp != EOS; cp++) {
+			if (*cp == '\n' || *cp == '\t') {
+				*cp = ' ';
+			}
+		}
+		while (cp > errmsg && cp[-1] == ' ') {
+			*--cp = EOS;
+		}
+		printf("%s\t%d\t%s\n", address, rc, errmsg);
+	}
+	if (fp != stdin) {
+		fclose(fp);
+	}
+	if (TimeBatch) {
+		fprintf(stderr, "addresses=%d first_us=%.0f lookup_ns=%.0f\n"
+		,	naddrs, first_ns / 1000
+		,	naddrs > 1 ? rest_ns / (naddrs - 1) : 0);
+	}
+	return(0);
+}
+
+int
+main(int argc, char ** argv) {
+
+	char *	address = NULL;
+	char *	bcast_arg = NULL;
+	char *	netmaskbits = NULL;
+	char *	if_specified = NULL;
+	char	result[MAXSTR*2];
+	char	errmsg[MAXSTR*2];
+	int		argerrs	= 0;
+	const char *	mechanism = NULL;
+	const char *	batchfile = NULL;
+	int		c, rc;
+
+	cmdname=argv[0];
+
+
+	while ((c = getopt(argc, argv, "Cm:f:p:t")) != -1) {
+		switch (c) {
+		case 'C':
+			OutputInCIDR=1;
+			break;
+		case 'm':
+			mechanism = optarg;
+			break;
+		case 'f':
+			batchfile = optarg;
+			break;
+		case 'p':
+			RouteDir = optarg;
+			break;
+		case 't':
+			TimeBatch = 1;
+			break;
+		default:
+			argerrs=1;
+			break;
+		}
+	}
+	if (optind != argc) {
+		argerrs=1;
+	}
+	if (mechanism != NULL) {
+		int	i;
+
+		for (i = 0; search_mechs[i].name != NULL; i++) {
+			if (strcmp(search_mechs[i].name, mechanism) == 0) {
+				break;
+			}
+		}
+		if (search_mechs[i].name == NULL) {
+			fprintf(stderr, "Unknown mechanism [%s].", mechanism);
+			argerrs=1;
+		}
+	}
+	if (argerrs) {
+		usage(OCF_ERR_ARGS);
+		/* not reached */
+		return(1);
+	}
+
+	if (batchfile != NULL) {
+		BatchMode = 1;
+		return FindBatch(batchfile, mechanism);
+	}
+
+	GetAddress (&address, &netmaskbits, &bcast_arg
+	,	 &if_specified);
+	if (address == NULL || *address == EOS) {
+		fprintf(stderr, "ERROR: IP address parameter is mandatory.");
+		usage(OCF_ERR_CONFIGURED);
+		/* not reached */
+	}
+
+	rc = FindAddress(address, netmaskbits, bcast_arg, if_specified
+	,	mechanism, result, sizeof(result), errmsg, sizeof(errmsg));
+	if (rc == 0) {
+		printf("%s\n", result);
+	}else if (*errmsg) {
+		fprintf(stderr, "%s", errmsg);
+	}
+	return(rc);
+}
+
 void
 usage(int ec)
 {
 	fprintf(stderr, "\n"
 		"%s version 2.99.1 Copyright Alan Robertson\n"
 		"\n"
-		"Usage: %s [-C]\n"
+		"Usage: %s [-C] [-m mechanism] [-f file [-t]] [-p dir]\n"
 		"Options:\n"
 		"    -C: Output netmask as the number of bits rather "
 			"than as 4 octets.\n"
+		"    -f: Read \"ip[/cidr_netmask] [nic [broadcast]]\" lines "
+			"from file (- for stdin)\n"
+		"        instead of the environment, and print a line "
+			"with the exit code\n"
+		"        for each.\n"
+		"    -m: Find the route only with mechanism: "
+#ifdef HAVE_LINUX_RTNETLINK_H
+			"netlink, index, "
+#endif
+			"proc or route.\n"
+		"    -p: Read the routes from dir/net/route and "
+			"dir/net/ipv6_route.\n"
+		"    -t: Print the time the addresses of -f took.\n"
 		"Environment variables:\n"
-		"OCF_RESKEY_ip		 ip address (mandatory!)\n"
+		"OCF_RESKEY_ip		 ip address, IPv4 or IPv6 (mandatory!)\n"
 		"OCF_RESKEY_cidr_netmask netmask of interface\n"
 		"OCF_RESKEY_broadcast	 broadcast address for interface\n"
 		"OCF_RESKEY_nic		 interface to assign to\n"
@@ -0,0 +1,863 @@
+/*
+ * findif_index.c: longest prefix match index of the routes and the
+ *	interface addresses, for findif
+ *
+ *	The routes of the main table and the addresses of the interfaces
+ *	are kept in path-compressed binary tries, one pair per address
+ *	family, so that an address is looked up in O(prefix length)
+ *	however many routes there are. The index is loaded with a netlink
+ *	dump and kept current from the netlink route, address and link
+ *	events.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#include <net/if.h>
+#include <netinet/in.h>
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+#include "findif_index.h"
+
+/*
+ * A node holds the routes (or addresses) of one prefix, or none if it
+ * only branches. The bits of key past plen are 0.
+ */
+struct rt_entry {
+	struct rt_entry	*next;
+	int		ifindex;
+	int		type;
+	unsigned	metric;
+	unsigned char	addr[];		/* an interface address */
+};
+
+struct rt_node {
+	struct rt_node	*child[2];
+	struct rt_entry	*entries;
+	int		plen;
+	unsigned char	key[16];
+};
+
+struct rt_link {
+	int		ifindex;
+	unsigned	flags;
+	char		name[IF_NAMESIZE];
+};
+
+struct rt_index {
+	struct rt_node	*routes[2];	/* AF_INET, AF_INET6 */
+	struct rt_node	*addrs[2];
+	struct rt_link	*links;
+	int		nlinks;
+	int		linksize;
+	unsigned long	generation;
+	unsigned long	nroutes;
+	unsigned long	nnodes;
+	int		fd;		/* the event socket */
+	int		reload;		/* an event was lost */
+};
+
+#define	FAMILY_INDEX(family)	((family) == AF_INET6)
+#define	FAMILY_BITS(family)	((family) == AF_INET6 ? 128 : 32)
+#define	KEY_BIT(key, i)		(((key)[(i) >> 3] >> (7 - ((i) & 7))) & 1)
+
+/* the number of leading bits, up to max, which a and b have in common */
+static int
+common_bits(const unsigned char *a, const unsigned char *b, int max)
+{
+	int	n;
+
+	for (n = 0; n < max; n += 8) {
+		unsigned char	x = a[n >> 3] ^ b[n >> 3];
+
+		if (x != 0) {
+			while (!(x & 0x80)) {
+				x <<= 1;
+				n++;
+			}
+			break;
+		}
+	}
+	return n < max ? n : max;
+}
+
+static struct rt_node *
+node_new(struct rt_index *idx, const unsigned char *key, int plen)
+{
+	struct rt_node	*n = calloc(1, sizeof(*n));
+
+	if (n == NULL) {
+		return NULL;
+	}
+	n->plen = plen;
+	memcpy(n->key, key, (plen + 7) / 8);
+	if (plen % 8) {
+		n->key[plen / 8] &= 0xff << (8 - plen % 8);
+	}
+	idx->nnodes++;
+	return n;
+}
+
+/* the node of key/plen, added if there is none */
+static struct rt_node *
+trie_insert(struct rt_index *idx, struct rt_node **pp
+,	const unsigned char *key, int plen)
+{
+	struct rt_node	*n, *leaf, *branch;
+	int		common = 0;
+
+	while ((n = *pp) != NULL) {
+		common = common_bits(n->key, key
+		,	n->plen < plen ? n->plen : plen);
+		if (common < n->plen) {
+			break;
+		}
+		if (n->plen == plen) {
+			return n;
+		}
+		pp = &n->child[KEY_BIT(key, n->plen)];
+	}
+	if ((leaf = node_new(idx, key, plen)) == NULL) {
+		return NULL;
+	}
+	if (n == NULL) {
+		*pp = leaf;
+	}else if (common == plen) {
+		/* the new prefix covers n */
+		leaf->child[KEY_BIT(n->key, plen)] = n;
+		*pp = leaf;
+	}else{
+		if ((branch = node_new(idx, key, common)) == NULL) {
+			free(leaf);
+			idx->nnodes--;
+			return NULL;
+		}
+		branch->child[KEY_BIT(key, common)] = leaf;
+		branch->child[KEY_BIT(n->key, common)] = n;
+		*pp = branch;
+	}
+	return leaf;
+}
+
+/*
+ * trie_find --- the node of exactly key/plen, or NULL
+ *
+ * The links leading to it are left in path, for trie_prune().
+ */
+static struct rt_node *
+trie_find(struct rt_node **pp, const unsigned char *key, int plen
+,	struct rt_node ***path, int *depth)
+{
+	struct rt_node	*n;
+
+	*depth = 0;
+	while ((n = *pp) != NULL && n->plen <= plen
+	&&	common_bits(n->key, key, n->plen) == n->plen) {
+		path[(*depth)++] = pp;
+		if (n->plen == plen) {
+			return n;
+		}
+		pp = &n->child[KEY_BIT(key, n->plen)];
+	}
+	return NULL;
+}
+
+/* remove the last node of path if it is empty, and a branch left over */
+static void
+trie_prune(struct rt_index *idx, struct rt_node ***path, int depth)
+{
+	while (depth > 0) {
+		struct rt_node	**pp = path[--depth], *n = *pp;
+
+		if (n->entries != NULL || (n->child[0] && n->child[1])) {
+			break;
+		}
+		*pp = n->child[0] ? n->child[0] : n->child[1];
+		free(n);
+		idx->nnodes--;
+	}
+}
+
+static void
+trie_free(struct rt_node *n)
+{
+	struct rt_entry	*e;
+
+	if (n == NULL) {
+		return;
+	}
+	trie_free(n->child[0]);
+	trie_free(n->child[1]);
+	while ((e = n->entries) != NULL) {
+		n->entries = e->next;
+		free(e);
+	}
+	free(n);
+}
+
+struct rt_index *
+rt_index_new(void)
+{
+	struct rt_index	*idx = calloc(1, sizeof(*idx));
+
+	if (idx != NULL) {
+		idx->fd = -1;
+	}
+	return idx;
+}
+
+void
+rt_index_clear(struct rt_index *idx)
+{
+	int	i;
+
+	for (i = 0; i < 2; i++) {
+		trie_free(idx->routes[i]);
+		trie_free(idx->addrs[i]);
+		idx->routes[i] = idx->addrs[i] = NULL;
+	}
+	idx->nlinks = 0;
+	idx->nroutes = idx->nnodes = 0;
+	idx->generation++;
+}
+
+void
+rt_index_free(struct rt_index *idx)
+{
+	if (idx == NULL) {
+		return;
+	}
+	rt_index_clear(idx);
+	if (idx->fd != -1) {
+		close(idx->fd);
+	}
+	free(idx->links);
+	free(idx);
+}
+
+/*
+ * An IPv4 route is identified by its metric, as the kernel allows one
+ * per prefix and metric in a table. IPv6 has one per interface too.
+ */
+#define	SAME_ROUTE(family, e, oif, m) \
+	((e)->metric == (m) && ((family) == AF_INET || (oif) == 0 \
+	||	(e)->ifindex == (oif)))
+
+int
+rt_index_add_route(struct rt_index *idx, int family, const void *dst
+,	int plen, int type, int ifindex, unsigned metric)
+{
+	struct rt_node	*n;
+	struct rt_entry	*e, **ep;
+
+	if (plen < 0 || plen > FAMILY_BITS(family)) {
+		errno = EINVAL;
+		return -1;
+	}
+	n = trie_insert(idx, &idx->routes[FAMILY_INDEX(family)], dst, plen);
+	if (n == NULL) {
+		return -1;
+	}
+	for (e = n->entries; e != NULL; e = e->next) {
+		if (SAME_ROUTE(family, e, ifindex, metric)) {
+			e->ifindex = ifindex;
+			e->type = type;
+			idx->generation++;
+			return 0;
+		}
+	}
+	if ((e = calloc(1, sizeof(*e))) == NULL) {
+		return -1;
+	}
+	e->ifindex = ifindex;
+	e->type = type;
+	e->metric = metric;
+	/* kept in the order of the metric */
+	for (ep = &n->entries; *ep != NULL && (*ep)->metric <= metric
+	;	ep = &(*ep)->next) {
+		;
+	}
+	e->next = *ep;
+	*ep = e;
+	idx->nroutes++;
+	idx->generation++;
+	return 0;
+}
+
+int
+rt_index_del_route(struct rt_index *idx, int family, const void *dst
+,	int plen, int ifindex, unsigned metric)
+{
+	struct rt_node	**path[129], *n;
+	struct rt_entry	*e, **ep;
+	int		depth;
+
+	n = trie_find(&idx->routes[FAMILY_INDEX(family)], dst, plen
+	,	path, &depth);
+	if (n == NULL) {
+		errno = ESRCH;
+		return -1;
+	}
+	for (ep = &n->entries; (e = *ep) != NULL; ep = &e->next) {
+		if (SAME_ROUTE(family, e, ifindex, metric)) {
+			*ep = e->next;
+			free(e);
+			idx->nroutes--;
+			idx->generation++;
+			trie_prune(idx, path, depth);
+			return 0;
+		}
+	}
+	errno = ESRCH;
+	return -1;
+}
+
+/*
+ * The addresses are kept under their prefix, so that the addresses
+ * whose subnet holds an address are on its path in the trie.
+ */
+int
+rt_index_add_addr(struct rt_index *idx, int family, const void *addr
+,	int plen, int ifindex)
+{
+	int		bytes = FAMILY_BITS(family) / 8;
+	struct rt_node	*n;
+	struct rt_entry	*e;
+
+	if (plen < 0 || plen > FAMILY_BITS(family)) {
+		errno = EINVAL;
+		return -1;
+	}
+	n = trie_insert(idx, &idx->addrs[FAMILY_INDEX(family)], addr, plen);
+	if (n == NULL) {
+		return -1;
+	}
+	for (e = n->entries; e != NULL; e = e->next) {
+		if (e->ifindex == ifindex && memcmp(e->addr, addr, bytes) == 0) {
+			return 0;
+		}
+	}
+	if ((e = calloc(1, sizeof(*e) + bytes)) == NULL) {
+		return -1;
+	}
+	e->ifindex = ifindex;
+	e->type = RTN_LOCAL;
+	memcpy(e->addr, addr, bytes);
+	e->next = n->entries;
+	n->entries = e;
+	idx->generation++;
+	return 0;
+}
+
+int
+rt_index_del_addr(struct rt_index *idx, int family, const void *addr
+,	int plen, int ifindex)
+{
+	int		bytes = FAMILY_BITS(family) / 8;
+	struct rt_node	**path[129], *n;
+	struct rt_entry	*e, **ep;
+	int		depth;
+
+	n = trie_find(&idx->addrs[FAMILY_INDEX(family)], addr, plen
+	,	path, &depth);
+	for (ep = n ? &n->entries : NULL; ep != NULL && (e = *ep) != NULL
+	;	ep = &e->next) {
+		if (e->ifindex == ifindex && memcmp(e->addr, addr, bytes) == 0) {
+			*ep = e->next;
+			free(e);
+			idx->generation++;
+			trie_prune(idx, path, depth);
+			return 0;
+		}
+	}
+	errno = ESRCH;
+	return -1;
+}
+
+static struct rt_link *
+find_link(struct rt_index *idx, int ifindex)
+{
+	int	i;
+
+	for (i = 0; i < idx->nlinks; i++) {
+		if (idx->links[i].ifindex == ifindex) {
+			return &idx->links[i];
+		}
+	}
+	return NULL;
+}
+
+int
+rt_index_set_link(struct rt_index *idx, int ifindex, const char *name
+,	unsigned flags)
+{
+	struct rt_link	*l = find_link(idx, ifindex);
+
+	if (l == NULL) {
+		if (idx->nlinks == idx->linksize) {
+			int	size = idx->linksize ? idx->linksize * 2 : 16;
+
+			l = realloc(idx->links, size * sizeof(*l));
+			if (l == NULL) {
+				return -1;
+			}
+			idx->links = l;
+			idx->linksize = size;
+		}
+		l = &idx->links[idx->nlinks++];
+		l->ifindex = ifindex;
+	}
+	l->flags = flags;
+	strncpy(l->name, name, sizeof(l->name));
+	l->name[sizeof(l->name) - 1] = '\0';
+	idx->generation++;
+	return 0;
+}
+
+int
+rt_index_del_link(struct rt_index *idx, int ifindex)
+{
+	struct rt_link	*l = find_link(idx, ifindex);
+
+	if (l == NULL) {
+		errno = ENODEV;
+		return -1;
+	}
+	*l = idx->links[--idx->nlinks];
+	idx->generation++;
+	return 0;
+}
+
+const char *
+rt_index_ifname(struct rt_index *idx, int ifindex)
+{
+	struct rt_link	*l = find_link(idx, ifindex);
+
+	return l ? l->name : NULL;
+}
+
+unsigned long
+rt_index_generation(struct rt_index *idx)
+{
+	return idx->generation;
+}
+
+unsigned long
+rt_index_routes(struct rt_index *idx)
+{
+	return idx->nroutes;
+}
+
+unsigned long
+rt_index_nodes(struct rt_index *idx)
+{
+	return idx->nnodes;
+}
+
+/*
+ * As findif does with netlink: a host address (/32, /128) is taken only
+ * if no subnet holds the address, and among equal prefixes, the
+ * interface which has the address wins.
+ */
+#define	ADDR_RANK(len, maxlen, ifindex, oif) \
+	(((len) == (maxlen) ? 0 : ((len) + 1) * 2) + ((ifindex) == (oif)))
+
+/* Return code: 1 if addr is an address of this host, 0 if not */
+static int
+lookup_local(struct rt_index *idx, int family, const unsigned char *addr
+,	int oif, struct rt_match *m)
+{
+	int		maxlen = FAMILY_BITS(family);
+	struct rt_node	*path[129], *n;
+	struct rt_entry	*e;
+	int		depth = 0, i, rank, best = -1, local = 0;
+
+	for (n = idx->addrs[FAMILY_INDEX(family)]; n != NULL
+	&&	common_bits(n->key, addr, n->plen) == n->plen
+	;	n = n->child[KEY_BIT(addr, n->plen)]) {
+		if (n->entries != NULL) {
+			path[depth++] = n;
+		}
+		if (n->plen == maxlen) {
+			break;
+		}
+	}
+	for (i = 0; i < depth && !local; i++) {
+		for (e = path[i]->entries; e != NULL; e = e->next) {
+			if (memcmp(e->addr, addr, maxlen / 8) == 0) {
+				local = e->ifindex;
+				break;
+			}
+		}
+	}
+	if (!local) {
+		return 0;
+	}
+	if (oif == 0) {
+		oif = local;
+	}
+	for (i = 0; i < depth; i++) {
+		for (e = path[i]->entries; e != NULL; e = e->next) {
+			rank = ADDR_RANK(path[i]->plen, maxlen, e->ifindex, oif);
+			if (rank > best) {
+				best = rank;
+				m->prefixlen = path[i]->plen;
+				m->ifindex = e->ifindex;
+			}
+		}
+	}
+	m->type = RTN_LOCAL;
+	m->metric = 0;
+	m->local = 1;
+	return 1;
+}
+
+int
+rt_index_lookup(struct rt_index *idx, int family, const void *addr
+,	int oif, struct rt_match *m)
+{
+	int		maxlen = FAMILY_BITS(family);
+	const unsigned char *key = addr;
+	struct rt_node	*n;
+	struct rt_entry	*e, *best = NULL;
+
+	memset(m, 0, sizeof(*m));
+	if (lookup_local(idx, family, key, oif, m)) {
+		return 0;
+	}
+	for (n = idx->routes[FAMILY_INDEX(family)]; n != NULL
+	&&	common_bits(n->key, key, n->plen) == n->plen
+	;	n = n->child[KEY_BIT(key, n->plen)]) {
+		/* the entries are in the order of the metric */
+		for (e = n->entries; e != NULL; e = e->next) {
+			if (oif == 0 || e->ifindex == oif) {
+				best = e;
+				m->prefixlen = n->plen;
+				break;
+			}
+		}
+		if (n->plen == maxlen) {
+			break;
+		}
+	}
+	if (best == NULL) {
+		return -1;
+	}
+	m->ifindex = best->ifindex;
+	m->type = best->type;
+	m->metric = best->metric;
+	return 0;
+}
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+/*
+ * rt_index_apply --- change the index as a netlink message says
+ *
+ * Only the main table is kept, as /proc/net/route shows it. The kernel
+ * drops the IPv4 routes of an interface going down without telling, so
+ * then the whole index is reloaded.
+ */
+static void
+rt_index_apply(struct rt_index *idx, struct nlmsghdr *nh)
+{
+	struct rtattr	*rta;
+	int		len;
+
+	switch (nh->nlmsg_type) {
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+	{
+		struct ifinfomsg *ifi = NLMSG_DATA(nh);
+		struct rt_link	*l = find_link(idx, ifi->ifi_index);
+		const char	*name = NULL;
+
+		if (nh->nlmsg_type == RTM_DELLINK) {
+			rt_index_del_link(idx, ifi->ifi_index);
+			idx->reload = 1;
+			break;
+		}
+		if (l != NULL && (l->flags & IFF_UP)
+		&&	!(ifi->ifi_flags & IFF_UP)) {
+			idx->reload = 1;
+		}
+		len = IFLA_PAYLOAD(nh);
+		for (rta = IFLA_RTA(ifi); RTA_OK(rta, len)
+		;	rta = RTA_NEXT(rta, len)) {
+			if (rta->rta_type == IFLA_IFNAME) {
+				name = RTA_DATA(rta);
+			}
+		}
+		if (name != NULL) {
+			rt_index_set_link(idx, ifi->ifi_index, name
+			,	ifi->ifi_flags);
+		}
+		break;
+	}
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+	{
+		struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+		const void	*addr = NULL;
+
+		if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6) {
+			break;
+		}
+		len = IFA_PAYLOAD(nh);
+		for (rta = IFA_RTA(ifa); RTA_OK(rta, len)
+		;	rta = RTA_NEXT(rta, len)) {
+			/* IPv6 has no IFA_LOCAL; IFA_ADDRESS is the address */
+			if (rta->rta_type == IFA_LOCAL || (addr == NULL
+			&&	rta->rta_type == IFA_ADDRESS)) {
+				addr = RTA_DATA(rta);
+			}
+		}
+		if (addr == NULL) {
+			break;
+		}
+		if (nh->nlmsg_type == RTM_NEWADDR) {
+			rt_index_add_addr(idx, ifa->ifa_family, addr
+			,	ifa->ifa_prefixlen, ifa->ifa_index);
+		}else{
+			rt_index_del_addr(idx, ifa->ifa_family, addr
+			,	ifa->ifa_prefixlen, ifa->ifa_index);
+		}
+		break;
+	}
+	case RTM_NEWROUTE:
+	case RTM_DELROUTE:
+	{
+		struct rtmsg	*rtm = NLMSG_DATA(nh);
+		unsigned char	dst[16];
+		unsigned	table = rtm->rtm_table, metric = 0;
+		int		oif = 0;
+
+		if ((rtm->rtm_family != AF_INET && rtm->rtm_family != AF_INET6)
+		||	(rtm->rtm_flags & RTM_F_CLONED)) {
+			break;
+		}
+		memset(dst, 0, sizeof(dst));
+		len = RTM_PAYLOAD(nh);
+		for (rta = RTM_RTA(rtm); RTA_OK(rta, len)
+		;	rta = RTA_NEXT(rta, len)) {
+			switch (rta->rta_type) {
+			case RTA_DST:
+				memcpy(dst, RTA_DATA(rta)
+				,	FAMILY_BITS(rtm->rtm_family) / 8);
+				break;
+			case RTA_TABLE:
+				table = *(unsigned *)RTA_DATA(rta);
+				break;
+			case RTA_PRIORITY:
+				metric = *(unsigned *)RTA_DATA(rta);
+				break;
+			case RTA_OIF:
+				oif = *(int *)RTA_DATA(rta);
+				break;
+			case RTA_MULTIPATH:
+				/* the first nexthop */
+				if (oif == 0 && RTA_PAYLOAD(rta)
+					>= sizeof(struct rtnexthop)) {
+					struct rtnexthop *nhp = RTA_DATA(rta);
+					oif = nhp->rtnh_ifindex;
+				}
+				break;
+			}
+		}
+		if (table != RT_TABLE_MAIN) {
+			break;
+		}
+		if (nh->nlmsg_type == RTM_NEWROUTE) {
+			/*
+			 * A replaced IPv6 route may have moved to another
+			 * interface, so it is not the same route to
+			 * SAME_ROUTE: drop the one of the prefix and metric.
+			 */
+			if (nh->nlmsg_flags & NLM_F_REPLACE) {
+				rt_index_del_route(idx, rtm->rtm_family, dst
+				,	rtm->rtm_dst_len, 0, metric);
+			}
+			rt_index_add_route(idx, rtm->rtm_family, dst
+			,	rtm->rtm_dst_len, rtm->rtm_type, oif, metric);
+		}else{
+			rt_index_del_route(idx, rtm->rtm_family, dst
+			,	rtm->rtm_dst_len, oif, metric);
+		}
+		break;
+	}
+	}
+}
+
+/* pass the messages in buf to rt_index_apply(); 1 at the end of a dump */
+static int
+rt_index_apply_all(struct rt_index *idx, char *buf, ssize_t len
+,	unsigned seq, int *rc)
+{
+	struct nlmsghdr	*nh;
+
+	for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len)
+	;	nh = NLMSG_NEXT(nh, len)) {
+		if (nh->nlmsg_type == NLMSG_DONE && nh->nlmsg_seq == seq) {
+			return 1;
+		}
+		if (nh->nlmsg_type == NLMSG_ERROR) {
+			if (nh->nlmsg_seq == seq) {
+				struct nlmsgerr *err = NLMSG_DATA(nh);
+
+				*rc = err->error;
+				return 1;
+			}
+			continue;
+		}
+		rt_index_apply(idx, nh);
+	}
+	return 0;
+}
+
+int
+rt_index_load(struct rt_index *idx)
+{
+	static const struct {
+		int	type;
+		size_t	len;
+	} dumps[] = {
+		{RTM_GETLINK,	sizeof(struct ifinfomsg)},
+		{RTM_GETADDR,	sizeof(struct ifaddrmsg)},
+		{RTM_GETROUTE,	sizeof(struct rtmsg)},
+	};
+	struct {
+		struct nlmsghdr	nh;
+		union {
+			struct ifinfomsg ifi;
+			struct ifaddrmsg ifa;
+			struct rtmsg	rtm;
+		} u;
+	} req;
+	struct sockaddr_nl	sa;
+	static char	buf[65536];
+	int		fd, i, rc = 0;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd == -1) {
+		return -errno;
+	}
+	rt_index_clear(idx);
+	idx->reload = 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	for (i = 0; rc == 0 && i < (int)(sizeof(dumps) / sizeof(dumps[0]))
+	;	i++) {
+		int	done = 0;
+
+		/* the family, AF_UNSPEC, comes first in all three */
+		memset(&req, 0, sizeof(req));
+		req.nh.nlmsg_len = NLMSG_LENGTH(dumps[i].len);
+		req.nh.nlmsg_type = dumps[i].type;
+		req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+		req.nh.nlmsg_seq = i + 1;
+		if (sendto(fd, &req, req.nh.nlmsg_len, 0
+		,	(struct sockaddr *)&sa, sizeof(sa)) == -1) {
+			rc = -errno;
+			break;
+		}
+		while (!done) {
+			ssize_t	len = recv(fd, buf, sizeof(buf), 0);
+
+			if (len == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				rc = -errno;
+				break;
+			}
+			done = rt_index_apply_all(idx, buf, len, i + 1, &rc);
+		}
+	}
+	close(fd);
+	return rc;
+}
+
+int
+rt_index_subscribe(struct rt_index *idx)
+{
+	struct sockaddr_nl	sa;
+	int	fd, size = 1024 * 1024;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd == -1) {
+		return -errno;
+	}
+	/* room for a burst of route changes; overruns cause a reload */
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR
+	|	RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		int	err = errno;
+
+		close(fd);
+		return -err;
+	}
+	if (idx->fd != -1) {
+		close(idx->fd);
+	}
+	idx->fd = fd;
+	return fd;
+}
+
+int
+rt_index_update(struct rt_index *idx)
+{
+	static char	buf[65536];
+	unsigned long	generation = idx->generation;
+	int		rc = 0;
+
+	while (idx->fd != -1) {
+		ssize_t	len = recv(idx->fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+		if (len == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == ENOBUFS) {
+				/* events were lost */
+				idx->reload = 1;
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return -errno;
+			}
+			break;
+		}
+		rt_index_apply_all(idx, buf, len, 0, &rc);
+	}
+	if (idx->reload && (rc = rt_index_load(idx)) < 0) {
+		return rc;
+	}
+	return idx->generation != generation;
+}
+#endif /* HAVE_LINUX_RTNETLINK_H */
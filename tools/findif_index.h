@@ -0,0 +1,96 @@
+/*
+ * findif_index.h: longest prefix match index of the routes and the
+ *	interface addresses, for findif
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef FINDIF_INDEX_H
+#define FINDIF_INDEX_H
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/rtnetlink.h>
+#else
+#define RTN_UNICAST	1
+#define RTN_LOCAL	2
+#endif
+
+struct rt_index;
+
+/* what rt_index_lookup() found for an address */
+struct rt_match {
+	int		ifindex;
+	int		prefixlen;
+	int		type;		/* RTN_UNICAST, RTN_BLACKHOLE, ... */
+	unsigned	metric;
+	int		local;		/* the address is on this host */
+};
+
+struct rt_index *rt_index_new(void);
+void rt_index_free(struct rt_index *idx);
+void rt_index_clear(struct rt_index *idx);
+
+/*
+ * The tables are filled either from the kernel (rt_index_load()) or by
+ * hand, as the benchmark does. family is AF_INET or AF_INET6, and
+ * addresses are in network byte order. Return code: 0, or -1 with errno.
+ */
+int rt_index_add_route(struct rt_index *idx, int family, const void *dst
+,	int plen, int type, int ifindex, unsigned metric);
+int rt_index_del_route(struct rt_index *idx, int family, const void *dst
+,	int plen, int ifindex, unsigned metric);
+int rt_index_add_addr(struct rt_index *idx, int family, const void *addr
+,	int plen, int ifindex);
+int rt_index_del_addr(struct rt_index *idx, int family, const void *addr
+,	int plen, int ifindex);
+int rt_index_set_link(struct rt_index *idx, int ifindex, const char *name
+,	unsigned flags);
+int rt_index_del_link(struct rt_index *idx, int ifindex);
+
+/*
+ * rt_index_lookup --- the route of addr, as the kernel would choose it
+ * from the main table, with the prefix of the address on the interface
+ * if addr is an address of this host. oif, if not 0, is the interface
+ * the route must go out of.
+ *
+ * Return code: 0, or -1 if there is no route.
+ */
+int rt_index_lookup(struct rt_index *idx, int family, const void *addr
+,	int oif, struct rt_match *m);
+
+const char *rt_index_ifname(struct rt_index *idx, int ifindex);
+
+/* changes whenever the index does; results may be cached until then */
+unsigned long rt_index_generation(struct rt_index *idx);
+
+/* the number of routes and of trie nodes, for the benchmark */
+unsigned long rt_index_routes(struct rt_index *idx);
+unsigned long rt_index_nodes(struct rt_index *idx);
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+/*
+ * rt_index_load() reads the links, addresses and routes from the kernel
+ * into an empty index. rt_index_subscribe() opens a socket for their
+ * changes and returns it, to be polled; rt_index_update() applies the
+ * changes pending on it, reloading the index if some were lost, and
+ * returns 1 if the index changed, 0 if not. Subscribe before loading,
+ * not to miss a change made during the dump. On an error, these return
+ * -errno.
+ */
+int rt_index_load(struct rt_index *idx);
+int rt_index_subscribe(struct rt_index *idx);
+int rt_index_update(struct rt_index *idx);
+#endif
+
+#endif /* FINDIF_INDEX_H */
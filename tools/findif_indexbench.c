@@ -0,0 +1,292 @@
+/*
+ * findif_indexbench.c: Measure the cost of a lookup in the route index
+ *	of findif
+ *
+ *	findif_indexbench [-6] [-n routes] [-q lookups] [-c changes] [-k]
+ *
+ *	A table of random routes (500000 by default) is put in the index,
+ *	and random addresses, half of them inside a route, are looked up
+ *	in it. The same lookups are done for a part of them by a linear
+ *	scan of the table, as findif -m proc does, to compare with. The
+ *	cost of adding and removing a route, as for a netlink event, is
+ *	measured with -c. With -k the routes of the kernel are loaded
+ *	instead (Linux), and the time the dump takes is printed too.
+ *
+ *	The result is one line of key=value pairs.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#include <netinet/in.h>
+
+#include "findif_index.h"
+
+struct route {
+	unsigned char	dst[16];
+	int		plen;
+	int		ifindex;
+	unsigned	metric;
+};
+
+static const char *cmdname = "findif_indexbench";
+static unsigned long long rand_state = 88172645463325252ULL;
+
+/* xorshift, so that every run uses the same table */
+static unsigned long
+next_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return (unsigned long)(rand_state >> 11);
+}
+
+static double
+now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+random_bytes(unsigned char *p, int len)
+{
+	int	i;
+
+	for (i = 0; i < len; i++) {
+		p[i] = next_rand() & 0xff;
+	}
+}
+
+static void
+mask(unsigned char *p, int plen, int len)
+{
+	int	i;
+
+	for (i = 0; i < len; i++) {
+		if (plen >= (i + 1) * 8) {
+			continue;
+		}
+		p[i] &= plen > i * 8 ? 0xff << (8 - (plen - i * 8)) : 0;
+	}
+}
+
+/* prefix lengths shaped roughly like a full BGP table */
+static int
+random_plen(int family)
+{
+	int	r = next_rand() % 100;
+
+	if (family == AF_INET6) {
+		return r < 55 ? 48 : r < 75 ? 32 + next_rand() % 16
+		:	r < 95 ? 49 + next_rand() % 16 : 16 + next_rand() % 16;
+	}
+	return r < 55 ? 24 : r < 75 ? 22 + next_rand() % 2
+	:	r < 90 ? 16 + next_rand() % 6 : r < 97 ? 25 + next_rand() % 8
+	:	8 + next_rand() % 8;
+}
+
+/* what findif -m proc does for each address */
+static int
+linear_lookup(const struct route *table, int n, const unsigned char *addr
+,	int len)
+{
+	int	i, best = -1;
+
+	for (i = 0; i < n; i++) {
+		unsigned char	a[16];
+
+		memcpy(a, addr, len);
+		mask(a, table[i].plen, len);
+		if (memcmp(a, table[i].dst, len) == 0
+		&&	(best < 0 || table[i].plen > table[best].plen
+		||	(table[i].plen == table[best].plen
+		&&	table[i].metric < table[best].metric))) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+static void
+usage(int ec)
+{
+	fprintf(stderr, "usage: %s [-6] [-n routes] [-q lookups]"
+	" [-c changes] [-k]\n", cmdname);
+	exit(ec);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct rt_index	*idx;
+	struct route	*table = NULL;
+	unsigned char	(*addrs)[16];
+	struct rt_match	m;
+	int	family = AF_INET, len;
+	int	nroutes = 500000, lookups = 1000000, changes = 0;
+	int	kernel = 0, linear, found = 0, mismatch = 0;
+	int	c, i;
+	double	t, build_ns, lookup_ns, linear_ns = 0, change_ns = 0;
+
+	while ((c = getopt(argc, argv, "6n:q:c:k")) != -1) {
+		switch (c) {
+		case '6':
+			family = AF_INET6;
+			break;
+		case 'n':
+			nroutes = atoi(optarg);
+			break;
+		case 'q':
+			lookups = atoi(optarg);
+			break;
+		case 'c':
+			changes = atoi(optarg);
+			break;
+		case 'k':
+			kernel = 1;
+			break;
+		default:
+			usage(2);
+		}
+	}
+	if (optind != argc || nroutes < 1 || lookups < 1 || changes < 0) {
+		usage(2);
+	}
+#ifndef HAVE_LINUX_RTNETLINK_H
+	if (kernel) {
+		fprintf(stderr, "%s: -k needs netlink.\n", cmdname);
+		exit(2);
+	}
+#endif
+	len = family == AF_INET6 ? 16 : 4;
+
+	if ((idx = rt_index_new()) == NULL
+	||	(addrs = malloc(lookups * sizeof(*addrs))) == NULL
+	||	(!kernel && (table = malloc(nroutes * sizeof(*table))) == NULL)) {
+		perror(cmdname);
+		exit(1);
+	}
+
+	t = now_ns();
+	if (kernel) {
+#ifdef HAVE_LINUX_RTNETLINK_H
+		int	rc = rt_index_load(idx);
+
+		if (rc < 0) {
+			fprintf(stderr, "%s: cannot load the routes: %s\n"
+			,	cmdname, strerror(-rc));
+			exit(1);
+		}
+#endif
+	}else{
+		for (i = 0; i < nroutes; i++) {
+			struct route	*r = &table[i];
+
+			memset(r->dst, 0, sizeof(r->dst));
+			random_bytes(r->dst, len);
+			r->plen = random_plen(family);
+			mask(r->dst, r->plen, len);
+			r->ifindex = 1 + next_rand() % 16;
+			r->metric = next_rand() % 4;
+		}
+		t = now_ns();
+		for (i = 0; i < nroutes; i++) {
+			if (rt_index_add_route(idx, family, table[i].dst
+			,	table[i].plen, RTN_UNICAST, table[i].ifindex
+			,	table[i].metric) < 0) {
+				perror(cmdname);
+				exit(1);
+			}
+		}
+	}
+	build_ns = now_ns() - t;
+
+	/* half inside a route, half anywhere */
+	for (i = 0; i < lookups; i++) {
+		random_bytes(addrs[i], len);
+		if (!kernel && i % 2 == 0) {
+			const struct route *r = &table[next_rand() % nroutes];
+			unsigned char	a[16];
+			int		j;
+
+			memcpy(a, addrs[i], len);
+			mask(a, r->plen, len);
+			for (j = 0; j < len; j++) {
+				addrs[i][j] = r->dst[j] | (addrs[i][j] ^ a[j]);
+			}
+		}
+	}
+
+	t = now_ns();
+	for (i = 0; i < lookups; i++) {
+		found += rt_index_lookup(idx, family, addrs[i], 0, &m) == 0;
+	}
+	lookup_ns = (now_ns() - t) / lookups;
+
+	/* the linear scan is slow; a few hundred lookups tell its cost */
+	linear = kernel ? 0 : lookups < 200 ? lookups : 200;
+	if (linear > 0) {
+		t = now_ns();
+		for (i = 0; i < linear; i++) {
+			int	best = linear_lookup(table, nroutes, addrs[i], len);
+			int	rc = rt_index_lookup(idx, family, addrs[i], 0, &m);
+
+			if ((rc < 0) != (best < 0)
+			||	(best >= 0 && m.prefixlen != table[best].plen)) {
+				mismatch++;
+			}
+		}
+		linear_ns = (now_ns() - t) / linear;
+	}
+
+	if (!kernel && changes > 0) {
+		t = now_ns();
+		for (i = 0; i < changes; i++) {
+			const struct route *r = &table[next_rand() % nroutes];
+
+			rt_index_del_route(idx, family, r->dst, r->plen
+			,	r->ifindex, r->metric);
+			rt_index_add_route(idx, family, r->dst, r->plen
+			,	RTN_UNICAST, r->ifindex, r->metric);
+		}
+		change_ns = (now_ns() - t) / (changes * 2);
+	}
+
+	printf("family=%s source=%s routes=%lu nodes=%lu build_ms=%.1f"
+	" lookups=%d found=%d lookup_ns=%.0f linear_ns=%.0f mismatch=%d"
+	" changes=%d change_ns=%.0f generation=%lu\n"
+	,	family == AF_INET6 ? "inet6" : "inet"
+	,	kernel ? "kernel" : "random"
+	,	rt_index_routes(idx), rt_index_nodes(idx), build_ns / 1e6
+	,	lookups, found, lookup_ns, linear_ns, mismatch
+	,	changes, change_ns, rt_index_generation(idx));
+	rt_index_free(idx);
+	free(table);
+	free(addrs);
+	return mismatch ? 1 : 0;
+}
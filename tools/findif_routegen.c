@@ -0,0 +1,315 @@
+/*
+ * findif_routegen.c: Make a synthetic routing table for findif -p
+ *
+ *	findif_routegen [-6] [-n routes] [-q addresses] [-i interfaces]
+ *		[-d percent] [-s seed] dir
+ *
+ *	dir/net/route, or dir/net/ipv6_route with -6, gets a table of
+ *	random routes (100000 by default) in the format of /proc, with
+ *	prefix lengths shaped roughly like a full BGP table, metrics from
+ *	0 to 3 spread over the interfaces eth0 to eth<interfaces - 1>. A
+ *	percent of the prefixes (10 by default) are repeated on another
+ *	interface with a higher metric, as a backup route would be, and
+ *	one IPv6 route in a hundred is unreachable. The table of the
+ *	other family is left empty.
+ *
+ *	dir/addresses gets addresses to look up (1000 by default) for
+ *	findif -f, half of them inside a route, half anywhere. The same
+ *	seed makes the same files.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* as in the kernel, and in findif */
+#define	RTF_UP_FLAG	0x0001
+#define	RTF_REJECT_FLAG	0x0200
+
+struct route {
+	unsigned char	dst[16];
+	int		plen;
+	int		ifindex;
+	unsigned	metric;
+};
+
+static const char *cmdname = "findif_routegen";
+static unsigned long long rand_state = 88172645463325252ULL;
+
+/* xorshift, so that a seed always makes the same table */
+static unsigned long
+next_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return (unsigned long)(rand_state >> 11);
+}
+
+static void
+mask(unsigned char *p, int plen, int len)
+{
+	int	i;
+
+	for (i = 0; i < len; i++) {
+		if (plen >= (i + 1) * 8) {
+			continue;
+		}
+		p[i] &= plen > i * 8 ? 0xff << (8 - (plen - i * 8)) : 0;
+	}
+}
+
+/*
+ * A random unicast address: IPv4 in 1.0.0.0 to 223.255.255.255 but not
+ * 127/8, IPv6 in 2000::/3, which findif takes without an interface.
+ */
+static void
+random_addr(unsigned char *p, int family)
+{
+	int	i, len = family == AF_INET6 ? 16 : 4;
+
+	for (i = 0; i < len; i++) {
+		p[i] = next_rand() & 0xff;
+	}
+	if (family == AF_INET6) {
+		p[0] = 0x20 | (p[0] & 0x1f);
+	}else{
+		do {
+			p[0] = 1 + next_rand() % 223;
+		} while (p[0] == 127);
+	}
+}
+
+/* prefix lengths shaped roughly like a full BGP table */
+static int
+random_plen(int family)
+{
+	int	r = next_rand() % 100;
+
+	if (family == AF_INET6) {
+		return r < 55 ? 48 : r < 75 ? 32 + next_rand() % 16
+		:	r < 95 ? 49 + next_rand() % 16 : 16 + next_rand() % 16;
+	}
+	return r < 55 ? 24 : r < 75 ? 22 + next_rand() % 2
+	:	r < 90 ? 16 + next_rand() % 6 : r < 97 ? 25 + next_rand() % 8
+	:	8 + next_rand() % 8;
+}
+
+static FILE *
+open_file(const char *dir, const char *name)
+{
+	char	path[PATH_MAX];
+	FILE	*f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((f = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "%s: cannot write %s: %s\n", cmdname, path
+		,	strerror(errno));
+		exit(1);
+	}
+	return f;
+}
+
+static void
+close_file(FILE *f)
+{
+	if (ferror(f) || fclose(f) == EOF) {
+		fprintf(stderr, "%s: write error\n", cmdname);
+		exit(1);
+	}
+}
+
+/* an empty /proc/net/route has the header line */
+static void
+route_header(FILE *f)
+{
+	fprintf(f, "Iface\tDestination\tGateway \tFlags\tRefCnt\tUse\tMetric"
+	"\tMask\t\tMTU\tWindow\tIRTT\n");
+}
+
+static void
+write_route(FILE *f, const struct route *r)
+{
+	uint32_t	dst, netmask;
+
+	/* the kernel prints the addresses as integers in host order */
+	memcpy(&dst, r->dst, 4);
+	netmask = htonl(r->plen == 0 ? 0 : 0xffffffffUL << (32 - r->plen));
+	fprintf(f, "eth%d\t%08X\t%08X\t%04X\t%d\t%u\t%d\t%08X\t%d\t%u\t%u\n"
+	,	r->ifindex, (unsigned)dst, 0U, RTF_UP_FLAG, 0, 0U
+	,	(int)r->metric, (unsigned)netmask, 0, 0U, 0U);
+}
+
+static void
+write_route6(FILE *f, const struct route *r)
+{
+	char	name[16];
+	int	i;
+
+	for (i = 0; i < 16; i++) {
+		fprintf(f, "%02x", r->dst[i]);
+	}
+	snprintf(name, sizeof(name), "eth%d", r->ifindex);
+	fprintf(f, " %02x %032x %02x %032x %08x %08x %08x %08x %8s\n"
+	,	r->plen, 0, 0, 0, r->metric, 1, 0
+	,	RTF_UP_FLAG | (next_rand() % 100 == 0 ? RTF_REJECT_FLAG : 0)
+	,	name);
+}
+
+static void
+write_addr(FILE *f, int family, const unsigned char *addr)
+{
+	char	buf[INET6_ADDRSTRLEN];
+
+	inet_ntop(family, addr, buf, sizeof(buf));
+	fprintf(f, "%s\n", buf);
+}
+
+static void
+usage(int ec)
+{
+	fprintf(stderr, "usage: %s [-6] [-n routes] [-q addresses]"
+	" [-i interfaces] [-d percent] [-s seed] dir\n", cmdname);
+	exit(ec);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct route	*table;
+	const char	*dir;
+	char		path[PATH_MAX];
+	FILE		*f;
+	int	family = AF_INET, len;
+	int	nroutes = 100000, naddrs = 1000, nifs = 16, dups = 10;
+	int	c, i;
+
+	while ((c = getopt(argc, argv, "6n:q:i:d:s:")) != -1) {
+		switch (c) {
+		case '6':
+			family = AF_INET6;
+			break;
+		case 'n':
+			nroutes = atoi(optarg);
+			break;
+		case 'q':
+			naddrs = atoi(optarg);
+			break;
+		case 'i':
+			nifs = atoi(optarg);
+			break;
+		case 'd':
+			dups = atoi(optarg);
+			break;
+		case 's':
+			rand_state += strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(2);
+		}
+	}
+	if (optind != argc - 1 || nroutes < 1 || naddrs < 0 || nifs < 1
+	||	dups < 0 || dups > 100 || rand_state == 0) {
+		usage(2);
+	}
+	dir = argv[optind];
+	len = family == AF_INET6 ? 16 : 4;
+
+	snprintf(path, sizeof(path), "%s/net", dir);
+	if ((mkdir(dir, 0777) < 0 && errno != EEXIST)
+	||	(mkdir(path, 0777) < 0 && errno != EEXIST)) {
+		fprintf(stderr, "%s: cannot make %s: %s\n", cmdname, path
+		,	strerror(errno));
+		exit(1);
+	}
+	if ((table = malloc(nroutes * sizeof(*table))) == NULL) {
+		perror(cmdname);
+		exit(1);
+	}
+
+	for (i = 0; i < nroutes; i++) {
+		struct route	*r = &table[i];
+
+		if (i > 0 && (int)(next_rand() % 100) < dups) {
+			/* a backup of the previous prefix */
+			*r = table[i - 1];
+			r->ifindex = (r->ifindex + 1 + next_rand() % nifs) % nifs;
+			r->metric += 1 + next_rand() % 4;
+			continue;
+		}
+		memset(r->dst, 0, sizeof(r->dst));
+		random_addr(r->dst, family);
+		r->plen = random_plen(family);
+		mask(r->dst, r->plen, len);
+		r->ifindex = next_rand() % nifs;
+		r->metric = next_rand() % 4;
+	}
+
+	f = open_file(dir, "net/route");
+	route_header(f);
+	if (family == AF_INET) {
+		for (i = 0; i < nroutes; i++) {
+			write_route(f, &table[i]);
+		}
+	}
+	close_file(f);
+	f = open_file(dir, "net/ipv6_route");
+	if (family == AF_INET6) {
+		for (i = 0; i < nroutes; i++) {
+			write_route6(f, &table[i]);
+		}
+	}
+	close_file(f);
+
+	f = open_file(dir, "addresses");
+	for (i = 0; i < naddrs; i++) {
+		unsigned char	a[16];
+
+		memset(a, 0, sizeof(a));
+		random_addr(a, family);
+		if (i % 2 == 0) {
+			const struct route *r = &table[next_rand() % nroutes];
+			unsigned char	host[16];
+			int		j;
+
+			memcpy(host, a, len);
+			mask(host, r->plen, len);
+			for (j = 0; j < len; j++) {
+				a[j] = r->dst[j] | (a[j] ^ host[j]);
+			}
+		}
+		write_addr(f, family, a);
+	}
+	close_file(f);
+
+	printf("%s: %d %s routes, %d addresses\n", dir, nroutes
+	,	family == AF_INET6 ? "inet6" : "inet", naddrs);
+	free(table);
+	return 0;
+}
@@ -40,7 +40,13 @@
      (AC_INIT, AM_INIT_AUTOMAKE) must change together.
  */
 #define SFEX_VERSION 1
-#define SFEX_REVISION 3
+#define SFEX_REVISION 4
+
+/* first revision whose version 2 meta-data has a lock map. See sfex_lockmap_ondisk. */
+#define SFEX_REVISION_LOCKMAP 4
+
+/* version of the binary on-disk format. See sfex_controldata_ondisk_v2. */
+#define SFEX_VERSION_V2 2
 
 #if 0
 #ifndef TRUE
@@ -91,6 +97,7 @@
  * number of locks  --- 4 bytes. This is printable integer number and range 
  * is from 1 to 999. This must be left-justify, null(0x00) padding, and make 
  * a last byte null. This is the number of locks following this control data.
+ * Format version 2 stores it in binary and allows up to SFEX_MAX_NUMLOCKS_V2.
  *
  * padding --- The size of this member depend on blocksize. It is adjusted so 
  * that the whole of the control data including this padding area becomes 
@@ -102,6 +109,7 @@ typedef struct sfex_controldata {
   int revision;			/*  revision number */
   size_t blocksize;		/*  block size */
   int numlocks;			/*  number of locks */
+  struct sfex_ctx *ctx;		/*  the devices, not stored on disk */
 } sfex_controldata;
 
 typedef struct sfex_controldata_ondisk {
@@ -112,6 +120,24 @@ typedef struct sfex_controldata_ondisk {
   uint8_t numlocks[4];
 } sfex_controldata_ondisk;
 
+/*
+ * sfex_controldata_ondisk_v2 --- control data of format version 2
+ *
+ * The magic number and the version number are stored the same way as
+ * version 1, so that the version 1 programs refuse the meta-data cleanly.
+ * The other fields are little-endian binary numbers.
+ *
+ * crc --- CRC32C of the preceding fields. The rest of the block is 0x00.
+ */
+typedef struct sfex_controldata_ondisk_v2 {
+  uint8_t magic[4];
+  uint8_t version[4];
+  uint8_t revision[4];
+  uint8_t blocksize[4];
+  uint8_t numlocks[4];
+  uint8_t crc[4];
+} sfex_controldata_ondisk_v2;
+
 /*
  * sfex_lockdata --- lock data
  *
@@ -143,8 +169,12 @@ typedef struct sfex_controldata_ondisk {
  */
 typedef struct sfex_lockdata {
   char status;				/* status of lock */
-  int count;				/* increment counter */
+  uint64_t count;			/* increment counter */
   char nodename[256];		/* node name */
+  uint32_t nodeid;			/* node ID, version 2 only */
+  uint64_t expiry;			/* lease expiry, version 2 only */
+  uint32_t interval;		/* heartbeat interval in msec, version 2 only */
+  uint32_t takeover;		/* takeover window in msec, version 2 only */
 } sfex_lockdata;
 
 typedef struct sfex_lockdata_ondisk {
@@ -153,6 +183,77 @@ typedef struct sfex_lockdata_ondisk {
 	uint8_t nodename[256];
 } sfex_lockdata_ondisk;
 
+/*
+ * sfex_lockdata_ondisk_v2 --- lock data of format version 2
+ *
+ * All numbers are little-endian binary, so the lock data are encoded and
+ * decoded without any formatting.
+ *
+ * lock status --- same as version 1.
+ *
+ * node ID --- 4 bytes. CRC32C of the node name. The owner of the lock is
+ * decided by this value, not by the node name.
+ *
+ * generation counter --- 8 bytes. Incremented by every update of the lock
+ * data and never wraps, unlike the version 1 counter.
+ *
+ * lease expiry --- 8 bytes. Wall clock time in milliseconds since the Epoch
+ * until which the holder promises to update the lock, 0 if not set. The
+ * clocks of the nodes are not assumed to be synchronized, so this is
+ * informational only.
+ *
+ * heartbeat interval --- 4 bytes. The interval in milliseconds at which 
+ * the holder updates the lock, 0 if not set. A node waiting for the lock 
+ * polls it at half of this interval.
+ *
+ * node name --- same as version 1, kept for display.
+ *
+ * takeover window --- 4 bytes. How long in milliseconds the counter must
+ * stay still before a waiting node may take the lock over without waiting
+ * the whole lock_timeout, 0 if the holder does not allow it. The holder
+ * fences itself before this window ends, so a node waiting for the lock
+ * uses this value rather than its own settings. Meta-data written before
+ * this field have 0 here.
+ *
+ * crc --- CRC32C of the whole block, computed with this field set to 0.
+ * A torn or partly written block fails this check.
+ */
+typedef struct sfex_lockdata_ondisk_v2 {
+	uint8_t status;
+	uint8_t reserved[3];
+	uint8_t nodeid[4];
+	uint8_t generation[8];
+	uint8_t expiry[8];
+	uint8_t interval[4];
+	uint8_t crc[4];
+	uint8_t nodename[256];
+	uint8_t takeover[4];
+} sfex_lockdata_ondisk_v2;
+
+/*
+ * sfex_lockmap_ondisk --- lock map of format version 2
+ * Meta-data of revision SFEX_REVISION_LOCKMAP and later have a lock map
+ * after the last lock data: one bit per lock, set while the lock is held,
+ * so that a free index is found without reading the whole table. Every
+ * block of the map has this header followed by the bits of
+ * SFEX_LOCKMAP_BITS consecutive locks; bit 0 of the first byte is the lock
+ * of the first index. The lock data stay authoritative: the map is updated
+ * by read-modify-write after the locks, and an update by another node at
+ * the same time may be lost, so a bit is only a hint.
+ * magic number --- 4 bytes. This is fixed in "SFXM".
+ * first index --- 4 bytes. Index of the lock of bit 0 of this block.
+ * crc --- CRC32C of the whole block, computed with this field set to 0.
+ */
+typedef struct sfex_lockmap_ondisk {
+	uint8_t magic[4];
+	uint8_t first[4];
+	uint8_t crc[4];
+	uint8_t reserved[4];
+} sfex_lockmap_ondisk;
+
+#define SFEX_LOCKMAP_MAGIC "SFXM"
+#define SFEX_LOCKMAP_BITS(blocksize) (((blocksize) - sizeof(sfex_lockmap_ondisk)) * 8)
+
 /* character for lock status. This is used in sfex_lockdata.status */
 #define SFEX_STATUS_UNLOCK 'u' /* unlock */
 #define SFEX_STATUS_LOCK 'l'	/* lock */
@@ -161,16 +262,101 @@ typedef struct sfex_lockdata_ondisk {
 #define SFEX_MAGIC "SFEX"
 #define SFEX_MIN_NUMLOCKS 1
 #define SFEX_MAX_NUMLOCKS 999
+#define SFEX_MAX_NUMLOCKS_V2 1048576
+#define SFEX_MAX_LOCKS(version) ((version) >= SFEX_VERSION_V2 ? SFEX_MAX_NUMLOCKS_V2 : SFEX_MAX_NUMLOCKS)
 #define SFEX_MIN_COUNT 0
 #define SFEX_MAX_COUNT 999
+#define SFEX_MIN_BLOCKSIZE 512
+#define SFEX_MAX_BLOCKSIZE 65536
 #define SFEX_MAX_NODENAME (sizeof(((sfex_lockdata *)0)->nodename) - 1)
 
-/* update macro for increment counter */
-#define SFEX_NEXT_COUNT(c) (c >= SFEX_MAX_COUNT ? c - SFEX_MAX_COUNT : c + 1)
+/* update macro for increment counter. The version 2 counter never wraps. */
+#define SFEX_NEXT_COUNT(cdata, c) ((cdata)->version >= SFEX_VERSION_V2 ? (c) + 1 : \
+	((c) >= SFEX_MAX_COUNT ? (c) - SFEX_MAX_COUNT : (c) + 1))
+
+/*
+ * sfex_status --- status page of sfex_daemon
+ *
+ * sfex_daemon -P <file> keeps its live state in this structure, mapped
+ * from <file> with mmap(2), so that a monitor can check it without any
+ * device I/O. The page is only meaningful on the host of the daemon.
+ *
+ * seq --- seqlock. The daemon makes it odd before changing the page and
+ * even again afterwards. A reader retries while it is odd or changed
+ * during the copy. See status_page_read().
+ *
+ * state --- SFEX_STATE_*.
+ *
+ * last_heartbeat --- CLOCK_MONOTONIC time in microseconds of the last
+ * successful heartbeat (or acquisition). last_heartbeat_ms is the same
+ * in CLOCK_REALTIME milliseconds, for display.
+ *
+ * count --- the counter that heartbeat wrote to the first held lock (to
+ * the last acquired one for the acquisition).
+ *
+ * last_io_usec --- time the last heartbeat took.
+ *
+ * io_errors --- consecutive failed heartbeats.
+ *
+ * indexes --- the first SFEX_STATUS_MAX_INDEXES of num_locks held indexes.
+ *
+ * window --- length of a latency window in seconds.
+ *
+ * slow_heartbeats --- heartbeats which took longer than the warning
+ * threshold since the start.
+ *
+ * latency, last_latency --- latency of the reads, the writes and whole
+ * heartbeats (SFEX_LATENCY_*) in the current and in the last complete
+ * window.
+ */
+#define SFEX_STATUS_MAGIC "SFXS"
+#define SFEX_STATUS_VERSION 2
+#define SFEX_STATUS_MAX_INDEXES 64
+
+#define SFEX_STATE_STARTING 1	/* acquiring the locks */
+#define SFEX_STATE_RUNNING 2	/* holding the locks */
+#define SFEX_STATE_STOPPING 3	/* releasing the locks */
+#define SFEX_STATE_FAILED 4	/* exited on an error */
+
+#define SFEX_LATENCY_READ 0
+#define SFEX_LATENCY_WRITE 1
+#define SFEX_LATENCY_HEARTBEAT 2
+#define SFEX_LATENCY_KINDS 3
+
+typedef struct sfex_latency {
+	uint32_t count;
+	uint32_t p50;	/* us */
+	uint32_t p99;	/* us */
+	uint32_t max;	/* us */
+} sfex_latency;
+
+typedef struct sfex_status {
+	char magic[4];
+	uint32_t version;
+	volatile uint32_t seq;
+	uint32_t pid;
+	uint32_t state;
+	uint32_t num_locks;
+	uint32_t monitor_interval;	/* ms */
+	uint32_t lock_timeout;		/* ms */
+	uint64_t last_heartbeat;	/* CLOCK_MONOTONIC usec */
+	uint64_t last_heartbeat_ms;	/* CLOCK_REALTIME ms */
+	uint64_t count;
+	uint32_t last_io_usec;
+	uint32_t io_errors;
+	int32_t indexes[SFEX_STATUS_MAX_INDEXES];
+	uint32_t window;		/* s */
+	uint32_t slow_heartbeats;
+	sfex_latency latency[SFEX_LATENCY_KINDS];
+	sfex_latency last_latency[SFEX_LATENCY_KINDS];
+} sfex_status;
 
 /* extern variables */
 extern const char *progname;
 extern char *nodename;
+/* those of the default context of sfex_lib.c, set by prepare_lock() */
 extern unsigned long sector_size;
+extern unsigned long physical_block_size;
+extern uint64_t device_size;
 
 #endif /* SFEX_H */
@@ -12,6 +12,14 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/select.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
 #include "sfex.h"
 #include "sfex_lib.h"
 
@@ -19,86 +27,534 @@
 #include <glue_config.h> /* for HA_LOG_FACILITY */
 #endif
 
+#if !SFEX_TESTING
 static int sysrq_fd;
-static int lock_index = 1;        /* default 1st lock */
-static time_t collision_timeout = 1; /* default 1 sec */
-static time_t lock_timeout = 60; /* default 60 sec */
+#endif
+static int *lock_indexes;         /* held lock indexes, sorted */
+static int num_locks;
+static sfex_lockdata *lock_area;  /* lock data read of lock_indexes, in the same order */
+static int lock_area_size;
+static sfex_lockdata *lock_held;  /* lock data of lock_indexes, in the same order */
+static int lock_held_size;
+/* times are in milliseconds */
+static unsigned long collision_timeout = 1000; /* default 1 sec */
+static unsigned long lock_timeout = 60000; /* default 60 sec */
 time_t unlock_timeout = 60;
-static time_t monitor_interval = 10;
+static unsigned long monitor_interval = 10000;
+static unsigned long missed_heartbeats = 3; /* 0 disables the fast takeover */
+static unsigned long stop_timeout = 0;  /* 0 means lock_timeout */
+static int timer_fd = -1;
+static int sig_fd = -1;           /* SIGTERM and SIGINT */
+static int quit_signo;            /* the stop signal received, or 0 */
+static uint64_t quit_time;        /* when it was received */
 
 static sfex_controldata cdata;
 static sfex_lockdata ldata;
-static sfex_lockdata ldata_new;
 
-static const char *device;
 const char *progname;
 char *nodename;
 static const char *rsc_id = "sfex";
+static const char *ctl_path;      /* control socket, NULL if disabled */
+static int ctl_fd = -1;
+
+/*
+ * control_client --- a connection of the control socket
+ *
+ * Clients are served from the main loop without ever blocking it: the
+ * request is read and the reply written when select() finds the socket
+ * ready, and a client which takes longer than SFEX_CONTROL_TIMEOUT is
+ * dropped. An "add" writes its claim and is finished by a later pass of
+ * the loop, once collision_timeout has passed.
+ */
+#define SFEX_CONTROL_CLIENTS 8
+#define SFEX_CONTROL_TIMEOUT 5000	/* ms */
+typedef struct control_client {
+	int fd;                   /* -1 if the slot is free */
+	uint64_t since;           /* when it was accepted, or its add finished */
+	char *reply;              /* NULL until the request is done */
+	size_t len, done;         /* of the reply */
+	int adding;               /* the index claimed by an add, or 0 */
+	uint64_t claimed;         /* when the claim was written */
+} control_client;
+static control_client ctl_clients[SFEX_CONTROL_CLIENTS];
+static int num_ctl_clients;
+static int foreground = 0;        /* -F */
+static unsigned long latency_window = 300000;  /* -W, ms */
+static double warn_fraction = 0.5;    /* -w, of lock_timeout. 0 disables */
+static double deadline_fraction = 0.8; /* -D, of the lease. 0 disables */
+static uint64_t deadline_usec;    /* heartbeat deadline, from deadline_fraction */
+static uint64_t acquired_usec;    /* when the last acquisition wrote its lock */
+static sfex_histogram latency[SFEX_LATENCY_KINDS];      /* current window */
+static sfex_latency last_latency[SFEX_LATENCY_KINDS];   /* last window */
+static uint64_t window_start;
+static unsigned long slow_heartbeats;
+static const char *status_path;   /* -P, NULL if disabled */
+static sfex_status *status;       /* the status page mapped from status_path */
 
 static void usage(FILE *dist) {
-	  fprintf(dist, "usage: %s [-i <index>] [-c <collision_timeout>] [-t <lock_timeout>] <device>\n", progname);
+	  fprintf(dist, "usage: %s [-i <index>[,<index>...]] [-c <collision_timeout>] [-t <lock_timeout>] [-m <monitor_interval>] [-M <missed_heartbeats>] [-s <control_socket>] [-I <io_backend>] [-T <stop_timeout>] [-P <status_file>] [-W <latency_window>] [-w <warn_fraction>] [-D <deadline_fraction>] [-F] <device> [<device>...]\n", progname);
 }
 
-static void acquire_lock(void)
+/*
+ * lease_expiry --- the lease expiry written with the lock data
+ *
+ * This is only stored by format version 2, and is informational since the
+ * clocks of the nodes may differ.
+ */
+static uint64_t lease_expiry(void)
 {
-	if (read_lockdata(&cdata, &ldata, lock_index) == -1) {
-		cl_log(LOG_ERR, "read_lockdata failed in acquire_lock\n");
-		exit(EXIT_FAILURE);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + lock_timeout;
+}
+
+/*
+ * takeover_ms --- the takeover window written with our locks
+ *
+ * missed_heartbeats of gap, the time until our next write of the lock, if
+ * that is shorter than lock_timeout, or 0. With format version 2 the
+ * contenders take a lock over when its counter has not moved for this long
+ * (see acquire_lock_set()), whatever their own -M is. gap is
+ * monitor_interval for a heartbeat, and claim_gap() for a claim, which is
+ * not written again until its collision_timeout has passed. The window
+ * is only safe because the watchdog fences us within it, so without the
+ * watchdog (-D 0) there is none.
+ */
+static uint32_t takeover_ms(unsigned long gap)
+{
+	if (cdata.version >= SFEX_VERSION_V2 && missed_heartbeats > 0
+	    && deadline_fraction > 0 && missed_heartbeats * gap < lock_timeout)
+		return missed_heartbeats * gap;
+	return 0;
+}
+
+static unsigned long claim_gap(void)
+{
+	return collision_timeout > monitor_interval ? collision_timeout : monitor_interval;
+}
+
+/*
+ * lease_usec --- how long the other nodes wait before taking a lock over
+ *
+ * This is our takeover window, or lock_timeout without one. The contender
+ * counts from its first read, which is never earlier than our last write.
+ */
+static uint64_t lease_usec(void)
+{
+	uint64_t lease = takeover_ms(monitor_interval);
+
+	return (lease ? lease : lock_timeout) * 1000;
+}
+
+/*
+ * The watchdog
+ *
+ * A thread of its own fences the node when no heartbeat has completed
+ * within deadline_usec. It must not depend on the main loop: a write to a
+ * failed path leaves the main thread in an uninterruptible sleep, where
+ * not even a signal handler runs, and the other nodes may take our locks
+ * over soon. The thread only waits on watchdog_cond for the deadlines the
+ * main loop sets, and resets the node through a sysrq fd of its own.
+ */
+static pthread_mutex_t watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watchdog_cond;
+static uint64_t watchdog_deadline;	/* 0 while not armed */
+static uint64_t watchdog_stop;		/* end of the stop, 0 until then */
+static int watchdog_started;
+#if !SFEX_TESTING
+static int watchdog_sysrq_fd = -1;
+#endif
+
+/*
+ * watchdog_fence --- self-fence when the heartbeat deadline passed
+ *
+ * The main thread is stuck, possibly in the middle of anything, so the
+ * status page is written directly and nothing but write(2) is used.
+ *
+ * stop --- whether it is the end of the stop which passed. With -D 0 the
+ * process then only exits.
+ */
+static void watchdog_fence(int stop)
+{
+	static const char msg[] = "sfex_daemon: heartbeat deadline expired. self-fencing.\n";
+	static const char stop_msg[] = "sfex_daemon: stop timed out. self-fencing.\n";
+	static const char exit_msg[] = "sfex_daemon: stop timed out.\n";
+	ssize_t ret;
+
+	if (stop && deadline_usec == 0) {
+		ret = write(STDERR_FILENO, exit_msg, sizeof(exit_msg) - 1);
+		(void)ret;
+		_exit(EXIT_FAILURE);
 	}
 
-	if ((ldata.status == SFEX_STATUS_LOCK) && (strncmp(nodename, (const char*)(ldata.nodename), sizeof(ldata.nodename)))) {
-		unsigned int t = lock_timeout;
-		while (t > 0)
-			t = sleep(t);
-		read_lockdata(&cdata, &ldata_new, lock_index);
-		if (ldata.count != ldata_new.count) {
-			cl_log(LOG_ERR, "can\'t acquire lock: the lock's already hold by some other node.\n");
-			exit(2);
+	if (status != NULL) {
+		status_page_begin(status);
+		status->state = SFEX_STATE_FAILED;
+		status->io_errors++;
+		status_page_end(status);
+	}
+	if (stop)
+		ret = write(STDERR_FILENO, stop_msg, sizeof(stop_msg) - 1);
+	else
+		ret = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+#if !SFEX_TESTING
+	ret = write(watchdog_sysrq_fd, "b\n", 2);
+#endif
+	(void)ret;
+	_exit(EXIT_FAILURE);
+}
+
+/* the first of the deadlines set, or 0 */
+static uint64_t watchdog_next(void)
+{
+	if (watchdog_stop != 0 && (watchdog_deadline == 0 || watchdog_stop < watchdog_deadline))
+		return watchdog_stop;
+	return watchdog_deadline;
+}
+
+static void *watchdog_main(void *arg)
+{
+	uint64_t next;
+
+	(void)arg;
+	pthread_mutex_lock(&watchdog_lock);
+	while ((next = watchdog_next()) == 0 || get_monotonic_usec() < next) {
+		struct timespec ts;
+
+		if (next == 0) {
+			pthread_cond_wait(&watchdog_cond, &watchdog_lock);
+			continue;
 		}
+		ts.tv_sec = next / 1000000;
+		ts.tv_nsec = (next % 1000000) * 1000;
+		pthread_cond_timedwait(&watchdog_cond, &watchdog_lock, &ts);
 	}
+	pthread_mutex_unlock(&watchdog_lock);
+	watchdog_fence(next == watchdog_stop);
+	return NULL;
+}
 
-	/* The lock acquisition is possible because it was not updated. */
-	ldata.status = SFEX_STATUS_LOCK;
-	ldata.count = SFEX_NEXT_COUNT(ldata.count);
-	strncpy((char*)(ldata.nodename), nodename, sizeof(ldata.nodename));
-	if (write_lockdata(&cdata, &ldata, lock_index) == -1) {
-		cl_log(LOG_ERR, "write_lockdata failed\n");
-		exit(EXIT_FAILURE);
+/*
+ * start_watchdog --- start the watchdog thread
+ *
+ * It is started after daemon(3), which would not carry it over, and with
+ * all signals blocked, which are for the main loop. With -D 0 it is only
+ * started for the stop.
+ *
+ * return value --- 0, or -1 if the node could not be fenced.
+ */
+static int start_watchdog(void)
+{
+	pthread_condattr_t attr;
+	sigset_t all, old;
+	pthread_t thread;
+	int ret;
+
+	if (watchdog_started)
+		return 0;
+#if !SFEX_TESTING
+	if (deadline_usec != 0)
+		watchdog_sysrq_fd = open("/proc/sysrq-trigger", O_WRONLY | O_CLOEXEC);
+	if (deadline_usec != 0 && watchdog_sysrq_fd == -1) {
+		cl_log(LOG_ERR, "failed to open /proc/sysrq-trigger due to %s\n", strerror(errno));
+		return -1;
 	}
+#endif
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&watchdog_cond, &attr);
+	pthread_condattr_destroy(&attr);
 
-	/* detect the collision of lock */
-	/* The collision occurs when two or more nodes do the reservation 
-	   processing of the lock at the same time. It waits for collision_timeout 
-	   seconds to detect this,and whether the superscription of lock data by 
-	   another node is done is checked. If the superscription was done by 
-	   another node, the lock acquisition with the own node is given up.  
-	 */
-	{
-		unsigned int t = collision_timeout;
-		while (t > 0)
-			t = sleep(t);
-		if (read_lockdata(&cdata, &ldata_new, lock_index) == -1) {
-			cl_log(LOG_ERR, "read_lockdata failed in collision detection\n");
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&thread, NULL, watchdog_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		cl_log(LOG_ERR, "can't start the watchdog: %s\n", strerror(ret));
+		return -1;
+	}
+	pthread_detach(thread);
+	watchdog_started = 1;
+	return 0;
+}
+
+/*
+ * arm_watchdog --- set the heartbeat deadline
+ *
+ * since is when the last successful heartbeat was submitted. If no other
+ * heartbeat completes within deadline_usec of it, the watchdog thread
+ * fences the node.
+ */
+static void arm_watchdog(uint64_t since)
+{
+	if (deadline_usec == 0)
+		return;
+	pthread_mutex_lock(&watchdog_lock);
+	watchdog_deadline = since + deadline_usec;
+	pthread_cond_signal(&watchdog_cond);
+	pthread_mutex_unlock(&watchdog_lock);
+}
+
+/*
+ * check_watchdog --- fence before a write if the deadline has passed
+ *
+ * The main thread may have been stopped between the read of a heartbeat
+ * and its write, long enough for the locks to be taken over, and resumed
+ * together with the watchdog thread. Its write must not win that race.
+ */
+static void check_watchdog(void)
+{
+	if (deadline_usec != 0 && watchdog_deadline != 0
+	    && get_monotonic_usec() >= watchdog_deadline)
+		watchdog_fence(0);
+}
+
+static const char *latency_names[SFEX_LATENCY_KINDS] = {"read", "write", "heartbeat"};
+
+/* the percentiles of a histogram, for the log and the status page */
+static void summarize_latency(const sfex_histogram *h, sfex_latency *l)
+{
+	l->count = h->count;
+	l->p50 = histogram_percentile(h, 50);
+	l->p99 = histogram_percentile(h, 99);
+	l->max = h->max;
+}
+
+/*
+ * record_latency --- account the latency of one heartbeat
+ *
+ * A heartbeat which took longer than warn_fraction of lock_timeout is
+ * logged, since the lease would be lost if it took lock_timeout. Every
+ * latency_window, the percentiles of the window are logged and kept as the
+ * last window, and a new window starts.
+ */
+static void record_latency(uint64_t read_usec, uint64_t write_usec)
+{
+	uint64_t total = read_usec + write_usec;
+	uint64_t now = get_monotonic_usec();
+	int k;
+
+	histogram_add(&latency[SFEX_LATENCY_READ], read_usec);
+	histogram_add(&latency[SFEX_LATENCY_WRITE], write_usec);
+	histogram_add(&latency[SFEX_LATENCY_HEARTBEAT], total);
+
+	if (warn_fraction > 0 && total >= warn_fraction * lock_timeout * 1000) {
+		slow_heartbeats++;
+		cl_log(LOG_WARNING, "heartbeat took %lu ms (read %lu ms, write %lu ms), %d%% of lock_timeout\n",
+				(unsigned long)(total / 1000), (unsigned long)(read_usec / 1000),
+				(unsigned long)(write_usec / 1000),
+				(int)(total / 10 / lock_timeout));
+	}
+
+	if (window_start == 0)
+		window_start = now;
+	if (now - window_start < latency_window * 1000ULL)
+		return;
+	for (k = 0; k < SFEX_LATENCY_KINDS; k++) {
+		summarize_latency(&latency[k], &last_latency[k]);
+		cl_log(LOG_INFO, "%s latency of %u heartbeats: p50 %u us, p99 %u us, max %u us\n",
+				latency_names[k], last_latency[k].count, last_latency[k].p50,
+				last_latency[k].p99, last_latency[k].max);
+		histogram_reset(&latency[k]);
+	}
+	window_start = now;
+}
+
+/*
+ * dump_latency --- log the histograms of the current window on SIGUSR1
+ */
+static void dump_latency(void)
+{
+	int k, b;
+
+	for (k = 0; k < SFEX_LATENCY_KINDS; k++) {
+		sfex_latency l;
+
+		summarize_latency(&latency[k], &l);
+		cl_log(LOG_INFO, "%s latency: %u heartbeats, p50 %u us, p99 %u us, max %u us\n",
+				latency_names[k], l.count, l.p50, l.p99, l.max);
+		for (b = 0; b < SFEX_HIST_BUCKETS; b++) {
+			if (latency[k].buckets[b])
+				cl_log(LOG_INFO, "  <= %llu us: %u\n",
+						(unsigned long long)histogram_bucket_limit(b),
+						latency[k].buckets[b]);
 		}
-		if (strncmp((char*)(ldata.nodename), (const char*)(ldata_new.nodename), sizeof(ldata.nodename))) {
-			cl_log(LOG_ERR, "can\'t acquire lock: collision detected in the air.\n");
-			exit(2);
+	}
+	cl_log(LOG_INFO, "%lu slow heartbeats\n", slow_heartbeats);
+}
+
+/*
+ * publish_status --- update the status page
+ *
+ * state --- SFEX_STATE_*
+ *
+ * heartbeat --- whether a heartbeat (or acquisition) has just succeeded.
+ * Then count is the counter of the first held lock and io_usec the time
+ * it took. Otherwise, in SFEX_STATE_FAILED, a failed heartbeat is counted.
+ */
+static void publish_status(int state, int heartbeat, uint64_t count, uint64_t io_usec)
+{
+	int i;
+
+	if (status == NULL)
+		return;
+
+	status_page_begin(status);
+	status->pid = getpid();
+	status->state = state;
+	status->monitor_interval = monitor_interval;
+	status->lock_timeout = lock_timeout;
+	status->num_locks = num_locks;
+	for (i = 0; i < num_locks && i < SFEX_STATUS_MAX_INDEXES; i++)
+		status->indexes[i] = lock_indexes[i];
+	if (heartbeat) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		status->last_heartbeat = get_monotonic_usec();
+		status->last_heartbeat_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+		status->count = count;
+		status->last_io_usec = io_usec;
+		status->io_errors = 0;
+	} else if (state == SFEX_STATE_FAILED) {
+		status->io_errors++;
+	}
+	status->window = latency_window / 1000;
+	status->slow_heartbeats = slow_heartbeats;
+	for (i = 0; i < SFEX_LATENCY_KINDS; i++) {
+		summarize_latency(&latency[i], &status->latency[i]);
+		status->last_latency[i] = last_latency[i];
+	}
+	status_page_end(status);
+}
+
+/*
+ * check_quit --- read the pending signals from sig_fd
+ *
+ * The signals are blocked and received through a signalfd, so that the
+ * locks are never released from a signal handler, in the middle of a
+ * heartbeat or of cl_log. SIGUSR1 dumps the latency histograms.
+ *
+ * return value --- 1 if a stop signal has been received.
+ */
+static int check_quit(void)
+{
+	struct signalfd_siginfo si;
+
+	while (!quit_signo && read(sig_fd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo == SIGUSR1) {
+			dump_latency();
+			continue;
 		}
+		quit_signo = si.ssi_signo;
+		quit_time = get_monotonic_usec();
 	}
+	return quit_signo != 0;
+}
 
-	/* extension of lock */
-	/* Validly time of the lock is extended. It is because of spending at 
-	   the collision_timeout seconds to detect the collision. */
-	ldata.count = SFEX_NEXT_COUNT(ldata.count);
-	if (write_lockdata(&cdata, &ldata, lock_index) == -1) {
-		cl_log(LOG_ERR, "write_lockdata failed in extension of lock\n");
-		exit(EXIT_FAILURE);
+/*
+ * wait_until_usec --- sleep until deadline unless a stop signal arrives
+ *
+ * return value --- 0 at the deadline, -1 if the daemon is to stop.
+ */
+static int wait_until_usec(uint64_t deadline)
+{
+	uint64_t now;
+
+	while (!quit_signo && (now = get_monotonic_usec()) < deadline) {
+		struct timeval tv;
+		fd_set rfds;
+
+		tv.tv_sec = (deadline - now) / 1000000;
+		tv.tv_usec = (deadline - now) % 1000000;
+		FD_ZERO(&rfds);
+		FD_SET(sig_fd, &rfds);
+		if (select(sig_fd + 1, &rfds, NULL, NULL, &tv) > 0)
+			check_quit();
 	}
-	cl_log(LOG_INFO, "lock acquired\n");
+	return quit_signo ? -1 : 0;
+}
+
+/* Return the position of index in lock_indexes, or -1 if it is not held. */
+static int find_index(int index)
+{
+	int i;
+
+	for (i = 0; i < num_locks; i++) {
+		if (lock_indexes[i] == index)
+			return i;
+	}
+	return -1;
+}
+
+/* Insert index into lock_indexes, keeping it sorted. */
+static int add_index(int index)
+{
+	int *p;
+	int i;
+
+	if (find_index(index) != -1)
+		return 0;
+	p = realloc(lock_indexes, sizeof(*p) * (num_locks + 1));
+	if (p == NULL) {
+		cl_log(LOG_ERR, "%s\n", strerror(errno));
+		return -1;
+	}
+	lock_indexes = p;
+	for (i = num_locks; i > 0 && lock_indexes[i - 1] > index; i--)
+		lock_indexes[i] = lock_indexes[i - 1];
+	lock_indexes[i] = index;
+	num_locks++;
+	return 0;
+}
+
+static void remove_index(int index)
+{
+	int i = find_index(index);
+
+	if (i == -1)
+		return;
+	num_locks--;
+	memmove(&lock_indexes[i], &lock_indexes[i + 1],
+			sizeof(*lock_indexes) * (num_locks - i));
+}
+
+/*
+ * Parse "-i" argument. It is a comma separated list of indexes and
+ * ranges, such as "1,4,10-20".
+ */
+static int parse_index_list(const char *arg)
+{
+	const char *p = arg;
+
+	while (*p) {
+		char *end;
+		unsigned long first, last;
+
+		first = strtoul(p, &end, 10);
+		last = first;
+		if (end != p && *end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+		}
+		if (end == p || (*end != ',' && *end != '\0')
+		    || first < SFEX_MIN_NUMLOCKS || last > SFEX_MAX_NUMLOCKS_V2
+		    || first > last) {
+			return -1;
+		}
+		for (; first <= last; first++) {
+			if (add_index(first) == -1)
+				return -1;
+		}
+		p = (*end == ',') ? end + 1 : end;
+	}
+	return 0;
 }
 
 static void error_todo (void)
 {
+	publish_status(SFEX_STATE_FAILED, 0, 0, 0);
 	if (fork() == 0) {
 		cl_log(LOG_INFO, "Execute \"crm_resource -F -r %s -H %s\" command\n", rsc_id, nodename);
 		execl("/usr/sbin/crm_resource", "crm_resource", "-F", "-r", rsc_id, "-H", nodename, NULL);
@@ -109,12 +565,14 @@ static void error_todo (void)
 
 static void failure_todo(void)
 {
-#ifdef SFEX_TESTING	
+#if SFEX_TESTING
+	publish_status(SFEX_STATE_FAILED, 0, 0, 0);
 	exit(EXIT_FAILURE);
 #else
 	/*execl("/usr/sbin/crm_resource", "crm_resource", "-F", "-r", rsc_id, "-H", nodename, NULL); */
 	int ret;
 
+	publish_status(SFEX_STATE_FAILED, 0, 0, 0);
 	cl_log(LOG_INFO, "Force reboot node %s\n", nodename);
 	ret = write(sysrq_fd, "b\n", 2);
 	if (ret == -1) {
@@ -125,65 +583,826 @@ static void failure_todo(void)
 #endif
 }
 
+/* make lock_area and lock_held hold count lock data */
+static int reserve_lock_area(int count)
+{
+	if (count > lock_area_size) {
+		sfex_lockdata *p = realloc(lock_area, sizeof(*p) * count);
+		if (p == NULL) {
+			cl_log(LOG_ERR, "%s\n", strerror(errno));
+			return -1;
+		}
+		lock_area = p;
+		lock_area_size = count;
+	}
+	if (count > lock_held_size) {
+		sfex_lockdata *p = realloc(lock_held, sizeof(*p) * count);
+		if (p == NULL) {
+			cl_log(LOG_ERR, "%s\n", strerror(errno));
+			return -1;
+		}
+		lock_held = p;
+		lock_held_size = count;
+	}
+	return 0;
+}
+
+/*
+ * acquire_lock_set --- acquire a set of locks together
+ *
+ * Every round reads the lock data with read_lockdata_set(), one read for
+ * nearby indexes, and writes the claims of the free locks and the
+ * extensions of the claimed locks whose collision_timeout has passed with
+ * one batch of writes. All claims of a round share one collision_timeout,
+ * and a claim is extended only by a round which read it collision_timeout
+ * after it was written, however often other locks wake the loop
+ * meanwhile. Starting with N free locks thus takes one collision window
+ * instead of N.
+ *
+ * The locks held by other nodes are watched with the same reads. If the
+ * holder advertises a takeover window (format version 2), the lock is
+ * polled at half of its interval, and the holder is regarded as dead when
+ * its counter has not moved for that window. The window is the holder's,
+ * as its self-fencing deadline is computed from it. Any progress of the
+ * counter proves that the holder is alive, so we give up the lock at once.
+ * Otherwise, if that would take longer, or with -M 0, the counter is
+ * compared once after lock_timeout. A lock whose holder is dead is claimed
+ * in a later round; meanwhile the locks already acquired are updated every
+ * monitor_interval.
+ *
+ * indexes --- n sorted indexes
+ *
+ * results --- set for each index to 0 if the lock was acquired, 2 if it
+ * is held by another node or a collision was detected, or EXIT_FAILURE on
+ * I/O error
+ *
+ * return value --- 0 if all locks were acquired, -1 if a stop signal
+ * arrived, otherwise the result of the first lock not acquired. In the
+ * case of -1, the locks which may have been written have result 0.
+ */
+#define SET_NEW		0	/* not read yet */
+#define SET_HELD	1	/* held by another node, watched */
+#define SET_CLAIMED	2	/* claimed, in the collision window */
+#define SET_DONE	3	/* results[] is set */
+
+typedef struct lock_watch {
+	int state;
+	uint64_t count;		/* counter of the holder when first seen */
+	uint64_t deadline;	/* when the holder is regarded as dead */
+	uint64_t period;	/* polling period, 0 to look at the deadline */
+	uint64_t claimed;	/* when the claim was written */
+} lock_watch;
+
+static int acquire_lock_set(const int *indexes, int n, int *results)
+{
+	uint64_t start = get_monotonic_usec();
+	uint64_t beat = 0;		/* last write of the acquired locks */
+	lock_watch *w = calloc(n, sizeof(*w));
+	int *writes = malloc(sizeof(*writes) * n);
+	int *pos = malloc(sizeof(*pos) * n);
+	int i, ret = 0;
+
+	if (w == NULL || writes == NULL || pos == NULL || reserve_lock_area(n) == -1) {
+		cl_log(LOG_ERR, "%s\n", strerror(errno));
+		for (i = 0; i < n; i++)
+			results[i] = EXIT_FAILURE;
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	while (1) {
+		uint64_t now, wake = 0, read_start = get_monotonic_usec();
+		int nwrites = 0, pending = 0, acquired = 0, extend = 0;
+
+		if (read_lockdata_set(&cdata, lock_area, indexes, n) == -1) {
+			cl_log(LOG_ERR, "read_lockdata failed in acquire_lock_set\n");
+			for (i = 0; i < n; i++) {
+				if (w[i].state != SET_DONE)
+					results[i] = EXIT_FAILURE;
+			}
+			break;
+		}
+		now = get_monotonic_usec();
+
+		for (i = 0; i < n; i++) {
+			sfex_lockdata *l = &lock_area[i];
+			sfex_lockdata *out = &lock_held[nwrites];
+			int owned = l->status == SFEX_STATUS_LOCK
+				&& lockdata_owned_by(&cdata, l, nodename);
+
+			if (w[i].state == SET_DONE) {
+				if (results[i] != 0)
+					continue;
+				if (!owned) {
+					cl_log(LOG_ERR, "lock #%d was taken while acquiring the others.\n",
+							indexes[i]);
+					results[i] = 2;
+					continue;
+				}
+				acquired++;
+				if (now < beat + monitor_interval * 1000ULL)
+					continue;
+				/* update it as update_lock() does */
+			} else if (w[i].state == SET_CLAIMED) {
+				if (!owned) {
+					cl_log(LOG_ERR, "can\'t acquire lock #%d: collision detected in the air.\n",
+							indexes[i]);
+					results[i] = 2;
+					w[i].state = SET_DONE;
+					continue;
+				}
+				/* a read within the collision window tells nothing */
+				if (read_start < w[i].claimed + collision_timeout * 1000ULL)
+					continue;
+				/* extension of lock */
+			} else if (owned && strncmp(nodename, l->nodename, sizeof(l->nodename))) {
+				/* two node names map to the same node ID */
+				cl_log(LOG_ERR, "can\'t acquire lock #%d: node ID of %s is the same as %s.\n",
+						indexes[i], nodename, l->nodename);
+				results[i] = 2;
+				w[i].state = SET_DONE;
+				continue;
+			} else if (l->status == SFEX_STATUS_LOCK && !owned) {
+				if (w[i].state == SET_NEW) {
+					uint64_t stale = missed_heartbeats > 0 ? l->takeover : 0;
+
+					w[i].state = SET_HELD;
+					w[i].count = l->count;
+					if (cdata.version < SFEX_VERSION_V2 || stale == 0 || stale >= lock_timeout) {
+						w[i].deadline = now + lock_timeout * 1000ULL;
+						w[i].period = 0;
+					} else {
+						w[i].deadline = now + stale * 1000;
+						w[i].period = (l->interval / 2 + 1) * 1000ULL;
+					}
+					continue;
+				}
+				if (l->count != w[i].count) {
+					cl_log(LOG_ERR, "can\'t acquire lock #%d: the lock's already hold by %s.\n",
+							indexes[i], l->nodename);
+					results[i] = 2;
+					w[i].state = SET_DONE;
+					continue;
+				}
+				if (now < w[i].deadline)
+					continue;
+				cl_log(LOG_INFO, "lock #%d: %s missed its heartbeats. taking over.\n",
+						indexes[i], l->nodename);
+			}
+
+			*out = *l;
+			if (w[i].state == SET_NEW || w[i].state == SET_HELD) {
+				/* the lock is free: claim it */
+				out->status = SFEX_STATUS_LOCK;
+				set_lockdata_owner(out, nodename);
+				out->takeover = takeover_ms(claim_gap());
+			} else {
+				extend = 1;
+				out->takeover = takeover_ms(monitor_interval);
+			}
+			out->count = SFEX_NEXT_COUNT(&cdata, l->count);
+			out->expiry = lease_expiry();
+			out->interval = monitor_interval;
+			pos[nwrites] = i;
+			writes[nwrites++] = indexes[i];
+		}
+
+		if (nwrites > 0) {
+			uint64_t t = get_monotonic_usec();
+
+			if (write_lockdata_set(&cdata, lock_held, writes, 0, nwrites) == -1) {
+				cl_log(LOG_ERR, "write_lockdata failed in acquire_lock_set\n");
+				for (i = 0; i < n; i++) {
+					if (w[i].state != SET_DONE)
+						results[i] = EXIT_FAILURE;
+				}
+				break;
+			}
+			if (extend) {
+				/* the lease of the acquired locks runs from here */
+				beat = t;
+				acquired_usec = t;
+			}
+			now = get_monotonic_usec();
+		}
+		for (i = 0; i < nwrites; i++) {
+			lock_watch *lw = &w[pos[i]];
+
+			if (pos[i] == 0)
+				ldata = lock_held[i];
+			if (lw->state == SET_CLAIMED) {
+				cl_log(LOG_INFO, "lock #%d acquired in %lu ms\n", writes[i],
+						(unsigned long)((get_monotonic_usec() - start) / 1000));
+				results[pos[i]] = 0;
+				lw->state = SET_DONE;
+				acquired++;
+			} else if (lw->state != SET_DONE) {
+				lw->state = SET_CLAIMED;
+				lw->claimed = now;
+			}
+		}
+
+		for (i = 0; i < n; i++) {
+			uint64_t t;
+
+			if (w[i].state == SET_CLAIMED)
+				t = w[i].claimed + collision_timeout * 1000ULL;
+			else if (w[i].state == SET_HELD) {
+				t = w[i].deadline;
+				if (w[i].period && now + w[i].period < t)
+					t = now + w[i].period;
+			} else
+				continue;
+			pending++;
+			if (wake == 0 || t < wake)
+				wake = t;
+		}
+		if (pending == 0)
+			break;
+		if (acquired && beat + monitor_interval * 1000ULL < wake)
+			wake = beat + monitor_interval * 1000ULL;
+		if (wait_until_usec(wake) == -1) {
+			/* the claimed locks may be ours now */
+			for (i = 0; i < n; i++) {
+				if (w[i].state == SET_CLAIMED)
+					results[i] = 0;
+				else if (w[i].state != SET_DONE)
+					results[i] = 2;
+			}
+			ret = -1;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < n && ret == 0; i++)
+		ret = results[i];
+out:
+	free(pos);
+	free(writes);
+	free(w);
+	return ret;
+}
+
+/*
+ * update_lock --- heartbeat all held locks
+ *
+ * The lock data of the held indexes are read with read_lockdata_set():
+ * nearby indexes are read with one read, the blocks between them included,
+ * so a set spread over a large table does not read all of it. Each run of
+ * consecutive held indexes is then written back with one write, and the
+ * writes are submitted together; the blocks between runs belong to other
+ * nodes and are never written.
+ */
 static void update_lock(void)
 {
+	uint64_t expiry = lease_expiry();
+	uint64_t start = get_monotonic_usec();
+	uint64_t read_done, now;
+	int i;
+
+	if (num_locks == 0)
+		return;
+
+	if (reserve_lock_area(num_locks) == -1) {
+		error_todo();
+		exit(EXIT_FAILURE);
+	}
+
 	/* read lock data */
-	if (read_lockdata(&cdata, &ldata, lock_index) == -1) {
+	if (read_lockdata_set(&cdata, lock_area, lock_indexes, num_locks) == -1) {
 		cl_log(LOG_ERR, "read_lockdata failed in update_lock\n");
 		error_todo();
 		exit(EXIT_FAILURE);
 	}
+	read_done = get_monotonic_usec();
+
+	for (i = 0; i < num_locks; i++) {
+		sfex_lockdata *l = &lock_area[i];
 
-	/* check current lock status */
-	/* if own node is not locking, lock update is failed */
-	if (ldata.status != SFEX_STATUS_LOCK || strncmp((const char*)(ldata.nodename), nodename, sizeof(ldata.nodename))) {
-		cl_log(LOG_ERR, "can't update lock.\n");
-		failure_todo();
-		exit(EXIT_FAILURE); 
+		/* check current lock status */
+		/* if own node is not locking, lock update is failed */
+		if (l->status != SFEX_STATUS_LOCK || !lockdata_owned_by(&cdata, l, nodename)) {
+			cl_log(LOG_ERR, "can't update lock #%d.\n", lock_indexes[i]);
+			failure_todo();
+			exit(EXIT_FAILURE); 
+		}
+
+		/* lock update */
+		lock_held[i] = *l;
+		lock_held[i].count = SFEX_NEXT_COUNT(&cdata, l->count);
+		lock_held[i].expiry = expiry;
+		lock_held[i].interval = monitor_interval;
+		lock_held[i].takeover = takeover_ms(monitor_interval);
 	}
 
-	/* lock update */
-	ldata.count = SFEX_NEXT_COUNT(ldata.count);
-	if (write_lockdata(&cdata, &ldata, lock_index) == -1) {
+	check_watchdog();
+	if (write_lockdata_set(&cdata, lock_held, lock_indexes, 0, num_locks) == -1) {
 		cl_log(LOG_ERR, "write_lockdata failed in update_lock\n");
 		error_todo();
 		exit(EXIT_FAILURE);
 	}
+	now = get_monotonic_usec();
+	arm_watchdog(read_done);
+	record_latency(read_done - start, now - read_done);
+	publish_status(SFEX_STATE_RUNNING, 1, lock_held[0].count, now - start);
 }
 
-static void release_lock(void)
+static int release_lock(int index)
 {
-	/* The only thing I care about in release_lock(), is to terminate the process */
-	   
-	/* read lock data */
-	if (read_lockdata(&cdata, &ldata, lock_index) == -1) {
-		cl_log(LOG_ERR, "read_lockdata failed in release_lock\n");
-		exit(EXIT_FAILURE);
+	return sfex_release(&cdata, &index, 1, nodename) == 0 ? 0 : -1;
+}
+
+/*
+ * release_all_locks --- release all held locks at once
+ *
+ * Locks already taken by another node are left alone; see sfex_release().
+ *
+ * return value --- 0 if all locks were released, -1 otherwise.
+ */
+static int release_all_locks(void)
+{
+	if (ctl_fd != -1)
+		unlink(ctl_path);
+	if (num_locks == 0)
+		return 0;
+	return sfex_release(&cdata, lock_indexes, num_locks, nodename) == 0 ? 0 : -1;
+}
+
+/*
+ * abort_adds --- hold the claims of the adds in progress, on a stop
+ *
+ * They may be ours, so they are released with the held locks.
+ */
+static void abort_adds(void)
+{
+	int i;
+
+	for (i = 0; i < SFEX_CONTROL_CLIENTS; i++) {
+		if (ctl_clients[i].fd != -1 && ctl_clients[i].adding) {
+			add_index(ctl_clients[i].adding);
+			ctl_clients[i].adding = 0;
+		}
 	}
+}
 
-	/* check current lock status */
-	/* if own node is not locking, we judge that lock has been released already */
-	if (ldata.status != SFEX_STATUS_LOCK || strncmp((const char*)(ldata.nodename), nodename, sizeof(ldata.nodename))) {
-		cl_log(LOG_ERR, "lock was already released.\n");
-		exit(EXIT_FAILURE);
+/*
+ * stop_daemon --- release the locks and exit on a stop signal
+ *
+ * This runs from the main loop, so a heartbeat in progress has completed
+ * and none can start. The watchdog goes on meanwhile, since the locks are
+ * held until the release is written: if the device hangs, the node is
+ * fenced at the heartbeat deadline or at stop_timeout after the signal,
+ * whichever comes first, before another node may take the locks over and
+ * a late release overwrite them. With -D 0, the process just exits at
+ * stop_timeout.
+ */
+static void stop_daemon(void)
+{
+	uint64_t start = get_monotonic_usec();
+	int ret;
+
+	cl_log(LOG_INFO, "signal %d received. now releasing locks\n", quit_signo);
+	publish_status(SFEX_STATE_STOPPING, 0, 0, 0);
+	abort_adds();
+
+	if (start_watchdog() == -1)
+		cl_log(LOG_WARNING, "the stop is not watched.\n");
+	/* before daemon(3), the leases run since the acquisition */
+	if (watchdog_deadline == 0 && acquired_usec != 0)
+		arm_watchdog(acquired_usec);
+	pthread_mutex_lock(&watchdog_lock);
+	watchdog_stop = quit_time + stop_timeout * 1000ULL;
+	pthread_cond_signal(&watchdog_cond);
+	pthread_mutex_unlock(&watchdog_lock);
+
+	ret = release_all_locks();
+	if (status_path != NULL)
+		unlink(status_path);
+
+	cl_log(LOG_INFO, "stopped in %lu ms (release %lu ms)\n",
+			(unsigned long)((get_monotonic_usec() - quit_time) / 1000),
+			(unsigned long)((get_monotonic_usec() - start) / 1000));
+	cl_log(LOG_INFO, "Shutdown sfex_daemon with %s\n",
+			ret == 0 ? "EXIT_SUCCESS" : "EXIT_FAILURE");
+	exit(ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static int open_control_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd, i;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		cl_log(LOG_ERR, "control socket path %s is too long.\n", path);
+		return -1;
 	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
 
-	/* lock release */
-	ldata.status = SFEX_STATUS_UNLOCK;
-	if (write_lockdata(&cdata, &ldata, lock_index) == -1) {
-	    /*FIXME: We are going to self-stop */
-		cl_log(LOG_ERR, "write_lockdata failed in release_lock\n");
-		exit(EXIT_FAILURE);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		cl_log(LOG_ERR, "can't create control socket: %s\n", strerror(errno));
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+	    || listen(fd, 4) == -1) {
+		cl_log(LOG_ERR, "can't bind control socket %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	for (i = 0; i < SFEX_CONTROL_CLIENTS; i++)
+		ctl_clients[i].fd = -1;
+	return fd;
+}
+
+/*
+ * start_add --- claim a lock for "add"
+ *
+ * A lock held by another node is not waited for. The claim is written as
+ * acquire_lock_set() writes one, and the add is finished by finish_add()
+ * after collision_timeout.
+ *
+ * return value --- the reply if the add is over already, or NULL if the
+ * claim was written.
+ */
+static const char *start_add(control_client *c, int index)
+{
+	sfex_lockdata l;
+	int i;
+
+	if (find_index(index) != -1)
+		return "ok\n";
+	for (i = 0; i < SFEX_CONTROL_CLIENTS; i++) {
+		if (ctl_clients[i].fd != -1 && ctl_clients[i].adding == index)
+			return "error add in progress\n";
+	}
+	if (read_lockdata(&cdata, &l, index) == -1) {
+		cl_log(LOG_ERR, "read_lockdata failed in add of lock #%d\n", index);
+		return "error can't acquire lock\n";
+	}
+	if (l.status == SFEX_STATUS_LOCK && lockdata_owned_by(&cdata, &l, nodename)
+	    && strncmp(nodename, l.nodename, sizeof(l.nodename))) {
+		/* two node names map to the same node ID */
+		cl_log(LOG_ERR, "can\'t acquire lock #%d: node ID of %s is the same as %s.\n",
+				index, nodename, l.nodename);
+		return "error can't acquire lock\n";
+	}
+	if (l.status == SFEX_STATUS_LOCK && !lockdata_owned_by(&cdata, &l, nodename)) {
+		cl_log(LOG_ERR, "can\'t acquire lock #%d: the lock's held by %s.\n",
+				index, l.nodename);
+		return "error can't acquire lock\n";
+	}
+
+	l.status = SFEX_STATUS_LOCK;
+	l.count = SFEX_NEXT_COUNT(&cdata, l.count);
+	l.expiry = lease_expiry();
+	l.interval = monitor_interval;
+	l.takeover = takeover_ms(claim_gap());
+	set_lockdata_owner(&l, nodename);
+	check_watchdog();
+	if (write_lockdata(&cdata, &l, index) == -1) {
+		cl_log(LOG_ERR, "write_lockdata failed in add of lock #%d\n", index);
+		release_lock(index);
+		return "error can't acquire lock\n";
+	}
+	c->adding = index;
+	c->claimed = get_monotonic_usec();
+	return NULL;
+}
+
+/*
+ * finish_add --- confirm or give up the claim of an add
+ *
+ * If another node overwrote the claim during collision_timeout, there was
+ * a collision and the lock is left to it. Otherwise the lock is extended,
+ * held from now on, and heartbeated with the others.
+ *
+ * return value --- the reply.
+ */
+static const char *finish_add(control_client *c)
+{
+	int index = c->adding;
+	sfex_lockdata l;
+
+	c->adding = 0;
+	if (read_lockdata(&cdata, &l, index) == -1) {
+		cl_log(LOG_ERR, "read_lockdata failed in collision detection\n");
+		release_lock(index);
+		return "error can't acquire lock\n";
+	}
+	if (l.status != SFEX_STATUS_LOCK || !lockdata_owned_by(&cdata, &l, nodename)) {
+		cl_log(LOG_ERR, "can\'t acquire lock #%d: collision detected in the air.\n", index);
+		return "error can't acquire lock\n";
+	}
+
+	/* extension of lock */
+	l.count = SFEX_NEXT_COUNT(&cdata, l.count);
+	l.expiry = lease_expiry();
+	l.interval = monitor_interval;
+	l.takeover = takeover_ms(monitor_interval);
+	check_watchdog();
+	if (write_lockdata(&cdata, &l, index) == -1) {
+		cl_log(LOG_ERR, "write_lockdata failed in extension of lock\n");
+		release_lock(index);
+		return "error can't acquire lock\n";
+	}
+	if (add_index(index) == -1) {
+		release_lock(index);
+		return "error out of memory\n";
+	}
+	if (update_lockmap(&cdata, &index, 1, 1) == -1)
+		cl_log(LOG_WARNING, "can't update the lock map.\n");
+	cl_log(LOG_INFO, "lock #%d acquired in %lu ms\n", index,
+			(unsigned long)((get_monotonic_usec() - c->claimed) / 1000));
+	return "ok\n";
+}
+
+/*
+ * control_request --- carry out one control socket request
+ *
+ * The request is one line, "add <index>", "del <index>" or "list". The
+ * reply is "ok" followed by the held indexes for list, or "error <reason>".
+ *
+ * return value --- the reply, which the caller frees, or NULL. For an add
+ * which wrote its claim, c->adding is set, and the reply is NULL too.
+ */
+static char *control_request(control_client *c, const char *buf)
+{
+	char reply[64];
+	char *list;
+	char cmd[8];
+	int index = 0;
+	int i, len;
+
+	if (sscanf(buf, "%7s %d", cmd, &index) < 1) {
+		snprintf(reply, sizeof(reply), "error bad request\n");
+	} else if (strcmp(cmd, "list") == 0) {
+		/* an index has at most 7 digits */
+		size_t size = 16 + 8 * (size_t)num_locks;
+
+		list = malloc(size);
+		if (list == NULL) {
+			snprintf(reply, sizeof(reply), "error out of memory\n");
+		} else {
+			len = snprintf(list, size, "ok");
+			for (i = 0; i < num_locks; i++)
+				len += snprintf(list + len, size - len, " %d", lock_indexes[i]);
+			snprintf(list + len, size - len, "\n");
+			return list;
+		}
+	} else if (index < SFEX_MIN_NUMLOCKS || index > cdata.numlocks) {
+		snprintf(reply, sizeof(reply), "error index out of range\n");
+	} else if (strcmp(cmd, "add") == 0) {
+		const char *r = start_add(c, index);
+
+		if (r == NULL)
+			return NULL;
+		snprintf(reply, sizeof(reply), "%s", r);
+	} else if (strcmp(cmd, "del") == 0) {
+		if (find_index(index) == -1) {
+			snprintf(reply, sizeof(reply), "error not held\n");
+		} else {
+			remove_index(index);
+			if (release_lock(index) == -1)
+				snprintf(reply, sizeof(reply), "error can't release lock\n");
+			else
+				snprintf(reply, sizeof(reply), "ok\n");
+		}
+	} else {
+		snprintf(reply, sizeof(reply), "error bad request\n");
+	}
+	return strdup(reply);
+}
+
+static void close_control_client(control_client *c)
+{
+	close(c->fd);
+	free(c->reply);
+	c->fd = -1;
+	c->reply = NULL;
+	c->adding = 0;
+	num_ctl_clients--;
+}
+
+/* accept a client of the control socket into a free slot */
+static void accept_control_client(void)
+{
+	int fd, i;
+
+	fd = accept(ctl_fd, NULL, NULL);
+	if (fd == -1)
+		return;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	for (i = 0; i < SFEX_CONTROL_CLIENTS; i++) {
+		if (ctl_clients[i].fd == -1) {
+			ctl_clients[i].fd = fd;
+			ctl_clients[i].since = get_monotonic_usec();
+			ctl_clients[i].reply = NULL;
+			ctl_clients[i].adding = 0;
+			num_ctl_clients++;
+			return;
+		}
 	}
-	cl_log(LOG_INFO, "lock released\n");
+	close(fd);
 }
 
-static void quit_handler(int signo, siginfo_t *info, void *context)
+/* write what the socket takes of the reply, and close it when done */
+static void write_control_reply(control_client *c)
 {
-	cl_log(LOG_INFO, "quit_handler called. now releasing lock\n");
-	release_lock();
-	cl_log(LOG_INFO, "Shutdown sfex_daemon with EXIT_SUCCESS\n");
-	exit(EXIT_SUCCESS);
+	ssize_t n = write(c->fd, c->reply + c->done, c->len - c->done);
+
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		cl_log(LOG_WARNING, "can't write control reply: %s\n", strerror(errno));
+		close_control_client(c);
+		return;
+	}
+	c->done += n;
+	if (c->done == c->len)
+		close_control_client(c);
+}
+
+/* send the reply of a request which is done, c->reply */
+static void set_control_reply(control_client *c)
+{
+	if (status)
+		publish_status(status->state, 0, 0, 0);
+	if (c->reply == NULL) {
+		close_control_client(c);
+		return;
+	}
+	c->len = strlen(c->reply);
+	c->done = 0;
+	write_control_reply(c);
+}
+
+/*
+ * read_control_request --- read the request of a client and carry it out
+ *
+ * As before, the first read which returns data is the request.
+ */
+static void read_control_request(control_client *c)
+{
+	char buf[64];
+	ssize_t n = read(c->fd, buf, sizeof(buf) - 1);
+
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		close_control_client(c);
+		return;
+	}
+	buf[n] = '\0';
+
+	c->reply = control_request(c, buf);
+	if (c->adding)
+		return;
+	set_control_reply(c);
+}
+
+/*
+ * control_fds --- add the control socket and its clients to the sets
+ *
+ * return value --- the select() timeout in ms for the first client to
+ * time out or add to be finished, or -1 if there is none.
+ */
+static long control_fds(fd_set *rfds, fd_set *wfds, int *maxfd)
+{
+	uint64_t now = get_monotonic_usec();
+	long timeout = -1;
+	int i;
+
+	if (num_ctl_clients < SFEX_CONTROL_CLIENTS) {
+		FD_SET(ctl_fd, rfds);
+		if (ctl_fd > *maxfd)
+			*maxfd = ctl_fd;
+	}
+	for (i = 0; i < SFEX_CONTROL_CLIENTS; i++) {
+		control_client *c = &ctl_clients[i];
+		uint64_t end = c->since + SFEX_CONTROL_TIMEOUT * 1000ULL;
+		long left;
+
+		if (c->fd == -1)
+			continue;
+		if (c->adding)
+			end = c->claimed + collision_timeout * 1000ULL;
+		else
+			FD_SET(c->fd, c->reply ? wfds : rfds);
+		if (c->fd > *maxfd)
+			*maxfd = c->fd;
+		left = end > now ? (long)((end - now + 999) / 1000) : 0;
+		if (timeout == -1 || left < timeout)
+			timeout = left;
+	}
+	return timeout;
+}
+
+/* serve the control socket and its clients which select() found ready */
+static void handle_control(fd_set *rfds, fd_set *wfds)
+{
+	uint64_t now = get_monotonic_usec();
+	int i;
+
+	for (i = 0; i < SFEX_CONTROL_CLIENTS; i++) {
+		control_client *c = &ctl_clients[i];
+
+		if (c->fd == -1)
+			continue;
+		if (c->adding) {
+			if (now < c->claimed + collision_timeout * 1000ULL)
+				continue;
+			c->reply = strdup(finish_add(c));
+			c->since = get_monotonic_usec();
+			set_control_reply(c);
+		} else if (c->reply == NULL && FD_ISSET(c->fd, rfds))
+			read_control_request(c);
+		else if (c->reply != NULL && FD_ISSET(c->fd, wfds))
+			write_control_reply(c);
+		else if (now - c->since >= SFEX_CONTROL_TIMEOUT * 1000ULL) {
+			cl_log(LOG_WARNING, "control client timed out.\n");
+			close_control_client(c);
+		}
+	}
+	if (FD_ISSET(ctl_fd, rfds))
+		accept_control_client();
+}
+
+/*
+ * start_timer --- start the heartbeat timer
+ *
+ * The timer fires every monitor_interval on a fixed CLOCK_MONOTONIC
+ * schedule, so a slow heartbeat does not delay the following ones.
+ */
+static int start_timer(void)
+{
+	struct itimerspec its;
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (timer_fd == -1) {
+		cl_log(LOG_ERR, "timerfd_create failed: %s\n", strerror(errno));
+		return -1;
+	}
+	its.it_interval.tv_sec = monitor_interval / 1000;
+	its.it_interval.tv_nsec = (monitor_interval % 1000) * 1000000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(timer_fd, 0, &its, NULL) == -1) {
+		cl_log(LOG_ERR, "timerfd_settime failed: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * wait_interval --- wait for the next heartbeat
+ *
+ * The control socket and its clients are served meanwhile.
+ *
+ * return value --- 0 when the heartbeat is due, -1 if the daemon is to stop.
+ */
+static int wait_interval(void)
+{
+	while (1) {
+		uint64_t expirations;
+		fd_set rfds, wfds;
+		struct timeval tv;
+		long timeout = -1;
+		int maxfd = timer_fd > sig_fd ? timer_fd : sig_fd;
+
+		if (quit_signo)
+			return -1;
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(timer_fd, &rfds);
+		FD_SET(sig_fd, &rfds);
+		if (ctl_fd != -1)
+			timeout = control_fds(&rfds, &wfds, &maxfd);
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		if (select(maxfd + 1, &rfds, &wfds, NULL, timeout == -1 ? NULL : &tv) == -1) {
+			if (errno == EINTR)
+				continue;
+			cl_log(LOG_ERR, "select failed: %s\n", strerror(errno));
+			error_todo();
+			exit(EXIT_FAILURE);
+		}
+		if (FD_ISSET(sig_fd, &rfds) && check_quit())
+			return -1;
+		if (ctl_fd != -1)
+			handle_control(&rfds, &wfds);
+		if (FD_ISSET(timer_fd, &rfds)
+		    && read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+			if (expirations > 1)
+				cl_log(LOG_WARNING, "heartbeat is late, %llu interval(s) missed\n",
+						(unsigned long long)(expirations - 1));
+			return 0;
+		}
+	}
 }
 
 int main(int argc, char *argv[])
@@ -201,67 +1420,62 @@ int main(int argc, char *argv[])
 	/* read command line option */
 	opterr = 0;
 	while (1) {
-		int c = getopt(argc, argv, "hi:c:t:m:n:r:");
+		int c = getopt(argc, argv, "hi:c:t:m:M:n:r:s:I:T:P:W:w:D:F");
 		if (c == -1)
 			break;
 		switch (c) {
 			case 'h':           /* help*/
 				usage(stdout);
 				exit(EXIT_SUCCESS);
-			case 'i':           /* -i <index> */
-				{
-					unsigned long l = strtoul(optarg, NULL, 10);
-					if (l < SFEX_MIN_NUMLOCKS || l > SFEX_MAX_NUMLOCKS) {
-						cl_log(LOG_ERR, 
-								"index %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
-								optarg,
-								(unsigned long)SFEX_MIN_NUMLOCKS,
-								(unsigned long)SFEX_MAX_NUMLOCKS);
-						exit(4);
-					}
-					lock_index = l;
+			case 'i':           /* -i <index>[,<index>...] */
+				if (parse_index_list(optarg) == -1) {
+					cl_log(LOG_ERR, 
+							"index %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
+							optarg,
+							(unsigned long)SFEX_MIN_NUMLOCKS,
+							(unsigned long)SFEX_MAX_NUMLOCKS_V2);
+					exit(4);
 				}
 				break;
 			case 'c':           /* -c <collision_timeout> */
-				{
-					unsigned long l = strtoul(optarg, NULL, 10);
-					if (l < 1 || l > INT_MAX) {
-						cl_log(LOG_ERR, 
-								"collision_timeout %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
-								optarg,
-								(unsigned long)1,
-								(unsigned long)INT_MAX);
-						exit(4);
-					}
-					collision_timeout = l;
+				if (parse_msec(optarg, &collision_timeout) == -1) {
+					cl_log(LOG_ERR, 
+							"collision_timeout %s is out of range or invalid. it must be seconds such as 1 or 0.5, or milliseconds such as 500ms, between 1ms and %lums.\n",
+							optarg,
+							(unsigned long)INT_MAX);
+					exit(4);
 				}
 				break;
 			case 'm':  			/* -m <monitor_interval> */
-				{
-					unsigned long l = strtoul(optarg, NULL, 10);
-					if (l < 1 || l > INT_MAX) {
-						cl_log(LOG_ERR, 
-								"monitor_interval %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
-								optarg,
-								(unsigned long)1,
-								(unsigned long)INT_MAX);
-						exit(4);
-					}
-					monitor_interval = l;
+				if (parse_msec(optarg, &monitor_interval) == -1) {
+					cl_log(LOG_ERR, 
+							"monitor_interval %s is out of range or invalid. it must be seconds such as 1 or 0.5, or milliseconds such as 500ms, between 1ms and %lums.\n",
+							optarg,
+							(unsigned long)INT_MAX);
+					exit(4);
 				}
 				break;	
-			case 't':           /* -t <lock_timeout> */
+			case 'M':           /* -M <missed_heartbeats> */
 				{
 					unsigned long l = strtoul(optarg, NULL, 10);
-					if (l < 1 || l > INT_MAX) {
+					if (l > INT_MAX) {
 						cl_log(LOG_ERR, 
-								"lock_timeout %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
+								"missed_heartbeats %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
 								optarg,
-								(unsigned long)1,
+								(unsigned long)0,
 								(unsigned long)INT_MAX);
 						exit(4);
 					}
-					lock_timeout = l;
+					missed_heartbeats = l;
+				}
+				break;
+			case 't':           /* -t <lock_timeout> */
+				if (parse_msec(optarg, &lock_timeout) == -1) {
+					cl_log(LOG_ERR, 
+							"lock_timeout %s is out of range or invalid. it must be seconds such as 1 or 0.5, or milliseconds such as 500ms, between 1ms and %lums.\n",
+							optarg,
+							(unsigned long)INT_MAX);
+					exit(4);
 				}
 				break;
 			case 'n':
@@ -281,6 +1495,63 @@ int main(int argc, char *argv[])
 					rsc_id = strdup(optarg);
 				}
 				break;
+			case 's':           /* -s <control_socket> */
+				ctl_path = optarg;
+				break;
+			case 'I':           /* -I <io_backend> */
+				if (sfex_set_io_backend(optarg) == -1) {
+					cl_log(LOG_ERR, "I/O backend %s is not available.\n", optarg);
+					exit(4);
+				}
+				break;
+			case 'T':           /* -T <stop_timeout> */
+				if (parse_msec(optarg, &stop_timeout) == -1) {
+					cl_log(LOG_ERR, "stop_timeout %s is out of range or invalid.\n", optarg);
+					exit(4);
+				}
+				break;
+			case 'P':           /* -P <status_file> */
+				status_path = optarg;
+				break;
+			case 'W':           /* -W <latency_window> */
+				if (parse_msec(optarg, &latency_window) == -1) {
+					cl_log(LOG_ERR, "latency_window %s is out of range or invalid.\n", optarg);
+					exit(4);
+				}
+				break;
+			case 'w':           /* -w <warn_fraction> */
+				{
+					char *end;
+
+					warn_fraction = strtod(optarg, &end);
+					if (*end == '%')
+						warn_fraction /= 100;
+					else if (*end != '\0')
+						warn_fraction = -1;
+					if (warn_fraction < 0 || warn_fraction > 1) {
+						cl_log(LOG_ERR, "warn_fraction %s is invalid. it must be between 0 and 1, or 0%% and 100%%.\n", optarg);
+						exit(4);
+					}
+				}
+				break;
+			case 'D':           /* -D <deadline_fraction> */
+				{
+					char *end;
+
+					deadline_fraction = strtod(optarg, &end);
+					if (*end == '%')
+						deadline_fraction /= 100;
+					else if (*end != '\0')
+						deadline_fraction = -1;
+					if (deadline_fraction < 0 || deadline_fraction >= 1) {
+						cl_log(LOG_ERR, "deadline_fraction %s is invalid. it must be 0, or more than 0 and less than 1.\n", optarg);
+						exit(4);
+					}
+				}
+				break;
+			case 'F':           /* -F, stay in the foreground */
+				foreground = 1;
+				break;
 			case '?':           /* error */
 				usage(stderr);
 				exit(4);
@@ -291,14 +1562,16 @@ int main(int argc, char *argv[])
 		cl_log(LOG_ERR, "no device specified.\n");
 		usage(stderr);
 		exit(EXIT_FAILURE);
-	} else if (optind + 1 < argc) {
-		cl_log(LOG_ERR, "too many arguments.\n");
-		usage(stderr);
-		exit(EXIT_FAILURE);
 	}
-	device = argv[optind];
+	if (monitor_interval >= lock_timeout) {
+		cl_log(LOG_WARNING, "monitor_interval %lums is not shorter than lock_timeout %lums. the lock may be taken over while it is held.\n",
+				monitor_interval, lock_timeout);
+	}
+	if (num_locks == 0)
+		add_index(1);   /* default 1st lock */
 
-	prepare_lock(device);
+	for (; optind < argc; optind++)
+		prepare_lock(argv[optind]);
 #if !SFEX_TESTING
 	sysrq_fd = open("/proc/sysrq-trigger", O_WRONLY);
 	if (sysrq_fd == -1) {
@@ -307,39 +1580,113 @@ int main(int argc, char *argv[])
 	}
 #endif
 
-	ret = lock_index_check(&cdata, lock_index);
+	ret = lock_index_check(&cdata, lock_indexes[num_locks - 1]);
 	if (ret == -1)
 		exit(EXIT_FAILURE);
 
 	{
-		struct sigaction sig_act;
-		sigemptyset (&sig_act.sa_mask);
-		sig_act.sa_flags = SA_SIGINFO;
-
-		sig_act.sa_sigaction = quit_handler;
-		ret = sigaction(SIGTERM, &sig_act, NULL);
-		if (ret == -1) {
-			cl_log(LOG_ERR, "sigaction failed\n");
+		sigset_t mask;
+
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGTERM);
+		sigaddset(&mask, SIGINT);
+		sigaddset(&mask, SIGUSR1);
+		if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1
+		    || (sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+			cl_log(LOG_ERR, "signalfd failed: %s\n", strerror(errno));
 			exit(EXIT_FAILURE);
 		}
 	}
+	if (stop_timeout == 0)
+		stop_timeout = lock_timeout;
+	deadline_usec = lease_usec() * deadline_fraction;
+	if (deadline_usec != 0 && deadline_usec <= monitor_interval * 1000ULL) {
+		cl_log(LOG_ERR, "heartbeat deadline %lums (%g of the lease %lums) is not longer than monitor_interval %lums.\n",
+				(unsigned long)(deadline_usec / 1000), deadline_fraction,
+				(unsigned long)(lease_usec() / 1000), monitor_interval);
+		exit(4);
+	}
+
+	if (status_path != NULL) {
+		status = status_page_create(status_path);
+		if (status == NULL)
+			exit(EXIT_FAILURE);
+	}
 
 	cl_log(LOG_INFO, "Starting SFeX Daemon...\n");
 	
 	/* acquire lock first.*/
-	acquire_lock();
+	{
+		uint64_t start = get_monotonic_usec();
+		int *indexes = malloc(sizeof(*indexes) * num_locks);
+		int *results = malloc(sizeof(*results) * num_locks);
+		int n = num_locks;
+		int i;
+
+		if (indexes == NULL || results == NULL) {
+			cl_log(LOG_ERR, "%s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		memcpy(indexes, lock_indexes, sizeof(*indexes) * n);
+		acquired_usec = 0;
+		ret = acquire_lock_set(indexes, n, results);
+		if (ret != 0) {
+			/* keep only the locks we got, to give them back */
+			for (i = 0; i < n; i++) {
+				if (results[i] != 0)
+					remove_index(indexes[i]);
+			}
+			if (ret == -1)
+				stop_daemon();
+			release_all_locks();
+			exit(ret);
+		}
+		if (update_lockmap(&cdata, indexes, n, 1) == -1)
+			cl_log(LOG_WARNING, "can't update the lock map.\n");
+		if (n > 1)
+			cl_log(LOG_INFO, "%d locks acquired in %lu ms\n", n,
+					(unsigned long)((get_monotonic_usec() - start) / 1000));
+		free(results);
+		free(indexes);
+	}
 
-	if (daemon(0, 1) != 0) {
+	if (!foreground && daemon(0, 1) != 0) {
 		cl_perror("%s::%d: daemon() failed.", __FUNCTION__, __LINE__);
-		release_lock();
+		release_all_locks();
+		exit(EXIT_FAILURE);
+	}
+	if (sfex_io_reinit() == -1) {
+		error_todo();
+		exit(EXIT_FAILURE);
+	}
+
+	if (ctl_path != NULL) {
+		ctl_fd = open_control_socket(ctl_path);
+		if (ctl_fd == -1) {
+			release_all_locks();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (start_timer() == -1) {
+		release_all_locks();
 		exit(EXIT_FAILURE);
 	}
 
 	cl_make_realtime(-1, -1, 128, 128);
+
+	/* the lease of the first lock runs since its acquisition */
+	if (deadline_usec != 0 && start_watchdog() == -1) {
+		release_all_locks();
+		exit(EXIT_FAILURE);
+	}
+	arm_watchdog(acquired_usec);
 	
+	/* the acquisition counts as the first heartbeat */
+	publish_status(SFEX_STATE_RUNNING, 1, ldata.count, 0);
 	cl_log(LOG_INFO, "SFeX Daemon started.\n");
-	while (1) {
-		sleep (monitor_interval);
+	while (wait_interval() == 0)
 		update_lock();
-	}
+	stop_daemon();
+	return EXIT_SUCCESS;
 }
@@ -0,0 +1,664 @@
+/*-------------------------------------------------------------------------
+ *
+ * Shared Disk File EXclusiveness Control Program(SF-EX)
+ *
+ * sfex_failbench.c --- Measure the sfex protocol under contention and
+ * failures.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *-------------------------------------------------------------------------
+ *
+ * sfex_failbench [-D <daemon>] [-N <nodes>] [-r <rounds>] [-s <scenarios>]
+ *                [-c <collision_timeout>] [-t <lock_timeout>]
+ *                [-m <monitor_interval>] [-H <hold>] [-l <latency>]
+ *                [-f <format>] [-v] <device>
+ *
+ * Run simulated nodes, each an sfex_daemon process with its own node name,
+ * against one lock of <device>, and watch the lock data to see which node
+ * holds the lock. <device> is formatted with <nodes> + 1 locks, the others
+ * for the mixed scenario, so it should be a file, a loop device or
+ * mem:<name> (see README.sfex).
+ *
+ * Every round of a scenario starts <nodes> daemons at once on a free lock,
+ * lets the winner hold it for <hold>, and then
+ *   start   --- stops all the daemons
+ *   release --- stops the holder with SIGTERM and starts the others again
+ *   crash   --- kills the holder with SIGKILL and starts the others again
+ *   hang    --- stops the holder with SIGSTOP and starts the others again.
+ *               After the takeover the holder is continued; it must notice
+ *               that it lost the lock and fence itself.
+ *   mixed   --- before the daemons start, another node takes a lock for
+ *               each of them and is stopped with SIGSTOP. Each daemon is
+ *               started on the free lock and its own held lock, so it
+ *               claims the free lock while it polls the held one every
+ *               half interval, and takes the held one over later.
+ *   stall   --- one daemon is started alone, and its first heartbeat
+ *               write hangs with the signals held (the stall fault of
+ *               fault:), as a write to a failed path does. The others are
+ *               started then; the stalled holder must fence itself before
+ *               any of them claims the lock.
+ * The new holder is held for <hold> again before the next round.
+ *
+ * One line of key=value pairs is printed per scenario:
+ *   acquire_*_ms  --- for start, from starting the daemons to the first
+ *                     holder confirming the lock, i.e. its second write;
+ *                     otherwise from the failure to the new holder
+ *                     confirming it
+ *   collisions    --- holders seen which never confirmed the lock
+ *   claim_min_ms  --- the shortest time from seeing a claim of the lock to
+ *                     seeing it confirmed. It must not be shorter than
+ *                     collision_timeout, or a collision may go unnoticed.
+ *   false_failovers --- the lock moved away from a running holder
+ *   fenced        --- hung holders which exited after being continued,
+ *                     or stalled holders which exited before the lock was
+ *                     claimed by another node
+ *   unfenced      --- hung holders still running afterwards, or stalled
+ *                     holders which had not exited by then
+ *   fence_margin_min_ms --- for stall, the shortest time from the holder
+ *                     fencing itself to another node claiming the lock
+ *   timeouts      --- rounds in which no node got the lock
+ *   hb_p99_ms, hb_max_ms --- the heartbeat interval seen on the device
+ *
+ * -D <daemon> --- The sfex_daemon to run. It should be built with
+ * SFEX_TESTING, so that a node fencing itself exits instead of rebooting
+ * the host. Default is ./sfex_daemon_test.
+ *
+ * -l <latency> --- I/O latency injected in the daemons with the fault:
+ * storage backend.
+ *
+ * The times are given as for sfex_daemon. Defaults are -N 3 -r 5 -c 200ms
+ * -t 3 -m 500ms -H 2 and all the scenarios.
+ *
+ * exit code --- 0 - Normal end. 3 - Error occurs while processing it.
+ * 4 - The mistake is found in the command line parameter.
+ *
+ *-------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include "sfex.h"
+#include "sfex_lib.h"
+
+#define MAX_NODES 64
+#define LOCK_INDEX 1
+/* the lock of node i held by the stopped node of mixed */
+#define HELD_INDEX(i) (LOCK_INDEX + 1 + (i))
+
+const char *progname;
+char *nodename;
+
+static sfex_controldata cdata;
+static const char *daemon_path = "./sfex_daemon_test";
+static const char *device;
+static char node_device[PATH_MAX + 64];
+static int nnodes = 3;
+static unsigned long collision_timeout = 200, lock_timeout = 3000;
+static unsigned long monitor_interval = 500, hold = 2000, latency = 0;
+static int verbose = 0;
+
+/* a simulated node */
+typedef struct node {
+  char name[32];
+  pid_t pid;			/* 0 if not running */
+  int status;			/* wait status after it exited */
+} node;
+
+static node nodes[MAX_NODES];
+static node blocker = { "bench-blocker", 0, 0 };	/* of mixed */
+
+/* results of one scenario */
+typedef struct result {
+  unsigned long *acquire;	/* usec */
+  int nacquire;
+  unsigned long *hb;		/* usec */
+  int nhb, hb_size;
+  unsigned long claim_min;	/* usec, 0 if none seen */
+  unsigned long fence_margin_min;	/* usec, 0 if none seen */
+  int collisions, false_failovers, fenced, unfenced, timeouts;
+} result;
+
+static void usage(FILE *dist) {
+  fprintf(dist, "usage: %s [-D <daemon>] [-N <nodes>] [-r <rounds>] [-s <scenarios>]"
+	  " [-c <collision_timeout>] [-t <lock_timeout>] [-m <monitor_interval>]"
+	  " [-H <hold>] [-l <latency>] [-f <format>] [-v] <device>\n", progname);
+}
+
+static int
+cmp_ulong(const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * start_node --- run sfex_daemon in the foreground as node n on indexes
+ * of dev
+ */
+static void
+start_node(node *n, const char *idx, const char *dev)
+{
+  char c[32], t[32], m[32];
+  pid_t pid;
+
+  snprintf(c, sizeof(c), "%lums", collision_timeout);
+  snprintf(t, sizeof(t), "%lums", lock_timeout);
+  snprintf(m, sizeof(m), "%lums", monitor_interval);
+
+  pid = fork();
+  if (pid == -1) {
+    fprintf(stderr, "%s: ERROR: fork failed: %s\n", progname, strerror(errno));
+    exit(3);
+  }
+  if (pid == 0) {
+    if (!verbose) {
+      int fd = open("/dev/null", O_WRONLY);
+
+      dup2(fd, 1);
+      dup2(fd, 2);
+    }
+    execl(daemon_path, daemon_path, "-F", "-n", n->name, "-i", idx,
+	  "-c", c, "-t", t, "-m", m, dev, (char *)NULL);
+    fprintf(stderr, "%s: ERROR: can't run %s: %s\n", progname, daemon_path,
+	    strerror(errno));
+    _exit(127);
+  }
+  n->pid = pid;
+}
+
+/*
+ * reap_nodes --- collect the nodes which have exited
+ */
+static void
+reap_nodes(void)
+{
+  int i, status;
+
+  for (i = 0; i < nnodes; i++) {
+    if (nodes[i].pid && waitpid(nodes[i].pid, &status, WNOHANG) == nodes[i].pid) {
+      nodes[i].pid = 0;
+      nodes[i].status = status;
+      if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+	exit(3);
+    }
+  }
+}
+
+/*
+ * stop_nodes --- stop all running nodes and wait for them
+ */
+static void
+stop_nodes(void)
+{
+  int i;
+
+  for (i = 0; i < nnodes; i++) {
+    if (nodes[i].pid) {
+      kill(nodes[i].pid, SIGCONT);
+      kill(nodes[i].pid, SIGTERM);
+    }
+  }
+  for (i = 0; i < nnodes; i++) {
+    if (nodes[i].pid) {
+      waitpid(nodes[i].pid, &nodes[i].status, 0);
+      nodes[i].pid = 0;
+    }
+  }
+}
+
+/* Return the node holding ldata, or -1. */
+static int
+holder_of(const sfex_lockdata *ldata)
+{
+  int i;
+
+  if (ldata->status != SFEX_STATUS_LOCK)
+    return -1;
+  for (i = 0; i < nnodes; i++)
+    if (strcmp(ldata->nodename, nodes[i].name) == 0)
+      return i;
+  return -1;
+}
+
+/* read the lock data, retrying a block caught in the middle of a write */
+static void
+read_lock(sfex_lockdata *ldata, int index)
+{
+  int tries;
+
+  for (tries = 0; read_lockdata(&cdata, ldata, index) == -1; tries++) {
+    if (tries == 100)
+      exit(3);
+    sleep_msec(1);
+  }
+}
+
+/*
+ * wait_holder --- wait until a node other than old confirms the lock
+ *
+ * A node has confirmed the lock when its count moved after it was first
+ * seen, which it does only after its collision check. Holders seen which
+ * did not confirm are counted as collisions. If record is set, the time
+ * from since is added to the acquire times.
+ *
+ * return value --- the new holder, or -1 on timeout.
+ */
+static int
+wait_holder(int old, uint64_t since, int record, result *res)
+{
+  uint64_t deadline = since + (lock_timeout + collision_timeout
+			       + 2 * monitor_interval + 5000) * 1000ULL;
+  sfex_lockdata ldata;
+  int seen = -1;
+  uint64_t first_count = 0, first_seen = 0;
+
+  while (get_monotonic_usec() < deadline) {
+    uint64_t now;
+    int h;
+
+    read_lock(&ldata, LOCK_INDEX);
+    now = get_monotonic_usec();
+    h = holder_of(&ldata);
+    if (h != -1 && h != old) {
+      if (h != seen) {
+	if (seen != -1)
+	  res->collisions++;
+	seen = h;
+	first_count = ldata.count;
+	first_seen = now;
+      } else if (ldata.count != first_count) {
+	if (res->claim_min == 0 || now - first_seen < res->claim_min)
+	  res->claim_min = now - first_seen;
+	if (record)
+	  res->acquire[res->nacquire++] = now - since;
+	return h;
+      }
+    }
+    reap_nodes();
+    sleep_msec(1);
+  }
+  res->timeouts++;
+  return -1;
+}
+
+/*
+ * watch_holder --- watch the holder for hold ms
+ *
+ * The intervals between its heartbeats are recorded. If the lock moves
+ * away while the holder is running, it is a false failover.
+ */
+static void
+watch_holder(int h, result *res)
+{
+  uint64_t end = get_monotonic_usec() + hold * 1000ULL;
+  uint64_t last = 0;
+  sfex_lockdata ldata;
+  uint64_t count;
+
+  read_lock(&ldata, LOCK_INDEX);
+  count = ldata.count;
+  while (get_monotonic_usec() < end) {
+    uint64_t now;
+
+    sleep_msec(1);
+    read_lock(&ldata, LOCK_INDEX);
+    now = get_monotonic_usec();
+    if (holder_of(&ldata) != h) {
+      reap_nodes();
+      if (nodes[h].pid)
+	res->false_failovers++;
+      return;
+    }
+    if (ldata.count != count) {
+      count = ldata.count;
+      if (last) {
+	if (res->nhb == res->hb_size) {
+	  res->hb_size = res->hb_size ? res->hb_size * 2 : 1024;
+	  res->hb = realloc(res->hb, sizeof(*res->hb) * res->hb_size);
+	  if (res->hb == NULL)
+	    exit(3);
+	}
+	res->hb[res->nhb++] = now - last;
+      }
+      last = now;
+    }
+  }
+}
+
+/*
+ * hold_blocker --- make the blocker hold the HELD_INDEX() locks and stop it
+ *
+ * return value --- 0, or -1 if it did not confirm the locks in time.
+ */
+static int
+hold_blocker(void)
+{
+  uint64_t deadline = get_monotonic_usec()
+    + (collision_timeout + 2 * monitor_interval + 5000) * 1000ULL;
+  char idx[16 * MAX_NODES];
+  sfex_lockdata ldata;
+  int i, len = 0;
+
+  for (i = 0; i < nnodes; i++)
+    len += snprintf(idx + len, sizeof(idx) - len, i ? ",%d" : "%d",
+		    HELD_INDEX(i));
+  start_node(&blocker, idx, node_device);
+  for (i = 0; i < nnodes && get_monotonic_usec() < deadline; ) {
+    read_lock(&ldata, HELD_INDEX(i));
+    /* a claim and its confirmation are two writes */
+    if (ldata.status == SFEX_STATUS_LOCK && ldata.count >= 2
+	&& strcmp(ldata.nodename, blocker.name) == 0)
+      i++;
+    else
+      sleep_msec(1);
+  }
+  if (i < nnodes)
+    return -1;
+  kill(blocker.pid, SIGSTOP);
+  return 0;
+}
+
+/*
+ * run_stall --- a round of the stall scenario
+ *
+ * Node 0 acquires the lock alone with three write batches, the claim, its
+ * confirmation and the lock map, so the fourth one, its first heartbeat,
+ * is the one to hang.
+ */
+static void
+run_stall(result *res)
+{
+  char dev[PATH_MAX + 128], idx[32];
+  uint64_t t, fenced = 0, claimed = 0, deadline;
+  sfex_lockdata ldata;
+  int i;
+
+  if (latency)
+    snprintf(dev, sizeof(dev), "fault:delay=%lums,stall=%lums,stallafter=3:%s",
+	     latency, 4 * lock_timeout, device);
+  else
+    snprintf(dev, sizeof(dev), "fault:stall=%lums,stallafter=3:%s",
+	     4 * lock_timeout, device);
+  snprintf(idx, sizeof(idx), "%d", LOCK_INDEX);
+  t = get_monotonic_usec();
+  start_node(&nodes[0], idx, dev);
+  if (wait_holder(-1, t, 0, res) != 0)
+    return;
+
+  t = get_monotonic_usec();
+  for (i = 1; i < nnodes; i++)
+    start_node(&nodes[i], idx, node_device);
+  deadline = t + (lock_timeout + collision_timeout
+		  + 2 * monitor_interval + 5000) * 1000ULL;
+  while (!claimed && get_monotonic_usec() < deadline) {
+    reap_nodes();
+    if (!fenced && nodes[0].pid == 0)
+      fenced = get_monotonic_usec();
+    read_lock(&ldata, LOCK_INDEX);
+    if (!claimed && holder_of(&ldata) > 0)
+      claimed = get_monotonic_usec();
+    sleep_msec(1);
+  }
+  if (fenced) {
+    res->fenced++;
+    if (claimed && (res->fence_margin_min == 0
+		    || claimed - fenced < res->fence_margin_min))
+      res->fence_margin_min = claimed - fenced;
+  } else
+    res->unfenced++;
+  i = wait_holder(0, t, 1, res);
+  if (i != -1)
+    watch_holder(i, res);
+  /* a node still stalled does not take SIGTERM */
+  if (nodes[0].pid)
+    kill(nodes[0].pid, SIGKILL);
+}
+
+/*
+ * run_round --- one round of a scenario
+ */
+static void
+run_round(const char *scenario, result *res)
+{
+  sfex_lockdata ldata;
+  char idx[32];
+  int mixed = strcmp(scenario, "mixed") == 0;
+  uint64_t t;
+  int h, i;
+
+  /* the locks are free at the start of every round */
+  init_lockdata(&ldata);
+  for (i = LOCK_INDEX; i <= cdata.numlocks; i++)
+    if (write_lockdata(&cdata, &ldata, i) == -1)
+      exit(3);
+  if (mixed && hold_blocker() == -1) {
+    res->timeouts++;
+    goto out;
+  }
+  if (strcmp(scenario, "stall") == 0) {
+    run_stall(res);
+    goto out;
+  }
+
+  t = get_monotonic_usec();
+  for (i = 0; i < nnodes; i++) {
+    if (mixed)
+      snprintf(idx, sizeof(idx), "%d,%d", LOCK_INDEX, HELD_INDEX(i));
+    else
+      snprintf(idx, sizeof(idx), "%d", LOCK_INDEX);
+    start_node(&nodes[i], idx, node_device);
+  }
+  h = wait_holder(-1, t, strcmp(scenario, "start") == 0 || mixed, res);
+  if (h == -1)
+    goto out;
+  watch_holder(h, res);
+  if (strcmp(scenario, "start") == 0 || mixed)
+    goto out;
+
+  reap_nodes();
+  t = get_monotonic_usec();
+  if (strcmp(scenario, "release") == 0) {
+    kill(nodes[h].pid, SIGTERM);
+    waitpid(nodes[h].pid, &nodes[h].status, 0);
+    nodes[h].pid = 0;
+  } else if (strcmp(scenario, "crash") == 0) {
+    kill(nodes[h].pid, SIGKILL);
+    waitpid(nodes[h].pid, &nodes[h].status, 0);
+    nodes[h].pid = 0;
+  } else
+    kill(nodes[h].pid, SIGSTOP);
+  snprintf(idx, sizeof(idx), "%d", LOCK_INDEX);
+  for (i = 0; i < nnodes; i++)
+    if (i != h && nodes[i].pid == 0)
+      start_node(&nodes[i], idx, node_device);
+
+  i = wait_holder(h, t, 1, res);
+  if (strcmp(scenario, "hang") == 0) {
+    uint64_t end;
+
+    /* the old holder has to find out that it lost the lock */
+    kill(nodes[h].pid, SIGCONT);
+    end = get_monotonic_usec() + 2 * monitor_interval * 1000ULL + 1000000;
+    while (nodes[h].pid && get_monotonic_usec() < end) {
+      reap_nodes();
+      sleep_msec(1);
+    }
+    if (nodes[h].pid)
+      res->unfenced++;
+    else
+      res->fenced++;
+  }
+  if (i != -1)
+    watch_holder(i, res);
+
+out:
+  if (blocker.pid) {
+    kill(blocker.pid, SIGKILL);
+    waitpid(blocker.pid, &blocker.status, 0);
+    blocker.pid = 0;
+  }
+  stop_nodes();
+}
+
+static void
+print_result(const char *scenario, int rounds, const result *res)
+{
+  unsigned long *a = res->acquire, *hb = res->hb;
+  int n = res->nacquire, m = res->nhb;
+
+  qsort(a, n, sizeof(*a), cmp_ulong);
+  qsort(hb, m, sizeof(*hb), cmp_ulong);
+  printf("scenario=%s nodes=%d rounds=%d latency_ms=%lu"
+	 " acquire_p50_ms=%.1f acquire_p99_ms=%.1f acquire_max_ms=%.1f"
+	 " collisions=%d claim_min_ms=%.1f false_failovers=%d fenced=%d"
+	 " unfenced=%d fence_margin_min_ms=%.1f timeouts=%d"
+	 " hb_p99_ms=%.1f hb_max_ms=%.1f\n",
+	 scenario, nnodes, rounds, latency,
+	 n ? a[n / 2] / 1000.0 : 0, n ? a[(n * 99) / 100] / 1000.0 : 0,
+	 n ? a[n - 1] / 1000.0 : 0,
+	 res->collisions, res->claim_min / 1000.0, res->false_failovers,
+	 res->fenced, res->unfenced, res->fence_margin_min / 1000.0,
+	 res->timeouts,
+	 m ? hb[(m * 99) / 100] / 1000.0 : 0, m ? hb[m - 1] / 1000.0 : 0);
+  fflush(stdout);
+}
+
+static void
+parse_time(const char *name, const char *arg, unsigned long *msec)
+{
+  if (parse_msec(arg, msec) == -1) {
+    fprintf(stderr, "%s: ERROR: %s %s is out of range or invalid.\n",
+	    progname, name, arg);
+    exit(4);
+  }
+}
+
+int
+main(int argc, char *argv[]) {
+  const char *scenarios = "start,release,crash,hang,mixed,stall";
+  char *list, *scenario;
+  int rounds = 5, version = SFEX_VERSION_V2;
+  sfex_lockdata ldata;
+  int i, r;
+
+  progname = get_progname(argv[0]);
+  cl_log_set_entity(progname);
+  cl_log_enable_stderr(TRUE);
+
+  opterr = 0;
+  while (1) {
+    int c = getopt(argc, argv, "hD:N:r:s:c:t:m:H:l:f:v");
+    if (c == -1)
+      break;
+    switch (c) {
+    case 'h':
+      usage(stdout);
+      exit(0);
+    case 'D':
+      daemon_path = optarg;
+      break;
+    case 'N':
+      nnodes = atoi(optarg);
+      break;
+    case 'r':
+      rounds = atoi(optarg);
+      break;
+    case 's':
+      scenarios = optarg;
+      break;
+    case 'c':
+      parse_time("collision_timeout", optarg, &collision_timeout);
+      break;
+    case 't':
+      parse_time("lock_timeout", optarg, &lock_timeout);
+      break;
+    case 'm':
+      parse_time("monitor_interval", optarg, &monitor_interval);
+      break;
+    case 'H':
+      parse_time("hold", optarg, &hold);
+      break;
+    case 'l':
+      parse_time("latency", optarg, &latency);
+      break;
+    case 'f':
+      version = atoi(optarg);
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case '?':
+      usage(stderr);
+      exit(4);
+    }
+  }
+  if (optind + 1 != argc || nnodes < 2 || nnodes > MAX_NODES || rounds < 1
+      || (version != SFEX_VERSION && version != SFEX_VERSION_V2)) {
+    usage(stderr);
+    exit(4);
+  }
+  device = argv[optind];
+  if (latency)
+    snprintf(node_device, sizeof(node_device), "fault:delay=%lums:%s",
+	     latency, device);
+  else
+    snprintf(node_device, sizeof(node_device), "%s", device);
+
+  nodename = get_nodename();
+  for (i = 0; i < nnodes; i++)
+    snprintf(nodes[i].name, sizeof(nodes[i].name), "bench-node%d", i + 1);
+
+  /* format the device with the locks */
+  prepare_lock(device);
+  init_controldata(&cdata, physical_block_size, HELD_INDEX(nnodes - 1),
+		   version);
+  init_lockdata(&ldata);
+  if (write_metadata(&cdata, &ldata) == -1)
+    exit(3);
+
+  list = strdup(scenarios);
+  for (scenario = strtok(list, ","); scenario; scenario = strtok(NULL, ",")) {
+    result res;
+
+    if (strcmp(scenario, "start") && strcmp(scenario, "release")
+	&& strcmp(scenario, "crash") && strcmp(scenario, "hang")
+	&& strcmp(scenario, "mixed") && strcmp(scenario, "stall")) {
+      fprintf(stderr, "%s: ERROR: unknown scenario %s.\n", progname, scenario);
+      exit(4);
+    }
+    memset(&res, 0, sizeof(res));
+    res.acquire = malloc(sizeof(*res.acquire) * rounds);
+    if (res.acquire == NULL)
+      exit(3);
+    for (r = 0; r < rounds; r++)
+      run_round(scenario, &res);
+    print_result(scenario, rounds, &res);
+    free(res.acquire);
+    free(res.hb);
+  }
+  free(list);
+  exit(0);
+}
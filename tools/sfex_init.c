@@ -25,7 +25,8 @@
  *
  *-------------------------------------------------------------------------
  *
- * sfex_init [-b <blocksize>] [-n <numlocks>] <device>
+ * sfex_init [-b <blocksize>] [-n <numlocks>] [-f <format>] [-I <io_backend>]
+ *           [-S] [-v] <device> [<device>...]
  *
  * -b <blocksize> --- The size of the block is specified by the number of 
  * bytes. In general, to prevent a partial writing to the disk, the size 
@@ -34,15 +35,40 @@
  * adjustment in the input-output buffer in the program when direct I/O 
  * is used(When you specify --enable-directio option for configure script). 
  * (In Linux kernel 2.6, "direct I/O " does not work if this value is not 
- * a multiple of 512.) Default is 512 bytes.
+ * a multiple of 512.) It must be a power of 2 and a multiple of the sector 
+ * size. Default is the physical block size of the device (BLKPBSZGET), so
+ * that a 512e drive, which has 512 byte sectors on 4KiB physical blocks,
+ * gets 4096 byte blocks and no write of lock data makes it read and write
+ * back a physical block. 512 for a regular file.
  *
  * -n <numlocks> --- The number of storing lock data is specified by integer 
  * of one or more. When you want to control two or more resources by one 
  * meta-data, you set the value of two or more to numlocks. A necessary disk 
  * area for meta data are (blocksize*(1+numlocks))bytes. Default is 1.
+ * Format 1 stores up to 999 locks, format 2 up to 1048576. Format 2 also
+ * writes a lock map of one bit per lock after the lock data, in
+ * ceil(numlocks/((blocksize-16)*8)) more blocks.
+ *
+ * -f <format> --- The on-disk format version, 1 or 2. Version 2 stores 
+ * binary fields with a checksum and a counter which never wraps. It can 
+ * be read only by sfex 1.3 or later with version 2 support, so all nodes 
+ * must be upgraded before it is used. Default is 1.
+ *
+ * -I <io_backend> --- The I/O backend, as sfex_daemon -I. With "async" the
+ * large writes of the meta-data are kept in flight together.
+ *
+ * -S --- Write the control data and each lock data with a separate write,
+ * as older sfex_init did. This is only for comparing the time taken.
+ *
+ * -v, --verify --- Read the whole meta-data back at once after writing it
+ * and check that it matches.
+ *
+ * The time taken to write (and verify) the meta-data is printed.
  *
  * <device> --- This is file path which stored meta-data. It is usually 
  * expressed in "/dev/...", because it is partition on the shared disk.
+ * With several devices, each holds a replica of the meta-data, and all of
+ * them are initialized together.
  *
  * exit code --- 0 - Normal end. 3 - Error occurs while processing it. 
  * The content of the error is displayed into stderr. 4 - The mistake is 
@@ -57,6 +83,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <stdint.h>
 
 #include "sfex.h"
 #include "sfex_lib.h"
@@ -75,7 +102,7 @@ char *nodename;
  * return value --- void
  */
 static void usage(FILE *dist) {
-  fprintf(dist, "usage: %s [-n <numlocks>] <device>\n", progname);
+  fprintf(dist, "usage: %s [-b <blocksize>] [-n <numlocks>] [-f <format>] [-I <io_backend>] [-S] [-v] <device> [<device>...]\n", progname);
 }
 
 /*
@@ -91,10 +118,21 @@ int
 main(int argc, char *argv[]) {
   sfex_controldata cdata;
   sfex_lockdata ldata;
+  uint64_t start, size;
+  unsigned long calls;
+  int i;
+  static const struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"verify", no_argument, NULL, 'v'},
+    {NULL, 0, NULL, 0}
+  };
 
   /* command line parameter */
+  unsigned long blocksize = 0;	/* default see below */
   int numlocks = 1;		/* default 1 locks  */
-  const char *device;
+  int version = SFEX_VERSION;	/* default format version 1 */
+  int per_block = 0;		/* -S */
+  int verify = 0;		/* -v */
 
   /*
    *  startup process
@@ -111,27 +149,64 @@ main(int argc, char *argv[]) {
   /* read command line option */
   opterr = 0;
   while (1) {
-    int c = getopt(argc, argv, "hn:");
+    int c = getopt_long(argc, argv, "hb:n:f:I:Sv", long_options, NULL);
     if (c == -1)
       break;
     switch (c) {
     case 'h':			/* help */
       usage(stdout);
       exit(0);
+    case 'b':			/* -b <blocksize> */
+      blocksize = strtoul(optarg, NULL, 10);
+      if (blocksize < SFEX_MIN_BLOCKSIZE || blocksize > SFEX_MAX_BLOCKSIZE
+	  || (blocksize & (blocksize - 1)) != 0) {
+	fprintf(stderr,
+		"%s: ERROR: blocksize %s is out of range or invalid. it must be a power of 2 between %lu and %lu.\n",
+		progname, optarg,
+		(unsigned long)SFEX_MIN_BLOCKSIZE,
+		(unsigned long)SFEX_MAX_BLOCKSIZE);
+	exit(4);
+      }
+      break;
     case 'n':			/* -n <numlocks> */
       {
 	unsigned long l = strtoul(optarg, NULL, 10);
-	if (l < SFEX_MIN_NUMLOCKS || l > SFEX_MAX_NUMLOCKS) {
+	if (l < SFEX_MIN_NUMLOCKS || l > SFEX_MAX_NUMLOCKS_V2) {
 	  fprintf(stderr,
 		  "%s: ERROR: numlocks %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
 		  progname, optarg,
 		  (unsigned long)SFEX_MIN_NUMLOCKS,
-		  (unsigned long)SFEX_MAX_NUMLOCKS);
+		  (unsigned long)SFEX_MAX_NUMLOCKS_V2);
 	  exit(4);
 	}
 	numlocks = l;
       }
       break;
+    case 'f':			/* -f <format> */
+      {
+	unsigned long l = strtoul(optarg, NULL, 10);
+	if (l != SFEX_VERSION && l != SFEX_VERSION_V2) {
+	  fprintf(stderr,
+		  "%s: ERROR: format %s is invalid. it must be %d or %d.\n",
+		  progname, optarg, SFEX_VERSION, SFEX_VERSION_V2);
+	  exit(4);
+	}
+	version = l;
+      }
+      break;
+    case 'I':			/* -I <io_backend> */
+      if (sfex_set_io_backend(optarg) == -1) {
+	fprintf(stderr, "%s: ERROR: I/O backend %s is not available.\n",
+		progname, optarg);
+	exit(4);
+      }
+      break;
+    case 'S':			/* -S */
+      per_block = 1;
+      break;
+    case 'v':			/* -v, --verify */
+      verify = 1;
+      break;
     case '?':			/* error */
       usage(stderr);
       exit(4);
@@ -139,18 +214,34 @@ main(int argc, char *argv[]) {
   }
 
   /* check parameter except the option */
+  if (numlocks > SFEX_MAX_LOCKS(version)) {
+    fprintf(stderr, "%s: ERROR: format %d stores at most %lu locks. use -f %d.\n",
+	    progname, version, (unsigned long)SFEX_MAX_LOCKS(version), SFEX_VERSION_V2);
+    exit(4);
+  }
   if (optind >= argc) {
     fprintf(stderr, "%s: ERROR: no device specified.\n", progname);
     usage(stderr);
     exit(4);
-  } else if (optind + 1 < argc) {
-    fprintf(stderr, "%s: ERROR: too many arguments.\n", progname);
-    usage(stderr);
-    exit(4);
   }
-  device = argv[optind];
 
-  prepare_lock(device);
+  for (i = optind; i < argc; i++)
+    prepare_lock(argv[i]);
+  /* every replica must be written, not only a majority */
+  sfex_set_quorum(argc - optind);
+
+  /* sfex before format 2 requires the blocksize of format 1 to be the
+     sector size, so only format 2 defaults to the physical block size */
+  if (blocksize == 0)
+    blocksize = version == SFEX_VERSION ? sector_size : physical_block_size;
+  if (blocksize % sector_size != 0) {
+    fprintf(stderr, "%s: ERROR: blocksize %lu is not a multiple of the sector size %lu.\n",
+	    progname, blocksize, sector_size);
+    exit(4);
+  }
+  if (blocksize < physical_block_size)
+    fprintf(stderr, "%s: WARNING: blocksize %lu is smaller than the physical block size %lu.\n",
+	    progname, blocksize, physical_block_size);
 
   /* main processes start */
 
@@ -158,15 +249,44 @@ main(int argc, char *argv[]) {
   nodename = get_nodename();
 
   /* create and control data and lock data */
-  init_controldata(&cdata, sector_size, numlocks);
+  init_controldata(&cdata, blocksize, numlocks, version);
   init_lockdata(&ldata);
 
+  /* the region is written a few MiB at a time whatever its size, but it
+     must fit on the devices */
+  size = (uint64_t)cdata.blocksize * (numlocks + 1 + lockmap_blocks(&cdata));
+  if (device_size && size > device_size) {
+    fprintf(stderr, "%s: ERROR: the meta-data take %llu bytes, more than the %llu bytes of the device. use a smaller numlocks or blocksize.\n",
+	    progname, (unsigned long long)size, (unsigned long long)device_size);
+    exit(4);
+  }
+
   /* write out control data and lock data */
-  write_controldata(&cdata);
-  {
+  start = get_monotonic_usec();
+  calls = sfex_io_syscalls();
+  if (per_block) {
     int index;
+
+    if (write_controldata(&cdata) == -1)
+      exit(3);
     for (index = 1; index <= numlocks; index++)
-      write_lockdata(&cdata, &ldata, index);
+      if (write_lockdata(&cdata, &ldata, index) == -1)
+	exit(3);
+    if (clear_lockmap(&cdata) == -1)
+      exit(3);
+  } else if (write_metadata(&cdata, &ldata) == -1)
+    exit(3);
+  printf("wrote %llu bytes in %lu ms with %lu I/O calls (%s).\n",
+	 (unsigned long long)size,
+	 (unsigned long)((get_monotonic_usec() - start) / 1000),
+	 sfex_io_syscalls() - calls, sfex_io_backend_name());
+
+  if (verify) {
+    start = get_monotonic_usec();
+    if (verify_metadata(&cdata, &ldata) == -1)
+      exit(3);
+    printf("verified in %lu ms.\n",
+	   (unsigned long)((get_monotonic_usec() - start) / 1000));
   }
 
   exit(0);
@@ -0,0 +1,243 @@
+/*-------------------------------------------------------------------------
+ *
+ * Shared Disk File EXclusiveness Control Program(SF-EX)
+ *
+ * sfex_iobench.c --- Measure the cost of the sfex heartbeat I/O.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *-------------------------------------------------------------------------
+ *
+ * sfex_iobench [-I <io_backend>] [-L] [-n <updates>] [-l <locks>]
+ *              [-g <gap>] <device> [<device>...]
+ *
+ * Repeat the heartbeat of sfex_daemon on a device initialized by
+ * sfex_init, and print the number of I/O system calls per heartbeat and
+ * its latency percentiles as one line of key=value pairs.
+ *
+ * -I <io_backend> --- I/O backend of the sfex library. Default is sync.
+ *
+ * -L --- Instead of the sfex library, use the lseek(2) + read(2) +
+ * lseek(2) + write(2) sequence per lock which sfex used before the I/O
+ * backends were introduced. This gives the baseline to compare with.
+ *
+ * -n <updates> --- The number of heartbeats. Default is 1000.
+ *
+ * -l <locks> --- The number of held locks. Default is 8.
+ *
+ * -g <gap> --- The distance between held indexes. With the default 2, no
+ * two held locks are adjacent, so every lock needs its own write.
+ *
+ * With several devices, the heartbeat completes on a majority of them, as
+ * in sfex_daemon; give one a fault: delay to see that it does not count.
+ * -L takes one device only.
+ *
+ * The blocksize of the meta-data and the physical block size of the device
+ * are printed too. To see what a blocksize smaller than the physical block
+ * size costs, initialize the device with sfex_init -b 512 and with the
+ * default blocksize, and compare.
+ *
+ * exit code --- 0 - Normal end. 3 - Error occurs while processing it.
+ * 4 - The mistake is found in the command line parameter.
+ *
+ *-------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "sfex.h"
+#include "sfex_lib.h"
+
+const char *progname;
+char *nodename;
+
+static void usage(FILE *dist) {
+  fprintf(dist, "usage: %s [-I <io_backend>] [-L] [-n <updates>] [-l <locks>] [-g <gap>] <device> [<device>...]\n", progname);
+}
+
+static unsigned long
+now_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static int
+cmp_ulong(const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * legacy_update --- one heartbeat the way sfex did it with lseek(2)
+ *
+ * Only the I/O is done; the lock data are not parsed.
+ */
+static int
+legacy_update(int fd, void *buf, size_t blocksize, const int *indexes,
+	      int nlocks, unsigned long *syscalls)
+{
+  int i;
+
+  for (i = 0; i < nlocks; i++) {
+    off_t off = (off_t)blocksize * indexes[i];
+
+    if (lseek(fd, off, SEEK_SET) == -1 || read(fd, buf, blocksize) != blocksize
+	|| lseek(fd, off, SEEK_SET) == -1 || write(fd, buf, blocksize) != blocksize) {
+      fprintf(stderr, "%s: ERROR: legacy I/O failed: %s\n", progname, strerror(errno));
+      return -1;
+    }
+    *syscalls += 4;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[]) {
+  sfex_controldata cdata;
+  sfex_lockdata *area, *held;
+  unsigned long *lat;
+  unsigned long syscalls = 0;
+  int *indexes;
+  int legacy = 0;
+  int updates = 1000, nlocks = 8, gap = 2;
+  int span, i, u;
+
+  progname = get_progname(argv[0]);
+  cl_log_set_entity(progname);
+  cl_log_enable_stderr(TRUE);
+
+  opterr = 0;
+  while (1) {
+    int c = getopt(argc, argv, "hI:Ln:l:g:");
+    if (c == -1)
+      break;
+    switch (c) {
+    case 'h':
+      usage(stdout);
+      exit(0);
+    case 'I':
+      if (sfex_set_io_backend(optarg) == -1) {
+	fprintf(stderr, "%s: ERROR: I/O backend %s is not available.\n", progname, optarg);
+	exit(4);
+      }
+      break;
+    case 'L':
+      legacy = 1;
+      break;
+    case 'n':
+      updates = atoi(optarg);
+      break;
+    case 'l':
+      nlocks = atoi(optarg);
+      break;
+    case 'g':
+      gap = atoi(optarg);
+      break;
+    case '?':
+      usage(stderr);
+      exit(4);
+    }
+  }
+  if (optind == argc || (legacy && optind + 1 != argc)
+      || updates < 1 || nlocks < 1 || gap < 1) {
+    usage(stderr);
+    exit(4);
+  }
+
+  nodename = get_nodename();
+  for (i = optind; i < argc; i++)
+    prepare_lock(argv[i]);
+
+  span = (nlocks - 1) * gap + 1;
+  if (lock_index_check(&cdata, span) == -1)
+    exit(3);
+
+  indexes = malloc(sizeof(*indexes) * nlocks);
+  area = malloc(sizeof(*area) * span);
+  held = malloc(sizeof(*held) * nlocks);
+  lat = malloc(sizeof(*lat) * updates);
+  if (!indexes || !area || !held || !lat) {
+    fprintf(stderr, "%s: ERROR: %s\n", progname, strerror(errno));
+    exit(3);
+  }
+  for (i = 0; i < nlocks; i++) {
+    indexes[i] = 1 + i * gap;
+    init_lockdata(&held[i]);
+    held[i].status = SFEX_STATUS_LOCK;
+    set_lockdata_owner(&held[i], nodename);
+  }
+  if (write_lockdata_set(&cdata, held, indexes, 0, nlocks) == -1)
+    exit(3);
+
+  if (legacy) {
+    const char *device = argv[optind];
+    int fd = open(device, O_RDWR | O_DIRECT | O_SYNC);
+    void *buf = alloc_iobuf(cdata.blocksize);
+
+    if (fd == -1 || buf == NULL) {
+      fprintf(stderr, "%s: ERROR: can't open %s: %s\n", progname, device, strerror(errno));
+      exit(3);
+    }
+    for (u = 0; u < updates; u++) {
+      unsigned long t = now_usec();
+      if (legacy_update(fd, buf, cdata.blocksize, indexes, nlocks, &syscalls) == -1)
+	exit(3);
+      lat[u] = now_usec() - t;
+    }
+  } else {
+    unsigned long base = sfex_io_syscalls();
+
+    for (u = 0; u < updates; u++) {
+      unsigned long t = now_usec();
+
+      if (read_lockdata_range(&cdata, area, 1, span) == -1)
+	exit(3);
+      for (i = 0; i < nlocks; i++) {
+	held[i] = area[indexes[i] - 1];
+	held[i].count = SFEX_NEXT_COUNT(&cdata, held[i].count);
+      }
+      if (write_lockdata_set(&cdata, held, indexes, 0, nlocks) == -1)
+	exit(3);
+      lat[u] = now_usec() - t;
+    }
+    syscalls = sfex_io_syscalls() - base;
+  }
+
+  for (i = 0; i < nlocks; i++)
+    init_lockdata(&held[i]);
+  write_lockdata_set(&cdata, held, indexes, 0, nlocks);
+
+  qsort(lat, updates, sizeof(*lat), cmp_ulong);
+  printf("backend=%s devices=%d blocksize=%lu physical=%lu locks=%d gap=%d updates=%d"
+	 " syscalls_per_update=%.2f p50_us=%lu p99_us=%lu max_us=%lu\n",
+	 legacy ? "legacy" : sfex_io_backend_name(), argc - optind,
+	 (unsigned long)cdata.blocksize, physical_block_size, nlocks, gap, updates,
+	 (double)syscalls / updates, lat[updates / 2],
+	 lat[(updates * 99) / 100],
+	 lat[updates - 1]);
+  exit(0);
+}
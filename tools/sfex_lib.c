@@ -29,8 +29,12 @@
 #define _GNU_SOURCE
 #endif
 
+#include <config.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -39,398 +43,2830 @@
 #include <unistd.h>
 #include <sys/utsname.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sched.h>
 #include <syslog.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
 #include <linux/fs.h>
+#ifdef HAVE_LINUX_AIO_ABI_H
+#include <linux/aio_abi.h>
+#endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #include "sfex.h"
 #include "sfex_lib.h"
 
-static void *locked_mem;
-static int dev_fd;
+/* copies of the sector and physical block sizes and the device size of
+   the default context */
 unsigned long sector_size = 0;
+unsigned long physical_block_size = 0;
+uint64_t device_size = 0;
 
-int
-prepare_lock (const char *device)
+/* the maximum number of devices of a context */
+#define SFEX_MAX_DEVICES 9
+
+/* the batches queued for a device before it is regarded as not responding */
+#define SFEX_QUORUM_BACKLOG 8
+
+/*
+ * sfex_batch --- a copy of a batch queued for one device
+ */
+typedef struct sfex_batch {
+  unsigned long id;
+  sfex_io *ios;			/* the requests, with their own buffer */
+  uint8_t *buf;
+  int n;
+  int done;
+  int ok;			/* every request completed */
+} sfex_batch;
+
+/*
+ * sfex_device --- one device holding a replica of the meta-data
+ */
+typedef struct sfex_device {
+  struct sfex_ctx *ctx;		/* the context it belongs to */
+  char *name;
+  int fd;
+  unsigned long pbsize;		/* physical block size */
+  uint64_t size;		/* bytes, 0 if it grows as a regular file */
+  uint8_t *mem_base;		/* mem: storage, NULL if not used */
+  size_t mem_size;
+  struct {			/* the faults of the fault: backend */
+    int enabled;
+    unsigned long delay;	/* ms */
+    double eio;			/* percent */
+    double torn;		/* percent */
+    unsigned int seed;
+    unsigned long stall;	/* ms */
+    unsigned long stall_after;	/* write batches before the stall */
+    unsigned long writes;	/* write batches so far */
+  } fault;
+  unsigned long syscalls;	/* I/O system calls issued so far */
+#ifdef HAVE_LINUX_AIO_ABI_H
+  aio_context_t aio_ctx;
+#endif
+#ifdef HAVE_LIBURING
+  struct io_uring ring;
+#endif
+  /* the worker thread of quorum_submit() and its queue */
+  pthread_t thread;
+  pthread_cond_t wake;
+  sfex_batch queue[SFEX_QUORUM_BACKLOG];
+  unsigned long head;		/* the next batch to run */
+  unsigned long tail;		/* the next free slot */
+  int lagging;			/* skipped with a full queue; logged once */
+  int failing;			/* failed the last batch; logged once */
+} sfex_device;
+
+/*
+ * I/O backends
+ *
+ * All device I/O of this file is done by sfex_ctx_submit(). A backend
+ * takes a batch of positional requests, keeps as many of them in flight as
+ * it can, and returns when all of them have completed. The result of each
+ * request is stored in its result member, a negative errno on error.
+ */
+typedef struct sfex_io_backend {
+  const char *name;
+  int (*init) (sfex_device * d);
+  int (*submit) (sfex_device * d, sfex_io * ios, int n);
+} sfex_io_backend;
+
+/*
+ * sfex_ctx --- the devices of one meta-data and how they are accessed
+ *
+ * Nothing of the library is kept outside of a context but the CRC table,
+ * so contexts are independent of each other. The batches of a context are
+ * run one at a time under submit_lock, which lets several threads share
+ * one context; the async backends and the quorum queues are not reentrant.
+ * The legacy API without a context works on default_ctx.
+ */
+struct sfex_ctx {
+  sfex_device devices[SFEX_MAX_DEVICES];
+  int num_devices;
+  int quorum;			/* devices which must complete, 0 for a majority */
+  const sfex_io_backend *io_backend;
+  unsigned long sector_size;
+  unsigned long physical_block_size;	/* the largest of the devices */
+  uint64_t device_size;		/* the smallest of the devices, 0 if none is bounded */
+  pthread_mutex_t submit_lock;
+  /* the device workers of quorum_submit() */
+  pid_t workers_pid;		/* the process running them */
+  int stopping;			/* sfex_ctx_free() is stopping them */
+  pthread_mutex_t quorum_lock;
+  pthread_cond_t quorum_done;
+  unsigned long quorum_batch;	/* the batch waited for, 0 if none */
+  unsigned long quorum_batches;	/* the number of batches so far */
+};
+
+/* the maximum number of requests kept in flight by the async backends */
+#define SFEX_IO_DEPTH 64
+
+/* the largest request write_metadata() and verify_metadata() issue */
+#define SFEX_IO_CHUNK (1024 * 1024)
+
+/* the number of SFEX_IO_CHUNK requests scan_lockdata(), write_metadata()
+   and verify_metadata() keep in flight */
+#define SFEX_SCAN_DEPTH 4
+
+/* read_lockdata_set() reads up to this many unneeded blocks between two
+   indexes rather than issuing another request */
+#define SFEX_READ_GAP 32
+
+/*
+ * sync backend --- one pread(2)/pwrite(2) per request
+ */
+static int
+sync_submit (sfex_device * d, sfex_io * ios, int n)
 {
-  do {
-    dev_fd = open (device, O_RDWR | O_DIRECT | O_SYNC);
-    if (dev_fd == -1) {
-      if (errno == EINTR || errno == EAGAIN)
-	continue;
-      cl_log(LOG_ERR, "can't open device %s: %s\n",
-		    device, strerror (errno));
-      exit (3);
+  int i;
+
+  for (i = 0; i < n; i++) {
+    ssize_t s;
+
+    do {
+      d->syscalls++;
+      if (ios[i].write)
+	s = pwrite (d->fd, ios[i].buf, ios[i].len, ios[i].offset);
+      else
+	s = pread (d->fd, ios[i].buf, ios[i].len, ios[i].offset);
     }
-    break;
+    while (s == -1 && (errno == EINTR || errno == EAGAIN));
+    ios[i].result = (s == -1) ? -errno : s;
   }
-  while (1);
+  return 0;
+}
 
-  ioctl(dev_fd, BLKSSZGET, &sector_size);
-  if (sector_size == 0) {
-	  cl_log(LOG_ERR, "Get sector size failed: %s\n", strerror(errno));
-	  exit(EXIT_FAILURE);
+#ifdef HAVE_LINUX_AIO_ABI_H
+/*
+ * aio backend --- Linux native AIO. The system calls are used directly, so
+ * that libaio is not needed.
+ */
+static int
+aio_init (sfex_device * d)
+{
+  d->aio_ctx = 0;
+  if (syscall (SYS_io_setup, SFEX_IO_DEPTH, &d->aio_ctx) == -1) {
+    cl_log(LOG_ERR, "io_setup failed: %s\n", strerror (errno));
+    return -1;
   }
+  return 0;
+}
 
-  if (posix_memalign
-      ((void **) (&locked_mem), SFEX_ODIRECT_ALIGNMENT,
-       sector_size) != 0) {
-    cl_log(LOG_ERR, "Failed to allocate aligned memory\n");
-    exit (3);
+static int
+aio_submit (sfex_device * d, sfex_io * ios, int n)
+{
+  struct iocb cb[SFEX_IO_DEPTH];
+  struct iocb *cbp[SFEX_IO_DEPTH];
+  struct io_event ev[SFEX_IO_DEPTH];
+  int done;
+
+  for (done = 0; done < n;) {
+    int batch = n - done < SFEX_IO_DEPTH ? n - done : SFEX_IO_DEPTH;
+    int submitted = 0, completed = 0;
+    int i;
+
+    for (i = 0; i < batch; i++) {
+      sfex_io *io = &ios[done + i];
+
+      memset (&cb[i], 0, sizeof (cb[i]));
+      cb[i].aio_data = done + i;
+      cb[i].aio_lio_opcode = io->write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+      cb[i].aio_fildes = d->fd;
+      cb[i].aio_buf = (uintptr_t) io->buf;
+      cb[i].aio_nbytes = io->len;
+      cb[i].aio_offset = io->offset;
+      cbp[i] = &cb[i];
+    }
+
+    while (submitted < batch) {
+      long r;
+
+      d->syscalls++;
+      r = syscall (SYS_io_submit, d->aio_ctx, (long) (batch - submitted),
+		   cbp + submitted);
+      if (r == -1) {
+	if (errno == EINTR || errno == EAGAIN)
+	  continue;
+	for (i = submitted; i < batch; i++)
+	  ios[done + i].result = -errno;
+	break;
+      }
+      submitted += r;
+    }
+
+    while (completed < submitted) {
+      long r;
+
+      d->syscalls++;
+      r = syscall (SYS_io_getevents, d->aio_ctx, (long) (submitted - completed),
+		   (long) (submitted - completed), ev, NULL);
+      if (r == -1) {
+	if (errno == EINTR)
+	  continue;
+	cl_log(LOG_ERR, "io_getevents failed: %s\n", strerror (errno));
+	return -1;
+      }
+      for (i = 0; i < r; i++)
+	ios[ev[i].data].result = ev[i].res;
+      completed += r;
+    }
+    done += batch;
+  }
+  return 0;
+}
+#endif /* HAVE_LINUX_AIO_ABI_H */
+
+#ifdef HAVE_LIBURING
+/*
+ * uring backend --- io_uring through liburing
+ */
+static int
+uring_init (sfex_device * d)
+{
+  int r = io_uring_queue_init (SFEX_IO_DEPTH, &d->ring, 0);
+
+  if (r < 0) {
+    cl_log(LOG_ERR, "io_uring_queue_init failed: %s\n", strerror (-r));
+    return -1;
   }
-  memset (locked_mem, 0, sector_size);
+  return 0;
+}
+
+static int
+uring_submit (sfex_device * d, sfex_io * ios, int n)
+{
+  int done;
+
+  for (done = 0; done < n;) {
+    int batch = n - done < SFEX_IO_DEPTH ? n - done : SFEX_IO_DEPTH;
+    int i, r;
+
+    for (i = 0; i < batch; i++) {
+      sfex_io *io = &ios[done + i];
+      struct io_uring_sqe *sqe = io_uring_get_sqe (&d->ring);
+
+      if (io->write)
+	io_uring_prep_write (sqe, d->fd, io->buf, io->len, io->offset);
+      else
+	io_uring_prep_read (sqe, d->fd, io->buf, io->len, io->offset);
+      io_uring_sqe_set_data (sqe, io);
+    }
+
+    /* one system call submits the batch and waits for all of it */
+    do {
+      d->syscalls++;
+      r = io_uring_submit_and_wait (&d->ring, batch);
+    }
+    while (r == -EINTR);
+    if (r < 0) {
+      cl_log(LOG_ERR, "io_uring_submit failed: %s\n", strerror (-r));
+      return -1;
+    }
+
+    for (i = 0; i < r; i++) {
+      struct io_uring_cqe *cqe;
+      int e;
 
+      while ((e = io_uring_wait_cqe (&d->ring, &cqe)) == -EINTR)
+	d->syscalls++;
+      if (e < 0) {
+	cl_log(LOG_ERR, "io_uring_wait_cqe failed: %s\n", strerror (-e));
+	return -1;
+      }
+      ((sfex_io *) io_uring_cqe_get_data (cqe))->result = cqe->res;
+      io_uring_cqe_seen (&d->ring, cqe);
+    }
+    done += batch;
+  }
   return 0;
 }
+#endif /* HAVE_LIBURING */
+
+static const sfex_io_backend io_backends[] = {
+  {"sync", NULL, sync_submit},
+#ifdef HAVE_LINUX_AIO_ABI_H
+  {"aio", aio_init, aio_submit},
+#endif
+#ifdef HAVE_LIBURING
+  {"uring", uring_init, uring_submit},
+#endif
+  {NULL, NULL, NULL}
+};
+
+static sfex_ctx default_ctx = {
+  .io_backend = &io_backends[0],
+  .submit_lock = PTHREAD_MUTEX_INITIALIZER,
+  .quorum_lock = PTHREAD_MUTEX_INITIALIZER,
+  .quorum_done = PTHREAD_COND_INITIALIZER,
+};
 
 /*
- * get_progname --- a program name
+ * sfex_ctx_new --- create an empty context
  *
- * We get program name from directory path. It does not include delimiter 
- * characters. Return value is pointer that point string of program name. 
- * We assume delimiter is '/'.
+ * Devices are added with sfex_ctx_add_device(), and the context is freed
+ * with sfex_ctx_free(). The I/O backend is sync.
+ *
+ * return value --- the context, or NULL with errno set.
+ */
+sfex_ctx *
+sfex_ctx_new (void)
+{
+  sfex_ctx *ctx = calloc (1, sizeof (*ctx));
+
+  if (ctx == NULL)
+    return NULL;
+  ctx->io_backend = &io_backends[0];
+  pthread_mutex_init (&ctx->submit_lock, NULL);
+  pthread_mutex_init (&ctx->quorum_lock, NULL);
+  pthread_cond_init (&ctx->quorum_done, NULL);
+  return ctx;
+}
+
+/* close a device and free what its storage and I/O backend hold */
+static void
+close_device (sfex_device * d)
+{
+  if (d->mem_base)
+    munmap (d->mem_base, d->mem_size);
+  else if (d->fd > 0) {
+#ifdef HAVE_LINUX_AIO_ABI_H
+    if (d->aio_ctx)
+      syscall (SYS_io_destroy, d->aio_ctx);
+#endif
+#ifdef HAVE_LIBURING
+    if (d->ring.ring_fd > 0)
+      io_uring_queue_exit (&d->ring);
+#endif
+  }
+  if (d->fd > 0)
+    close (d->fd);
+  free (d->name);
+}
+
+/*
+ * sfex_ctx_free --- stop the device workers and close the devices
+ *
+ * No other thread may use the context any longer.
+ */
+void
+sfex_ctx_free (sfex_ctx * ctx)
+{
+  int i;
+
+  if (ctx == NULL)
+    return;
+  if (ctx->workers_pid == getpid ()) {
+    pthread_mutex_lock (&ctx->quorum_lock);
+    ctx->stopping = 1;
+    for (i = 0; i < ctx->num_devices; i++)
+      pthread_cond_signal (&ctx->devices[i].wake);
+    pthread_mutex_unlock (&ctx->quorum_lock);
+    for (i = 0; i < ctx->num_devices; i++)
+      pthread_join (ctx->devices[i].thread, NULL);
+  }
+  for (i = 0; i < ctx->num_devices; i++)
+    close_device (&ctx->devices[i]);
+  pthread_mutex_destroy (&ctx->submit_lock);
+  pthread_mutex_destroy (&ctx->quorum_lock);
+  pthread_cond_destroy (&ctx->quorum_done);
+  free (ctx);
+}
+
+/*
+ * sfex_ctx_set_io_backend --- select the I/O backend
+ *
+ * This must be called before sfex_ctx_add_device(). name is one of "sync",
+ * "aio" and "uring". "async" selects the best asynchronous backend
+ * available. Return -1 if the backend is not available in this build.
  */
+int
+sfex_ctx_set_io_backend (sfex_ctx * ctx, const char *name)
+{
+  const sfex_io_backend *b;
+
+  if (strcmp (name, "async") == 0) {
+    for (b = io_backends; b->name; b++)
+      ctx->io_backend = b;
+    return ctx->io_backend == io_backends ? -1 : 0;
+  }
+  for (b = io_backends; b->name; b++) {
+    if (strcmp (b->name, name) == 0) {
+      ctx->io_backend = b;
+      return 0;
+    }
+  }
+  return -1;
+}
+
 const char *
-get_progname (const char *argv0)
+sfex_ctx_io_backend_name (const sfex_ctx * ctx)
 {
-  char *p;
+  return ctx->io_backend->name;
+}
 
-  p = strrchr (argv0, '/');
-  if (p)
-    return p + 1;
-  else
-    return argv0;
+unsigned long
+sfex_ctx_io_syscalls (sfex_ctx * ctx)
+{
+  unsigned long n = 0;
+  int i;
+
+  pthread_mutex_lock (&ctx->submit_lock);
+  for (i = 0; i < ctx->num_devices; i++)
+    n += ctx->devices[i].syscalls;
+  pthread_mutex_unlock (&ctx->submit_lock);
+  return n;
 }
 
 /*
- * get_nodename --- get a node name(hostname)
+ * sfex_ctx_io_reinit --- set up the I/O backend again after fork(2)
  *
- * We get a node name by using uname(2) and return pointer of it.
- * The error checks are done in this function. The caller does not have 
- * to check return value.
+ * The contexts of the async backends and the quorum workers belong to the
+ * process which created them, so a child process must call this before
+ * doing any I/O.
  */
-char *
-get_nodename (void)
+int
+sfex_ctx_io_reinit (sfex_ctx * ctx)
 {
-  struct utsname u;
-  char *n;
+  int i;
 
-  if (uname (&u)) {
-    cl_log(LOG_ERR, "%s\n", strerror (errno));
-    exit (3);
+  /* the parent may have forked while another thread held it */
+  pthread_mutex_init (&ctx->submit_lock, NULL);
+  /* the workers are started again by quorum_submit() */
+  for (i = 0; i < ctx->num_devices; i++) {
+    sfex_device *d = &ctx->devices[i];
+
+    if (ctx->io_backend->init && d->mem_base == NULL
+	&& ctx->io_backend->init (d) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * sfex_ctx_set_quorum --- set how many devices must complete each request
+ *
+ * 0 (default) means a majority of the devices of the context. sfex_init
+ * asks for all of them.
+ */
+void
+sfex_ctx_set_quorum (sfex_ctx * ctx, int n)
+{
+  ctx->quorum = n;
+}
+
+/*
+ * sfex_ctx_sector_size --- the sector size of the devices
+ *
+ * physical is set to the largest physical block size of them, if not NULL.
+ */
+unsigned long
+sfex_ctx_sector_size (const sfex_ctx * ctx, unsigned long *physical)
+{
+  if (physical)
+    *physical = ctx->physical_block_size;
+  return ctx->sector_size;
+}
+
+/*
+ * sfex_ctx_device_size --- the size of the smallest device in bytes
+ *
+ * return value --- 0 if no device has a fixed size, as regular files grow.
+ */
+uint64_t
+sfex_ctx_device_size (const sfex_ctx * ctx)
+{
+  return ctx->device_size;
+}
+
+/* the same on the default context, for the programs of sfex */
+int
+sfex_set_io_backend (const char *name)
+{
+  return sfex_ctx_set_io_backend (&default_ctx, name);
+}
+
+const char *
+sfex_io_backend_name (void)
+{
+  return sfex_ctx_io_backend_name (&default_ctx);
+}
+
+unsigned long
+sfex_io_syscalls (void)
+{
+  return sfex_ctx_io_syscalls (&default_ctx);
+}
+
+int
+sfex_io_reinit (void)
+{
+  return sfex_ctx_io_reinit (&default_ctx);
+}
+
+void
+sfex_set_quorum (int n)
+{
+  sfex_ctx_set_quorum (&default_ctx, n);
+}
+
+/*
+ * Storage backends
+ *
+ * The device name given to prepare_lock() selects where the meta-data are
+ * stored:
+ *
+ *   <path>                   a block device, or a regular file created in
+ *                            advance (e.g. with truncate(1)) on a local or
+ *                            shared file system
+ *   mem:<name>[:<size>]      POSIX shared memory /sfex-<name>, shared by
+ *                            the processes of one host. Default size is 4MB.
+ *   fault:<faults>:<device>  <device> with faults injected, for testing.
+ *                            <faults> is a comma separated list of
+ *                              delay=<time>  latency added to every batch
+ *                              eio=<percent> requests failing with EIO
+ *                              torn=<percent> writes of which only the first
+ *                                            half reaches the storage, while
+ *                                            success is reported
+ *                              seed=<n>      seed of the random numbers
+ *                              stall=<time>  the write batch after the
+ *                                            first stallafter=<n> (default
+ *                                            0) hangs for <time>, with the
+ *                                            signals of the thread held as
+ *                                            in an uninterruptible sleep
+ *
+ * Block devices and files are accessed through the I/O backend; shared
+ * memory is copied directly.
+ */
+#define SFEX_MEM_DEFAULT_SIZE (4 * 1024 * 1024)
+
+static int
+fd_submit (sfex_device * d, sfex_io * ios, int n)
+{
+  return d->ctx->io_backend->submit (d, ios, n);
+}
+
+/*
+ * mem_submit --- copy requests from/to the shared memory
+ *
+ * The whole batch is done under flock(2), so that the processes see each
+ * other's writes in units of a request, as sector writes of a disk.
+ */
+static int
+mem_submit (sfex_device * d, sfex_io * ios, int n)
+{
+  int i, write = 0;
+
+  for (i = 0; i < n; i++)
+    write |= ios[i].write;
+  while (flock (d->fd, write ? LOCK_EX : LOCK_SH) == -1) {
+    if (errno != EINTR) {
+      cl_log(LOG_ERR, "flock failed: %s\n", strerror (errno));
+      return -1;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    if (ios[i].offset < 0 || ios[i].offset + ios[i].len > d->mem_size) {
+      ios[i].result = -ENOSPC;
+      continue;
+    }
+    if (ios[i].write)
+      memcpy (d->mem_base + ios[i].offset, ios[i].buf, ios[i].len);
+    else
+      memcpy (ios[i].buf, d->mem_base + ios[i].offset, ios[i].len);
+    ios[i].result = ios[i].len;
+  }
+  flock (d->fd, LOCK_UN);
+  return 0;
+}
+
+static int
+storage_submit (sfex_device * d, sfex_io * ios, int n)
+{
+  return d->mem_base ? mem_submit (d, ios, n) : fd_submit (d, ios, n);
+}
+
+/*
+ * fault_chance --- true with the given probability in percent
+ */
+static int
+fault_chance (sfex_device * d, double percent)
+{
+  return percent > 0 && rand_r (&d->fault.seed) < percent / 100 * RAND_MAX;
+}
+
+/*
+ * fault_stall --- hang as a write to a failed path does
+ *
+ * A process waiting for such a write is in an uninterruptible sleep, where
+ * no signal handler runs. Only SIGKILL and SIGSTOP, which cannot be
+ * blocked, end or stop the stall.
+ */
+static void
+fault_stall (unsigned long msec)
+{
+  sigset_t all, old;
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  sleep_msec (msec);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * fault_submit --- run a batch on the storage with faults injected
+ *
+ * Requests chosen to fail get -EIO without being done. A torn write is
+ * done with half of its length (rounded down to the sector size on a
+ * device or a file, so possibly nothing), and reported as complete.
+ */
+static int
+fault_submit (sfex_device * d, sfex_io * ios, int n)
+{
+  size_t *want;
+  sfex_io *todo;
+  int *map;
+  int ntodo = 0;
+  int i, ret = 0;
+
+  if (d->fault.delay)
+    sleep_msec (d->fault.delay);
+  for (i = 0; i < n && !ios[i].write; i++)
+    ;
+  if (i < n && d->fault.writes++ == d->fault.stall_after && d->fault.stall)
+    fault_stall (d->fault.stall);
+
+  want = malloc (sizeof (*want) * n);
+  todo = malloc (sizeof (*todo) * n);
+  map = malloc (sizeof (*map) * n);
+  if (want == NULL || todo == NULL || map == NULL) {
+    ret = -1;
+    goto out;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (fault_chance (d, d->fault.eio)) {
+      ios[i].result = -EIO;
+      continue;
+    }
+    want[i] = ios[i].len;
+    todo[ntodo] = ios[i];
+    if (ios[i].write && fault_chance (d, d->fault.torn)) {
+      size_t align = d->mem_base ? 1 : d->ctx->sector_size;
+
+      todo[ntodo].len = (ios[i].len / 2) / align * align;
+      if (todo[ntodo].len == 0) {
+	/* lost write */
+	ios[i].result = ios[i].len;
+	continue;
+      }
+    }
+    map[ntodo++] = i;
+  }
+
+  if (ntodo > 0 && storage_submit (d, todo, ntodo) == -1) {
+    ret = -1;
+    goto out;
+  }
+  for (i = 0; i < ntodo; i++) {
+    sfex_io *io = &ios[map[i]];
+
+    io->result = todo[i].result;
+    if (todo[i].result == (ssize_t) todo[i].len)
+      io->result = want[map[i]];
+  }
+
+out:
+  free (map);
+  free (todo);
+  free (want);
+  return ret;
+}
+
+static int
+device_submit (sfex_device * d, sfex_io * ios, int n)
+{
+  if (d->fault.enabled)
+    return fault_submit (d, ios, n);
+  return storage_submit (d, ios, n);
+}
+
+/*
+ * check_batch --- check that every request of a batch is complete
+ *
+ * If log is set, the first incomplete request is logged, with the name of
+ * the device when there are several. errno is set to its error.
+ */
+static int
+check_batch (sfex_device * d, sfex_io * ios, int n, int log)
+{
+  const char *prefix = d->ctx->num_devices > 1 ? d->name : NULL;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (ios[i].result < 0) {
+      if (log)
+	cl_log(LOG_ERR, "%s%scan't %s meta-data: %s\n",
+	       prefix ? prefix : "", prefix ? ": " : "",
+	       ios[i].write ? "write" : "read", strerror (-ios[i].result));
+      errno = -ios[i].result;
+      return -1;
+    }
+    else if (ios[i].result != ios[i].len) {
+      /* if the I/O was not done atomically, this process is error */
+      if (log)
+	cl_log(LOG_ERR, "%s%scan't %s meta-data atomically.\n",
+	       prefix ? prefix : "", prefix ? ": " : "",
+	       ios[i].write ? "write" : "read");
+      errno = EIO;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Quorum
+ *
+ * With several devices, every device has a replica of the meta-data and a
+ * worker thread which runs the batches queued for it in order. A batch is
+ * copied to the queue of each device and is complete when a quorum of
+ * them, a majority by default, has done it, so a slow or dead device does
+ * not delay the result. A device which falls SFEX_QUORUM_BACKLOG batches
+ * behind is skipped until it catches up. Any two majorities share a
+ * device, so a read from a majority sees the last write to one.
+ *
+ * The workers block all signals, which are left to the main thread, and
+ * are started again in a child process after fork(2).
+ */
+
+/* free the copy of a batch. called with quorum_lock held */
+static void
+free_batch (sfex_batch * b)
+{
+  free (b->ios);
+  free (b->buf);
+  b->ios = NULL;
+  b->buf = NULL;
+}
+
+static void *
+device_worker (void *arg)
+{
+  sfex_device *d = arg;
+  sfex_ctx *ctx = d->ctx;
+
+  pthread_mutex_lock (&ctx->quorum_lock);
+  while (1) {
+    sfex_batch *b;
+    int ok;
+
+    while (d->head == d->tail && !ctx->stopping)
+      pthread_cond_wait (&d->wake, &ctx->quorum_lock);
+    if (ctx->stopping)
+      break;
+    b = &d->queue[d->head % SFEX_QUORUM_BACKLOG];
+    pthread_mutex_unlock (&ctx->quorum_lock);
+
+    ok = device_submit (d, b->ios, b->n) == 0
+      && check_batch (d, b->ios, b->n, 0) == 0;
+
+    pthread_mutex_lock (&ctx->quorum_lock);
+    b->ok = ok;
+    b->done = 1;
+    d->head++;
+    if (b->id != ctx->quorum_batch)
+      free_batch (b);		/* nobody is waiting for it any longer */
+    pthread_cond_broadcast (&ctx->quorum_done);
+  }
+  /* sfex_ctx_free(): the batches left are not waited for any longer */
+  for (; d->head != d->tail; d->head++)
+    free_batch (&d->queue[d->head % SFEX_QUORUM_BACKLOG]);
+  pthread_mutex_unlock (&ctx->quorum_lock);
+  return NULL;
+}
+
+static int
+start_workers (sfex_ctx * ctx)
+{
+  sigset_t all, old;
+  int i, r = 0;
+
+  /* a child inherits the lock state and the queues, but not the threads */
+  pthread_mutex_init (&ctx->quorum_lock, NULL);
+  pthread_cond_init (&ctx->quorum_done, NULL);
+  ctx->quorum_batch = 0;
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  for (i = 0; i < ctx->num_devices && r == 0; i++) {
+    sfex_device *d = &ctx->devices[i];
+
+    memset (d->queue, 0, sizeof (d->queue));
+    d->head = d->tail = 0;
+    pthread_cond_init (&d->wake, NULL);
+    r = pthread_create (&d->thread, NULL, device_worker, d);
+  }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  if (r != 0) {
+    cl_log(LOG_ERR, "pthread_create failed: %s\n", strerror (r));
+    return -1;
+  }
+  ctx->workers_pid = getpid ();
+  return 0;
+}
+
+/* copy a batch for a device, with the data of the writes */
+static int
+copy_batch (sfex_batch * b, const sfex_io * ios, int n, size_t total)
+{
+  size_t off = 0;
+  int i;
+
+  b->ios = malloc (sizeof (*b->ios) * n);
+  b->buf = alloc_iobuf (total);
+  if (b->ios == NULL || b->buf == NULL) {
+    free_batch (b);
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    b->ios[i] = ios[i];
+    b->ios[i].buf = b->buf + off;
+    if (ios[i].write)
+      memcpy (b->ios[i].buf, ios[i].buf, ios[i].len);
+    off += ios[i].len;
+  }
+  b->n = n;
+  b->done = 0;
+  return 0;
+}
+
+/*
+ * pick_common --- choose the copy most devices agree on
+ *
+ * Among copies held by as many devices, the one of the first device is
+ * taken.
+ */
+static void
+pick_common (sfex_io * io, uint8_t ** copies, int ncopies, const void *arg)
+{
+  int best = 0, best_votes = 0;
+  int i, j;
+
+  for (i = 0; i < ncopies; i++) {
+    int votes = 0;
+
+    for (j = 0; j < ncopies; j++)
+      votes += memcmp (copies[i], copies[j], io->len) == 0;
+    if (votes > best_votes) {
+      best = i;
+      best_votes = votes;
+    }
+  }
+  memcpy (io->buf, copies[best], io->len);
+}
+
+/*
+ * quorum_submit --- run a batch on a quorum of the devices
+ *
+ * For each read, pick() makes the result from the copies read from the
+ * devices which completed the batch.
+ */
+static int
+quorum_submit (sfex_ctx * ctx, sfex_io * ios, int n, sfex_pick pick,
+	       const void *arg)
+{
+  sfex_device *devices = ctx->devices;
+  int num_devices = ctx->num_devices;
+  sfex_batch *batch[SFEX_MAX_DEVICES];
+  int need = ctx->quorum > 0 ? ctx->quorum : num_devices / 2 + 1;
+  int sent = 0, ok, failed;
+  size_t total = 0;
+  int i, j;
+
+  if (ctx->workers_pid != getpid () && start_workers (ctx) == -1)
+    return -1;
+  for (i = 0; i < n; i++)
+    total += ios[i].len;
+
+  pthread_mutex_lock (&ctx->quorum_lock);
+  ctx->quorum_batch = ++ctx->quorum_batches;
+  for (j = 0; j < num_devices; j++) {
+    sfex_device *d = &devices[j];
+    sfex_batch *b = &d->queue[d->tail % SFEX_QUORUM_BACKLOG];
+
+    batch[j] = NULL;
+    if (d->tail - d->head == SFEX_QUORUM_BACKLOG
+	|| (d->lagging && d->head != d->tail)) {
+      if (!d->lagging)
+	cl_log(LOG_WARNING, "%s is not responding. continuing with the other devices.\n",
+	       d->name);
+      d->lagging = 1;
+      continue;
+    }
+    if (d->lagging)
+      cl_log(LOG_INFO, "%s is responding again.\n", d->name);
+    d->lagging = 0;
+    if (copy_batch (b, ios, n, total) == -1)
+      continue;
+    b->id = ctx->quorum_batch;
+    batch[j] = b;
+    d->tail++;
+    sent++;
+    pthread_cond_signal (&d->wake);
+  }
+
+  /* wait until a quorum has completed, or can't any longer */
+  while (1) {
+    ok = failed = 0;
+    for (j = 0; j < num_devices; j++) {
+      if (batch[j] && batch[j]->done)
+	batch[j]->ok ? ok++ : failed++;
+    }
+    if (ok >= need || sent - failed < need)
+      break;
+    pthread_cond_wait (&ctx->quorum_done, &ctx->quorum_lock);
+  }
+
+  for (i = 0; i < n && ok >= need; i++) {
+    uint8_t *copies[SFEX_MAX_DEVICES];
+    int ncopies = 0;
+
+    for (j = 0; j < num_devices && !ios[i].write; j++) {
+      if (batch[j] && batch[j]->done && batch[j]->ok)
+	copies[ncopies++] = batch[j]->ios[i].buf;
+    }
+    if (!ios[i].write)
+      (pick ? pick : pick_common) (&ios[i], copies, ncopies, arg);
+    ios[i].result = ios[i].len;
+  }
+
+  /* the results of the devices, logged when they change */
+  for (j = 0; j < num_devices; j++) {
+    sfex_device *d = &devices[j];
+    sfex_batch *b = batch[j];
+
+    if (b == NULL || !b->done)
+      continue;
+    if (!b->ok && !d->failing)
+      check_batch (d, b->ios, b->n, 1);
+    else if (b->ok && d->failing)
+      cl_log(LOG_INFO, "%s: meta-data I/O succeeded again.\n", d->name);
+    d->failing = !b->ok;
+    free_batch (b);
+  }
+  ctx->quorum_batch = 0;
+  pthread_mutex_unlock (&ctx->quorum_lock);
+
+  if (ok < need) {
+    cl_log(LOG_ERR, "meta-data I/O completed on %d of %d devices. %d needed.\n",
+	   ok, num_devices, need);
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * sfex_ctx_submit_pick --- run a batch of requests on the device(s)
+ *
+ * All requests are submitted together and are complete when this returns.
+ * With several devices, pick chooses the result of each read among the
+ * copies of the devices; NULL takes the copy most of them agree on.
+ *
+ * return value --- 0 if every request transferred its whole length.
+ */
+int
+sfex_ctx_submit_pick (sfex_ctx * ctx, sfex_io * ios, int n, sfex_pick pick,
+		      const void *arg)
+{
+  int ret;
+
+  pthread_mutex_lock (&ctx->submit_lock);
+  if (ctx->num_devices == 0) {
+    cl_log(LOG_ERR, "no device is given.\n");
+    errno = ENODEV;
+    ret = -1;
+  } else if (ctx->num_devices > 1)
+    ret = quorum_submit (ctx, ios, n, pick, arg);
+  else if (device_submit (&ctx->devices[0], ios, n) == -1)
+    ret = -1;
+  else
+    ret = check_batch (&ctx->devices[0], ios, n, 1);
+  pthread_mutex_unlock (&ctx->submit_lock);
+  return ret;
+}
+
+/*
+ * sfex_ctx_submit --- run a batch of requests on the device(s)
+ */
+int
+sfex_ctx_submit (sfex_ctx * ctx, sfex_io * ios, int n)
+{
+  return sfex_ctx_submit_pick (ctx, ios, n, NULL, NULL);
+}
+
+int
+sfex_io_submit_pick (sfex_io * ios, int n, sfex_pick pick, const void *arg)
+{
+  return sfex_ctx_submit_pick (&default_ctx, ios, n, pick, arg);
+}
+
+int
+sfex_io_submit (sfex_io * ios, int n)
+{
+  return sfex_ctx_submit_pick (&default_ctx, ios, n, NULL, NULL);
+}
+
+/*
+ * alloc_iobuf --- allocate a buffer suitable for direct I/O
+ *
+ * The buffer is zero filled. The caller frees it with free(3).
+ */
+void *
+alloc_iobuf (size_t size)
+{
+  void *p;
+
+  if (posix_memalign (&p, SFEX_ODIRECT_ALIGNMENT, size) != 0) {
+    cl_log(LOG_ERR, "Failed to allocate aligned memory\n");
+    return NULL;
+  }
+  memset (p, 0, size);
+  return p;
+}
+
+/*
+ * open_file_storage --- open a block device or a regular file
+ *
+ * The physical block size of a block device, the unit the device writes
+ * internally, is set to d->pbsize. It is larger than the sector size on
+ * 512e drives, which emulate 512 byte sectors on 4KiB physical ones. The
+ * size of a block device is set to d->size.
+ *
+ * return value --- the sector size, or 0 with errno set.
+ */
+static unsigned long
+open_file_storage (sfex_device * d, const char *device)
+{
+  struct stat st;
+  int flags = O_RDWR | O_DIRECT | O_SYNC;
+  unsigned long size = 0;
+
+  do {
+    d->fd = open (device, flags);
+    if (d->fd == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+      if (errno == EINVAL && (flags & O_DIRECT)
+	  && stat (device, &st) == 0 && S_ISREG (st.st_mode)) {
+	/* some file systems, such as tmpfs, don't support direct I/O */
+	cl_log(LOG_WARNING, "%s doesn't support direct I/O.\n", device);
+	flags &= ~O_DIRECT;
+	continue;
+      }
+      cl_log(LOG_ERR, "can't open device %s: %s\n",
+		    device, strerror (errno));
+      return 0;
+    }
+    break;
+  }
+  while (1);
+
+  if (fstat (d->fd, &st) == -1) {
+    cl_log(LOG_ERR, "can't stat device %s: %s\n", device, strerror (errno));
+    return 0;
+  }
+  if (S_ISREG (st.st_mode)) {
+    d->pbsize = 512;
+    return 512;
+  }
+
+  ioctl(d->fd, BLKSSZGET, &size);
+  if (size == 0) {
+	  cl_log(LOG_ERR, "Get sector size failed: %s\n", strerror(errno));
+	  return 0;
+  }
+#ifdef BLKPBSZGET
+  {
+    unsigned int pbsize = 0;
+
+    if (ioctl (d->fd, BLKPBSZGET, &pbsize) == 0)
+      d->pbsize = pbsize;
+  }
+#endif
+#ifdef BLKGETSIZE64
+  if (ioctl (d->fd, BLKGETSIZE64, &d->size) == -1)
+    d->size = 0;
+#endif
+  if (d->pbsize < size)
+    d->pbsize = size;
+  return size;
+}
+
+/*
+ * open_mem_storage --- open the shared memory of "mem:<name>[:<size>]"
+ *
+ * return value --- the sector size, or 0 with errno set.
+ */
+static unsigned long
+open_mem_storage (sfex_device * d, const char *spec)
+{
+  char name[NAME_MAX];
+  const char *colon = strchr (spec, ':');
+  struct stat st;
+
+  d->mem_size = SFEX_MEM_DEFAULT_SIZE;
+  if (colon) {
+    d->mem_size = strtoul (colon + 1, NULL, 10);
+    snprintf (name, sizeof (name), "/sfex-%.*s", (int) (colon - spec), spec);
+  } else
+    snprintf (name, sizeof (name), "/sfex-%s", spec);
+
+  d->fd = shm_open (name, O_RDWR | O_CREAT, 0600);
+  if (d->fd == -1 || fstat (d->fd, &st) == -1) {
+    cl_log(LOG_ERR, "can't open shared memory %s: %s\n", name, strerror (errno));
+    return 0;
+  }
+  /* the first process sizes it; the others use the size it has */
+  if (st.st_size == 0 && ftruncate (d->fd, d->mem_size) == -1) {
+    cl_log(LOG_ERR, "can't size shared memory %s: %s\n", name, strerror (errno));
+    return 0;
+  }
+  if (st.st_size)
+    d->mem_size = st.st_size;
+  d->size = d->mem_size;
+  d->mem_base = mmap (NULL, d->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, d->fd, 0);
+  if (d->mem_base == MAP_FAILED) {
+    cl_log(LOG_ERR, "can't map shared memory %s: %s\n", name, strerror (errno));
+    d->mem_base = NULL;
+    return 0;
+  }
+  d->pbsize = 512;
+  return 512;
+}
+
+/*
+ * parse_faults --- parse the <faults> of "fault:<faults>:<device>"
+ *
+ * return value --- the rest of spec, which is the underlying device, or
+ * NULL if spec is invalid.
+ */
+static const char *
+parse_faults (sfex_device * d, const char *spec)
+{
+  d->fault.enabled = 1;
+  d->fault.seed = getpid () + d->ctx->num_devices;
+  while (*spec && *spec != ':') {
+    char opt[64];
+    size_t len = strcspn (spec, ",:");
+    char *val;
+
+    if (len >= sizeof (opt))
+      goto bad;
+    memcpy (opt, spec, len);
+    opt[len] = 0;
+    spec += len;
+    if (*spec == ',')
+      spec++;
+    val = strchr (opt, '=');
+    if (val == NULL)
+      goto bad;
+    *val++ = 0;
+    if (strcmp (opt, "delay") == 0) {
+      if (parse_msec (val, &d->fault.delay) == -1)
+	goto bad;
+    } else if (strcmp (opt, "eio") == 0)
+      d->fault.eio = atof (val);
+    else if (strcmp (opt, "torn") == 0)
+      d->fault.torn = atof (val);
+    else if (strcmp (opt, "seed") == 0)
+      d->fault.seed = strtoul (val, NULL, 10);
+    else if (strcmp (opt, "stall") == 0) {
+      if (parse_msec (val, &d->fault.stall) == -1)
+	goto bad;
+    } else if (strcmp (opt, "stallafter") == 0)
+      d->fault.stall_after = strtoul (val, NULL, 10);
+    else
+      goto bad;
+  }
+  if (*spec == ':')
+    return spec + 1;
+
+bad:
+  cl_log(LOG_ERR, "invalid fault specification.\n");
+  errno = EINVAL;
+  return NULL;
+}
+
+/*
+ * sfex_ctx_add_device --- open a device of the meta-data
+ *
+ * This may be called for several devices, which then hold replicas of
+ * the same meta-data; see quorum_submit(). They must have the same sector
+ * size.
+ *
+ * return value --- 0 on success, or -1 with errno set: EINVAL for an
+ * invalid device specification, E2BIG if SFEX_MAX_DEVICES are added
+ * already, EMEDIUMTYPE if the sector size differs from the other devices,
+ * and the error of the system call otherwise.
+ */
+int
+sfex_ctx_add_device (sfex_ctx * ctx, const char *device)
+{
+  sfex_device *d;
+  unsigned long size;
+  int err;
+
+  if (ctx->num_devices == SFEX_MAX_DEVICES) {
+    cl_log(LOG_ERR, "too many devices. at most %d can be given.\n",
+	   SFEX_MAX_DEVICES);
+    errno = E2BIG;
+    return -1;
+  }
+  d = &ctx->devices[ctx->num_devices];
+  memset (d, 0, sizeof (*d));
+  d->ctx = ctx;
+  d->fd = -1;
+  d->name = strdup (device);
+  if (d->name == NULL)
+    return -1;
+
+  if (strncmp (device, "fault:", 6) == 0) {
+    device = parse_faults (d, device + 6);
+    if (device == NULL)
+      goto fail;
+  }
+
+  if (strncmp (device, "mem:", 4) == 0)
+    size = open_mem_storage (d, device + 4);
+  else {
+    size = open_file_storage (d, device);
+    if (size && ctx->io_backend->init && ctx->io_backend->init (d) == -1)
+      size = 0;
+  }
+  if (size == 0)
+    goto fail;
+  if (ctx->num_devices > 0 && size != ctx->sector_size) {
+    cl_log(LOG_ERR, "sector size of %s is %lu, not %lu as of %s.\n",
+	   d->name, size, ctx->sector_size, ctx->devices[0].name);
+    errno = EMEDIUMTYPE;
+    goto fail;
+  }
+  ctx->sector_size = size;
+  if (d->pbsize > ctx->physical_block_size)
+    ctx->physical_block_size = d->pbsize;
+  if (d->size && (ctx->device_size == 0 || d->size < ctx->device_size))
+    ctx->device_size = d->size;
+  ctx->num_devices++;
+  return 0;
+
+fail:
+  err = errno;
+  close_device (d);
+  errno = err;
+  return -1;
+}
+
+/*
+ * prepare_lock --- open a device of the meta-data of the default context
+ *
+ * On error this exits with 4 for an invalid device, or 3. sector_size,
+ * physical_block_size and device_size are set to those of the default
+ * context.
+ */
+int
+prepare_lock (const char *device)
+{
+  if (sfex_ctx_add_device (&default_ctx, device) == -1)
+    exit (errno == EINVAL || errno == E2BIG ? 4 : 3);
+  sector_size = default_ctx.sector_size;
+  physical_block_size = default_ctx.physical_block_size;
+  device_size = default_ctx.device_size;
+  return 0;
+}
+
+/*
+ * get_monotonic_usec --- current CLOCK_MONOTONIC time in microseconds
+ *
+ * Timeouts and intervals are measured with this clock, so that they are
+ * not disturbed by changes of the wall clock.
+ */
+uint64_t
+get_monotonic_usec (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * sleep_until_usec --- sleep until an absolute CLOCK_MONOTONIC time
+ *
+ * Sleeping until a deadline instead of for a duration keeps a periodic
+ * task from drifting when a period takes longer than expected.
+ */
+void
+sleep_until_usec (uint64_t deadline)
+{
+  struct timespec ts;
+
+  ts.tv_sec = deadline / 1000000;
+  ts.tv_nsec = (deadline % 1000000) * 1000;
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+/*
+ * sleep_msec --- sleep for a number of milliseconds
+ */
+void
+sleep_msec (unsigned long msec)
+{
+  sleep_until_usec (get_monotonic_usec () + (uint64_t) msec * 1000);
+}
+
+/*
+ * parse_msec --- parse a time given on the command line
+ *
+ * The time is a number of seconds, which may have a fraction such as
+ * "0.5", or a number of milliseconds with the "ms" suffix such as "500ms".
+ * It must be between 1 millisecond and INT_MAX milliseconds.
+ */
+int
+parse_msec (const char *arg, unsigned long *msec)
+{
+  char *end;
+  double v;
+
+  errno = 0;
+  v = strtod (arg, &end);
+  if (end == arg || errno)
+    return -1;
+  if (strcmp (end, "ms") != 0) {
+    if (*end != '\0' && strcmp (end, "s") != 0)
+      return -1;
+    v *= 1000;
+  }
+  if (!(v >= 1 && v <= INT_MAX))
+    return -1;
+  *msec = (unsigned long) v;
+  return 0;
+}
+
+/*
+ * get_progname --- a program name
+ *
+ * We get program name from directory path. It does not include delimiter 
+ * characters. Return value is pointer that point string of program name. 
+ * We assume delimiter is '/'.
+ */
+const char *
+get_progname (const char *argv0)
+{
+  char *p;
+
+  p = strrchr (argv0, '/');
+  if (p)
+    return p + 1;
+  else
+    return argv0;
+}
+
+/*
+ * sfex_get_nodename --- get a node name(hostname)
+ *
+ * We get a node name by using uname(2) and return a copy of it, which the
+ * caller frees with free(3).
+ *
+ * return value --- the node name, or NULL with errno set. ENAMETOOLONG
+ * means it does not fit in the lock data.
+ */
+char *
+sfex_get_nodename (void)
+{
+  struct utsname u;
+
+  if (uname (&u)) {
+    cl_log(LOG_ERR, "%s\n", strerror (errno));
+    return NULL;
+  }
+  if (strlen (u.nodename) > SFEX_MAX_NODENAME) {
+    cl_log(LOG_ERR,
+      "nodename %s is too long. must be less than %lu byte.\n",
+       u.nodename, (unsigned long)SFEX_MAX_NODENAME);
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  return strdup (&u.nodename[0]);
+}
+
+/*
+ * get_nodename --- get a node name(hostname)
+ *
+ * The error checks are done in this function. The caller does not have 
+ * to check return value.
+ */
+char *
+get_nodename (void)
+{
+  char *n = sfex_get_nodename ();
+
+  if (!n) {
+    if (errno != ENAMETOOLONG)
+      cl_log(LOG_ERR, "%s\n", strerror (errno));
+    exit (3);
+  }
+  return n;
+}
+
+/*
+ * crc32c --- CRC32C (Castagnoli) of a buffer
+ *
+ * This is used to detect torn or stale blocks of format version 2, and to
+ * derive the node ID from the node name.
+ */
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void
+crc32c_init (void)
+{
+  uint32_t i, j;
+
+  for (i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (j = 0; j < 8; j++)
+      c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+    crc32c_table[i] = c;
+  }
+}
+
+uint32_t
+crc32c (const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  uint32_t crc = 0xffffffff;
+
+  pthread_once (&crc32c_once, crc32c_init);
+  while (len--)
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+/* little-endian field access for format version 2 */
+static void
+put_le32 (uint8_t * p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void
+put_le64 (uint8_t * p, uint64_t v)
+{
+  put_le32 (p, (uint32_t) v);
+  put_le32 (p + 4, (uint32_t) (v >> 32));
+}
+
+static uint32_t
+get_le32 (const uint8_t * p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t
+get_le64 (const uint8_t * p)
+{
+  return get_le32 (p) | ((uint64_t) get_le32 (p + 4) << 32);
+}
+
+/*
+ * block_crc --- CRC32C of a block with its crc field regarded as 0
+ */
+static uint32_t
+block_crc (uint8_t * block, size_t blocksize, uint8_t * crc)
+{
+  uint8_t saved[4];
+  uint32_t v;
+
+  memcpy (saved, crc, sizeof (saved));
+  memset (crc, 0, sizeof (saved));
+  v = crc32c (block, blocksize);
+  memcpy (crc, saved, sizeof (saved));
+  return v;
+}
+
+/*
+ * get_nodeid --- node ID of a node name
+ */
+uint32_t
+get_nodeid (const char *name)
+{
+  return crc32c (name, strlen (name));
+}
+
+/*
+ * set_lockdata_owner --- make the lock data belong to a node
+ */
+void
+set_lockdata_owner (sfex_lockdata * ldata, const char *name)
+{
+  strncpy (ldata->nodename, name, sizeof (ldata->nodename));
+  ldata->nodename[sizeof (ldata->nodename) - 1] = '\0';
+  ldata->nodeid = get_nodeid (name);
+}
+
+/*
+ * lockdata_owned_by --- check the owner of the lock data
+ *
+ * With format version 2 the node IDs are compared, otherwise the node
+ * names. The lock status is not checked.
+ */
+int
+lockdata_owned_by (const sfex_controldata * cdata,
+		   const sfex_lockdata * ldata, const char *name)
+{
+  if (cdata->version >= SFEX_VERSION_V2)
+    return ldata->nodeid == get_nodeid (name);
+  return strncmp (ldata->nodename, name, sizeof (ldata->nodename)) == 0;
+}
+
+/*
+ * sfex_ctx_init_controldata --- initialize control data
+ *
+ * We initialize each member of sfex_controldata structure. version is the
+ * on-disk format, SFEX_VERSION or SFEX_VERSION_V2. The meta-data are on
+ * the devices of ctx.
+ */
+void
+sfex_ctx_init_controldata (sfex_ctx * ctx, sfex_controldata * cdata,
+			   size_t blocksize, int numlocks, int version)
+{
+  cdata->ctx = ctx;
+  memcpy (cdata->magic, SFEX_MAGIC, sizeof (cdata->magic));
+  cdata->version = version;
+  cdata->revision = SFEX_REVISION;
+  cdata->blocksize = blocksize;
+  cdata->numlocks = numlocks;
+}
+
+void
+init_controldata (sfex_controldata * cdata, size_t blocksize, int numlocks,
+		  int version)
+{
+  sfex_ctx_init_controldata (&default_ctx, cdata, blocksize, numlocks, version);
+}
+
+/*
+ * init_lockdata --- initialize lock data
+ *
+ * We initialize each member of sfex_lockdata structure.
+ */
+void
+init_lockdata (sfex_lockdata * ldata)
+{
+  ldata->status = SFEX_STATUS_UNLOCK;
+  ldata->count = 0;
+  ldata->nodename[0] = 0;
+  ldata->nodeid = 0;
+  ldata->expiry = 0;
+  ldata->interval = 0;
+  ldata->takeover = 0;
+}
+
+/*
+ * encode_controldata --- format control data into an on-disk block
+ *
+ * cdata --- pointer of control data
+ *
+ * block --- destination buffer of blocksize bytes
+ */
+static void
+encode_controldata (const sfex_controldata * cdata, uint8_t * block)
+{
+  memset (block, 0, cdata->blocksize);
+
+  if (cdata->version >= SFEX_VERSION_V2) {
+    sfex_controldata_ondisk_v2 *b2 = (sfex_controldata_ondisk_v2 *) block;
+
+    memcpy (b2->magic, cdata->magic, sizeof (b2->magic));
+    snprintf ((char *) (b2->version), sizeof (b2->version), "%d",
+	      cdata->version);
+    put_le32 (b2->revision, cdata->revision);
+    put_le32 (b2->blocksize, cdata->blocksize);
+    put_le32 (b2->numlocks, cdata->numlocks);
+    put_le32 (b2->crc, crc32c (b2, offsetof (sfex_controldata_ondisk_v2, crc)));
+  } else {
+    sfex_controldata_ondisk *b1 = (sfex_controldata_ondisk *) block;
+
+    /* We write control data into the buffer with given format. */
+    /* We write the offset value of each field of the control data directly.
+     * Because a point using this value is limited to two places, we do not 
+     * use macro. If you change the following offset values, you must change 
+     * values in the read_controldata() function.
+     */
+    memcpy (b1->magic, cdata->magic, sizeof (b1->magic));
+    snprintf ((char *) (b1->version), sizeof (b1->version), "%d",
+	      cdata->version);
+    snprintf ((char *) (b1->revision), sizeof (b1->revision), "%d",
+	      cdata->revision);
+    snprintf ((char *) (b1->blocksize), sizeof (b1->blocksize), "%u",
+	      (unsigned)cdata->blocksize);
+    snprintf ((char *) (b1->numlocks), sizeof (b1->numlocks), "%d",
+	      cdata->numlocks);
+  }
+}
+
+/*
+ * write_controldata --- write control data into file
+ *
+ * We write sfex_controldata struct into file. We open a file with 
+ * synchronization mode and write out control data.
+ *
+ * cdata --- pointer of control data
+ *
+ * return value --- 0 on success, -1 on error.
+ */
+int
+write_controldata (const sfex_controldata * cdata)
+{
+  uint8_t *block;
+  sfex_io io;
+  int ret;
+
+  block = alloc_iobuf (cdata->blocksize);
+  if (block == NULL)
+    return -1;
+  encode_controldata (cdata, block);
+
+  /* write buffer into a file  */
+  io.write = 1;
+  io.buf = block;
+  io.len = cdata->blocksize;
+  io.offset = 0;
+  ret = sfex_ctx_submit (cdata->ctx, &io, 1);
+  free (block);
+  return ret;
+}
+
+/*
+ * encode_lockdata --- format lock data into an on-disk block
+ *
+ * cdata --- pointer for control data
+ *
+ * block --- destination buffer of blocksize bytes
+ *
+ * ldata --- pointer for lock data
+ */
+static void
+encode_lockdata (const sfex_controldata * cdata, uint8_t * block,
+		 const sfex_lockdata * ldata)
+{
+  memset (block, 0, cdata->blocksize);
+
+  if (cdata->version >= SFEX_VERSION_V2) {
+    sfex_lockdata_ondisk_v2 *b2 = (sfex_lockdata_ondisk_v2 *) block;
+    size_t len = strnlen (ldata->nodename, sizeof (b2->nodename) - 1);
+
+    b2->status = ldata->status;
+    put_le32 (b2->nodeid, ldata->nodeid);
+    put_le64 (b2->generation, ldata->count);
+    put_le64 (b2->expiry, ldata->expiry);
+    put_le32 (b2->interval, ldata->interval);
+    memcpy (b2->nodename, ldata->nodename, len);
+    put_le32 (b2->takeover, ldata->takeover);
+    put_le32 (b2->crc, block_crc (block, cdata->blocksize, b2->crc));
+  } else {
+    sfex_lockdata_ondisk *b1 = (sfex_lockdata_ondisk *) block;
+
+    /* We write lock data into buffer with given format */
+    /* We write the offset value of each field of the control data directly.
+     * Because a point using this value is limited to two places, we do not 
+     * use macro. If you chage the following offset values, you must change 
+     * values in the decode_lockdata() function.
+     */
+    b1->status = ldata->status;
+    snprintf ((char *) (b1->count), sizeof (b1->count), "%d",
+	      (int) ldata->count);
+    snprintf ((char *) (b1->nodename), sizeof (b1->nodename), "%s",
+	      ldata->nodename);
+  }
+}
+
+/*
+ * write_lockdata --- write lock data into file
+ *
+ * We write sfex_lockdata into file and seek file pointer to the given
+ * position of lock data.
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- pointer for lock data
+ *
+ * device --- file name for write
+ *
+ * index --- index number for lock data. 1 origine.
+ */
+int
+write_lockdata (const sfex_controldata * cdata, const sfex_lockdata * ldata,
+		int index)
+{
+  return write_lockdata_range (cdata, ldata, index, 1);
+}
+
+/*
+ * write_lockdata_range --- write consecutive lock data into file
+ *
+ * We write count sfex_lockdata at once, starting at the given index. All
+ * blocks are formatted into one buffer and submitted as a single write, so
+ * a run of locks held by one node costs one I/O.
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- array of count lock data
+ *
+ * index --- index number of the first lock data. 1 origine.
+ *
+ * count --- number of lock data to write
+ */
+int
+write_lockdata_range (const sfex_controldata * cdata,
+		      const sfex_lockdata * ldata, int index, int count)
+{
+  return write_lockdata_set (cdata, ldata, NULL, index, count);
+}
+
+/*
+ * write_lockdata_set --- write lock data of a set of indexes
+ *
+ * ldata[i] is written to the lock data of indexes[i]. The indexes must be
+ * sorted. Each run of consecutive indexes is written with one request, and
+ * all the requests are submitted together. If indexes is NULL, the count
+ * lock data starting at first are written.
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- array of count lock data
+ *
+ * indexes --- array of count index numbers, or NULL
+ *
+ * first --- index number of the first lock data if indexes is NULL
+ *
+ * count --- number of lock data to write
+ */
+int
+write_lockdata_set (const sfex_controldata * cdata,
+		    const sfex_lockdata * ldata, const int *indexes,
+		    int first, int count)
+{
+  uint8_t *buf;
+  sfex_io *ios;
+  int nios = 0;
+  int i, ret;
+
+  buf = alloc_iobuf (cdata->blocksize * count);
+  ios = malloc (sizeof (*ios) * count);
+  if (buf == NULL || ios == NULL) {
+    free (buf);
+    free (ios);
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    int index = indexes ? indexes[i] : first + i;
+    uint8_t *block = buf + cdata->blocksize * i;
+
+    encode_lockdata (cdata, block, &ldata[i]);
+    if (nios > 0 && ios[nios - 1].offset + ios[nios - 1].len
+	== cdata->blocksize * index) {
+      ios[nios - 1].len += cdata->blocksize;
+      continue;
+    }
+    ios[nios].write = 1;
+    ios[nios].buf = block;
+    ios[nios].len = cdata->blocksize;
+    ios[nios].offset = cdata->blocksize * index;
+    nios++;
+  }
+
+  ret = sfex_ctx_submit (cdata->ctx, ios, nios);
+  free (ios);
+  free (buf);
+  return ret;
+}
+
+/*
+ * lockmap_blocks --- number of blocks of the lock map
+ *
+ * return value --- 0 if the meta-data have no lock map.
+ */
+int
+lockmap_blocks (const sfex_controldata * cdata)
+{
+  size_t bits = SFEX_LOCKMAP_BITS (cdata->blocksize);
+
+  if (cdata->version < SFEX_VERSION_V2
+      || cdata->revision < SFEX_REVISION_LOCKMAP)
+    return 0;
+  return (cdata->numlocks + bits - 1) / bits;
+}
+
+/* offset of block k of the lock map */
+static off_t
+lockmap_offset (const sfex_controldata * cdata, int k)
+{
+  return (off_t) cdata->blocksize * (cdata->numlocks + 1 + k);
+}
+
+/* set the header of block k of the lock map, after its bits */
+static void
+seal_lockmap_block (const sfex_controldata * cdata, uint8_t * block, int k)
+{
+  sfex_lockmap_ondisk *m = (sfex_lockmap_ondisk *) block;
+
+  memcpy (m->magic, SFEX_LOCKMAP_MAGIC, sizeof (m->magic));
+  put_le32 (m->first, k * SFEX_LOCKMAP_BITS (cdata->blocksize) + 1);
+  memset (m->reserved, 0, sizeof (m->reserved));
+  put_le32 (m->crc, block_crc (block, cdata->blocksize, m->crc));
+}
+
+/* check the header of block k of the lock map */
+static int
+check_lockmap_block (const sfex_controldata * cdata, uint8_t * block, int k)
+{
+  sfex_lockmap_ondisk *m = (sfex_lockmap_ondisk *) block;
+
+  return memcmp (m->magic, SFEX_LOCKMAP_MAGIC, sizeof (m->magic)) == 0
+    && get_le32 (m->first) == k * SFEX_LOCKMAP_BITS (cdata->blocksize) + 1
+    && get_le32 (m->crc) == block_crc (block, cdata->blocksize, m->crc) ? 0 : -1;
+}
+
+/*
+ * encode_metadata --- format n blocks of the meta-data region
+ *
+ * Block first and the n - 1 following ones of the region, the control
+ * data, numlocks copies of ldata and then an empty lock map, are formatted
+ * into buf.
+ */
+static void
+encode_metadata (const sfex_controldata * cdata, const sfex_lockdata * ldata,
+		 uint8_t * buf, int first, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    uint8_t *block = buf + (size_t) cdata->blocksize * i;
+    int b = first + i;
+
+    if (b == 0)
+      encode_controldata (cdata, block);
+    else if (b <= cdata->numlocks)
+      encode_lockdata (cdata, block, ldata);
+    else {
+      memset (block, 0, cdata->blocksize);
+      seal_lockmap_block (cdata, block, b - cdata->numlocks - 1);
+    }
+  }
+}
+
+/* the number of blocks write_metadata() and verify_metadata() handle at once */
+static int
+metadata_window (const sfex_controldata * cdata)
+{
+  int n = SFEX_IO_CHUNK * SFEX_SCAN_DEPTH / cdata->blocksize;
+
+  return n < 1 ? 1 : n;
+}
+
+/*
+ * submit_region --- read or write a part of the region in large requests
+ *
+ * The len bytes at offset are split into requests of at most SFEX_IO_CHUNK
+ * bytes, and all of them are submitted together, so that an async backend
+ * keeps them in flight at once.
+ */
+static int
+submit_region (const sfex_controldata * cdata, int write, uint8_t * buf,
+	       off_t offset, size_t len)
+{
+  sfex_io ios[SFEX_SCAN_DEPTH];
+  int nios = 0;
+  size_t done;
+
+  /* len is at most a window, SFEX_SCAN_DEPTH requests */
+  for (done = 0; done < len && nios < SFEX_SCAN_DEPTH; done += ios[nios++].len) {
+    ios[nios].write = write;
+    ios[nios].buf = buf + done;
+    ios[nios].offset = offset + (off_t) done;
+    ios[nios].len = len - done;
+    if (ios[nios].len > SFEX_IO_CHUNK)
+      ios[nios].len = SFEX_IO_CHUNK;
+  }
+  return sfex_ctx_submit (cdata->ctx, ios, nios);
+}
+
+/*
+ * write_metadata --- write the whole meta-data region
+ *
+ * The control data, every lock data, all set to ldata, and an empty lock
+ * map are written with a few large requests instead of one write per
+ * block. They are formatted and written a window of a few MiB at a time,
+ * so that memory use does not grow with the number of locks.
+ *
+ * cdata --- pointer of control data
+ *
+ * ldata --- lock data written to every index
+ */
+int
+write_metadata (const sfex_controldata * cdata, const sfex_lockdata * ldata)
+{
+  int total = cdata->numlocks + 1 + lockmap_blocks (cdata);
+  int window = metadata_window (cdata);
+  uint8_t *buf;
+  int first, ret = 0;
+
+  buf = alloc_iobuf ((size_t) cdata->blocksize * window);
+  if (buf == NULL)
+    return -1;
+  for (first = 0; first < total && ret == 0; first += window) {
+    int n = total - first < window ? total - first : window;
+
+    encode_metadata (cdata, ldata, buf, first, n);
+    ret = submit_region (cdata, 1, buf, (off_t) cdata->blocksize * first,
+			 (size_t) cdata->blocksize * n);
+  }
+  free (buf);
+  return ret;
+}
+
+/*
+ * verify_metadata --- check the meta-data region written by write_metadata
+ *
+ * The region is read back a window at a time, as write_metadata() writes
+ * it, and compared with what write_metadata() writes for the same
+ * arguments.
+ *
+ * return value --- 0 if it matches, -1 on mismatch or I/O error.
+ */
+int
+verify_metadata (const sfex_controldata * cdata, const sfex_lockdata * ldata)
+{
+  int total = cdata->numlocks + 1 + lockmap_blocks (cdata);
+  int window = metadata_window (cdata);
+  uint8_t *expect, *buf;
+  int first, ret = -1;
+  int i;
+
+  expect = alloc_iobuf ((size_t) cdata->blocksize * window);
+  buf = alloc_iobuf ((size_t) cdata->blocksize * window);
+  if (expect == NULL || buf == NULL)
+    goto out;
+
+  for (first = 0; first < total; first += window) {
+    int n = total - first < window ? total - first : window;
+
+    encode_metadata (cdata, ldata, expect, first, n);
+    if (submit_region (cdata, 0, buf, (off_t) cdata->blocksize * first,
+		       (size_t) cdata->blocksize * n) == -1)
+      goto out;
+    for (i = 0; i < n; i++) {
+      size_t off = (size_t) cdata->blocksize * i;
+      int b = first + i;
+
+      if (memcmp (buf + off, expect + off, cdata->blocksize) == 0)
+	continue;
+      if (b == 0)
+	cl_log (LOG_ERR, "control data verification failed.\n");
+      else if (b <= cdata->numlocks)
+	cl_log (LOG_ERR, "lock data #%d verification failed.\n", b);
+      else
+	cl_log (LOG_ERR, "lock map block #%d verification failed.\n",
+		b - cdata->numlocks - 1);
+      goto out;
+    }
+  }
+  ret = 0;
+
+out:
+  free (buf);
+  free (expect);
+  return ret;
+}
+
+/*
+ * sfex_ctx_read_controldata --- read control data from file
+ *
+ * read sfex_controldata structure from the devices of ctx. Only the first
+ * sector is read: the control data fit in it whatever the blocksize is, so
+ * that meta-data of any blocksize are read before it is known.
+ *
+ * cdata --- pointer for control data
+ *
+ * return value --- 0 on success, -1 on error. errno is EINVAL if the
+ * control data are invalid.
+ */
+int
+sfex_ctx_read_controldata (sfex_ctx * ctx, sfex_controldata * cdata)
+{
+  sfex_controldata_ondisk *block;
+  sfex_io io;
+  int ret = -1;
+
+  cdata->ctx = ctx;
+  block = alloc_iobuf (ctx->sector_size);
+  if (block == NULL)
+    return -1;
+
+  /* read data from file */
+  io.write = 0;
+  io.buf = block;
+  io.len = ctx->sector_size;
+  io.offset = 0;
+  if (sfex_ctx_submit (cdata->ctx, &io, 1) == -1) {
+    free (block);
+    return -1;
+  }
+
+  /* read control data from buffer */
+  /* 1. check the magic number.  2. check the version number. 
+     3. check null terminator or crc of each field 
+     4. Unmuch of revision number is allowed  */
+  /* We write the offset value of each field of the control data directly.
+   * Because a point using this value is limited to two places, we do not 
+   * use macro. If you chage the following offset values, you must change 
+   * values in the write_controldata() function.
+   */
+  memcpy (cdata->magic, block->magic, 4);
+  if (memcmp (cdata->magic, SFEX_MAGIC, sizeof (cdata->magic))) {
+    cl_log(LOG_ERR, "magic number mismatched. %c%c%c%c <-> %s\n", block->magic[0], block->magic[1], block->magic[2], block->magic[3], SFEX_MAGIC);
+    goto out;
+  }
+  if (block->version[sizeof (block->version)-1]) {
+    cl_log(LOG_ERR, "control data format error.\n");
+    goto out;
+  }
+  cdata->version = atoi ((char *) (block->version));
+  if (cdata->version == SFEX_VERSION_V2) {
+    sfex_controldata_ondisk_v2 *b2 = (sfex_controldata_ondisk_v2 *) block;
+
+    if (get_le32 (b2->crc)
+	!= crc32c (b2, offsetof (sfex_controldata_ondisk_v2, crc))) {
+      cl_log(LOG_ERR, "control data checksum error.\n");
+      goto out;
+    }
+    cdata->revision = get_le32 (b2->revision);
+    cdata->blocksize = get_le32 (b2->blocksize);
+    cdata->numlocks = get_le32 (b2->numlocks);
+    if (cdata->numlocks < SFEX_MIN_NUMLOCKS
+	|| cdata->numlocks > SFEX_MAX_NUMLOCKS_V2
+	|| cdata->blocksize <= sizeof (sfex_lockmap_ondisk)) {
+      cl_log(LOG_ERR, "control data format error.\n");
+      goto out;
+    }
+    goto check;
+  }
+  if (cdata->version != SFEX_VERSION) {
+    cl_log(LOG_ERR,
+      "version number mismatched. program is %d or %d, data is %d.\n",
+       SFEX_VERSION, SFEX_VERSION_V2, cdata->version);
+    goto out;
+  }
+  if (block->revision[sizeof (block->revision)-1]
+      || block->blocksize[sizeof (block->blocksize)-1]
+      || block->numlocks[sizeof (block->numlocks)-1]) {
+    cl_log(LOG_ERR, "control data format error.\n");
+    goto out;
+  }
+  cdata->revision = atoi ((char *) (block->revision));
+  cdata->blocksize = atoi ((char *) (block->blocksize));
+  cdata->numlocks = atoi ((char *) (block->numlocks));
+
+ check:
+  /* any multiple of the sector size keeps the I/O aligned */
+  if (cdata->blocksize == 0 || cdata->blocksize % ctx->sector_size != 0) {
+    cl_log(LOG_ERR, "blocksize %lu is not a multiple of the sector size %lu.\n",
+	   (unsigned long) cdata->blocksize, ctx->sector_size);
+    goto out;
+  }
+  ret = 0;
+
+ out:
+  free (block);
+  if (ret == -1)
+    errno = EINVAL;
+  return ret;
+}
+
+/*
+ * read_controldata --- read control data of the default context
+ */
+int
+read_controldata (sfex_controldata * cdata)
+{
+  return sfex_ctx_read_controldata (&default_ctx, cdata);
+}
+
+/*
+ * parse_lockdata --- parse an on-disk block into lock data
+ *
+ * cdata --- pointer for control data
+ *
+ * block --- source buffer
+ *
+ * ldata --- pointer for lock data. Parsed lock data are stored into this 
+ * pointed area.
+ *
+ * return value --- NULL, or the error found in the block.
+ */
+static const char *
+parse_lockdata (const sfex_controldata * cdata, uint8_t * block,
+		sfex_lockdata * ldata)
+{
+  if (cdata->version >= SFEX_VERSION_V2) {
+    sfex_lockdata_ondisk_v2 *b2 = (sfex_lockdata_ondisk_v2 *) block;
+
+    /* 1. check the crc 2. check the status */
+    if (get_le32 (b2->crc) != block_crc (block, cdata->blocksize, b2->crc))
+      return "lock data checksum error.";
+    ldata->status = b2->status;
+    ldata->nodeid = get_le32 (b2->nodeid);
+    ldata->count = get_le64 (b2->generation);
+    ldata->expiry = get_le64 (b2->expiry);
+    ldata->interval = get_le32 (b2->interval);
+    ldata->takeover = get_le32 (b2->takeover);
+    memcpy (ldata->nodename, b2->nodename, sizeof (ldata->nodename));
+    ldata->nodename[sizeof (ldata->nodename) - 1] = '\0';
+  } else {
+    sfex_lockdata_ondisk *b1 = (sfex_lockdata_ondisk *) block;
+
+    /* read control data form buffer */
+    /* 1. check null terminator of each field 2. check the status */
+    /* We write the offset value of each field of the control data directly.
+     * Because a point using this value is limited to two places, we do not 
+     * use macro. If you chage the following offset values, you must change 
+     * values in the encode_lockdata() function.
+     */
+    if (b1->count[sizeof(b1->count)-1] || b1->nodename[sizeof(b1->nodename)-1])
+      return "lock data format error.";
+    ldata->status = b1->status;
+    ldata->count = atoi ((char *) (b1->count));
+    strncpy ((char *) (ldata->nodename), (const char *) (b1->nodename), sizeof(b1->nodename));
+    ldata->nodeid = get_nodeid (ldata->nodename);
+    ldata->expiry = 0;
+    ldata->interval = 0;
+    ldata->takeover = 0;
+  }
+  if (ldata->status != SFEX_STATUS_UNLOCK
+      && ldata->status != SFEX_STATUS_LOCK)
+    return "lock data format error.";
+  return NULL;
+}
+
+static int
+decode_lockdata (const sfex_controldata * cdata, uint8_t * block,
+		 sfex_lockdata * ldata)
+{
+  const char *error = parse_lockdata (cdata, block, ldata);
+
+  if (error) {
+    cl_log(LOG_ERR, "%s\n", error);
+    return -1;
+  }
+#ifdef SFEX_DEBUG
+  cl_log(LOG_INFO, "status: %c\n", ldata->status);
+  cl_log(LOG_INFO, "count: %llu\n", (unsigned long long)ldata->count);
+  cl_log(LOG_INFO, "nodename: %s\n", ldata->nodename);
+#endif
+  return 0;
+}
+
+/*
+ * count_newer --- whether counter a was written after counter b
+ *
+ * The counters of format version 1 wrap around after SFEX_MAX_COUNT.
+ */
+static int
+count_newer (const sfex_controldata * cdata, uint64_t a, uint64_t b)
+{
+  uint64_t span = SFEX_MAX_COUNT + 1;
+
+  if (cdata->version >= SFEX_VERSION_V2)
+    return a > b;
+  return a != b && (a + span - b) % span < span / 2;
+}
+
+/*
+ * pick_lockdata --- choose the current copy of each lock data
+ *
+ * Every write of lock data advances its counter, so the copy with the
+ * highest counter is the last one written; copies which don't parse, such
+ * as torn writes, are ignored. If copies with that counter disagree, two
+ * nodes wrote the lock at the same time and each reached part of the
+ * devices. Which of them a node would see depends on the devices it
+ * reads, so the lock is shown held by nobody instead: both nodes detect
+ * a collision, and the others regard the lock as held until its counter
+ * stops.
+ */
+static void
+pick_lockdata (sfex_io * io, uint8_t ** copies, int ncopies,
+	       const void *arg)
+{
+  const sfex_controldata *cdata = arg;
+  size_t off;
+
+  for (off = 0; off < io->len; off += cdata->blocksize) {
+    sfex_lockdata best, l;
+    int found = -1, conflict = 0;
+    int i;
+
+    for (i = 0; i < ncopies; i++) {
+      if (parse_lockdata (cdata, copies[i] + off, &l) != NULL)
+	continue;
+      if (found == -1 || count_newer (cdata, l.count, best.count)) {
+	best = l;
+	found = i;
+	conflict = 0;
+      } else if (l.count == best.count
+		 && memcmp (copies[i] + off, copies[found] + off,
+			    cdata->blocksize) != 0)
+	conflict = 1;
+    }
+    if (found == -1)
+      found = 0;		/* let the caller report the error */
+    if (conflict) {
+      best.status = SFEX_STATUS_LOCK;
+      set_lockdata_owner (&best, "");
+      encode_lockdata (cdata, (uint8_t *) io->buf + off, &best);
+    } else
+      memcpy ((uint8_t *) io->buf + off, copies[found] + off, cdata->blocksize);
+  }
+}
+
+/*
+ * read_lockdata --- read lock data from file
+ *
+ * read sfex_lockdata from file and seek file pointer to head position of the 
+ * file.
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- pointer for lock data. Read lock data are stored into this 
+ * pointed area.
+ *
+ * device --- file name of source file
+ *
+ * index --- index number. 1 origin.
+ */
+int
+read_lockdata (const sfex_controldata * cdata, sfex_lockdata * ldata,
+	       int index)
+{
+  return read_lockdata_range (cdata, ldata, index, 1);
+}
+
+/*
+ * read_lockdata_range --- read consecutive lock data from file
+ *
+ * read count sfex_lockdata starting at the given index with one read.
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- array of count lock data. Read lock data are stored into this 
+ * pointed area.
+ *
+ * index --- index number of the first lock data. 1 origin.
+ *
+ * count --- number of lock data to read
+ */
+int
+read_lockdata_range (const sfex_controldata * cdata, sfex_lockdata * ldata,
+		     int index, int count)
+{
+  uint8_t *buf;
+  sfex_io io;
+  int ret = 0;
+  int i;
+
+  buf = alloc_iobuf (cdata->blocksize * count);
+  if (buf == NULL)
+    return -1;
+
+  /* read from file */
+  io.write = 0;
+  io.buf = buf;
+  io.len = cdata->blocksize * count;
+  io.offset = cdata->blocksize * index;
+  if (sfex_ctx_submit_pick (cdata->ctx, &io, 1, pick_lockdata, cdata) == -1) {
+    free (buf);
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (decode_lockdata (cdata, buf + cdata->blocksize * i, &ldata[i]) == -1) {
+      ret = -1;
+      break;
+    }
+  }
+  free (buf);
+  return ret;
+}
+
+/*
+ * read_lockdata_set --- read lock data of a set of indexes
+ *
+ * ldata[i] is set to the lock data of indexes[i]. The indexes must be
+ * sorted. Runs of indexes at most SFEX_READ_GAP blocks apart are read with
+ * one request, the blocks between them included, and all the requests are
+ * submitted together; so a set of nearby indexes costs one read, and a
+ * set spread over a large table does not read the whole span.
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- array of count lock data
+ *
+ * indexes --- array of count index numbers
+ *
+ * count --- number of lock data to read
+ */
+int
+read_lockdata_set (const sfex_controldata * cdata, sfex_lockdata * ldata,
+		   const int *indexes, int count)
+{
+  uint8_t *buf = NULL;
+  sfex_io *ios;
+  size_t total = 0;
+  int nios = 0;
+  int i, j, ret = -1;
+
+  ios = malloc (sizeof (*ios) * count);
+  if (ios == NULL)
+    return -1;
+
+  for (i = 0; i < count; i++) {
+    off_t off = (off_t) cdata->blocksize * indexes[i];
+
+    if (nios > 0 && off <= ios[nios - 1].offset + (off_t) ios[nios - 1].len
+	+ (off_t) cdata->blocksize * SFEX_READ_GAP) {
+      ios[nios - 1].len = off - ios[nios - 1].offset + cdata->blocksize;
+      continue;
+    }
+    ios[nios].write = 0;
+    ios[nios].offset = off;
+    ios[nios].len = cdata->blocksize;
+    nios++;
   }
-  if (strlen (u.nodename) > SFEX_MAX_NODENAME) {
-    cl_log(LOG_ERR,
-      "nodename %s is too long. must be less than %lu byte.\n",
-       u.nodename, (unsigned long)SFEX_MAX_NODENAME);
-    exit (3);
+  for (j = 0; j < nios; j++)
+    total += ios[j].len;
+  buf = alloc_iobuf (total);
+  if (buf == NULL)
+    goto out;
+  total = 0;
+  for (j = 0; j < nios; j++) {
+    ios[j].buf = buf + total;
+    total += ios[j].len;
   }
-  n = strdup (&u.nodename[0]);
-  if (!n) {
-    cl_log(LOG_ERR, "%s\n", strerror (errno));
-    exit (3);
+  if (sfex_ctx_submit_pick (cdata->ctx, ios, nios, pick_lockdata, cdata) == -1)
+    goto out;
+
+  for (i = 0, j = 0; i < count; i++) {
+    off_t off = (off_t) cdata->blocksize * indexes[i];
+
+    while (off >= ios[j].offset + (off_t) ios[j].len)
+      j++;
+    if (decode_lockdata (cdata, (uint8_t *) ios[j].buf + (off - ios[j].offset),
+			 &ldata[i]) == -1)
+      goto out;
   }
-  return n;
+  ret = 0;
+
+out:
+  free (buf);
+  free (ios);
+  return ret;
 }
 
 /*
- * init_controldata --- initialize control data
+ * scan_lockdata --- read a range of lock data in large chunks
  *
- * We initialize each member of sfex_controldata structure.
+ * The count lock data starting at index are read with requests of
+ * SFEX_IO_CHUNK bytes, SFEX_SCAN_DEPTH of them submitted together, and
+ * fn() is called for each lock data in order. Memory use does not grow
+ * with the number of locks, so the whole table of a large meta-data can
+ * be scanned.
+ *
+ * fn --- called with the index, the lock data and arg. A non-zero return
+ * value stops the scan.
+ *
+ * return value --- 0 if all lock data were scanned, 1 if fn() stopped the
+ * scan, -1 on error.
  */
-void
-init_controldata (sfex_controldata * cdata, size_t blocksize, int numlocks)
+int
+scan_lockdata (const sfex_controldata * cdata, int index, int count,
+	       sfex_scan fn, void *arg)
 {
-  memcpy (cdata->magic, SFEX_MAGIC, sizeof (cdata->magic));
-  cdata->version = SFEX_VERSION;
-  cdata->revision = SFEX_REVISION;
-  cdata->blocksize = blocksize;
-  cdata->numlocks = numlocks;
+  int per_io = SFEX_IO_CHUNK / cdata->blocksize;
+  uint8_t *buf;
+  sfex_io ios[SFEX_SCAN_DEPTH];
+  sfex_lockdata ldata;
+  int ret = 0;
+
+  if (per_io < 1)
+    per_io = 1;
+  buf = alloc_iobuf (cdata->blocksize * per_io * SFEX_SCAN_DEPTH);
+  if (buf == NULL)
+    return -1;
+
+  while (count > 0 && ret == 0) {
+    int nios = 0, n = 0, i;
+
+    while (nios < SFEX_SCAN_DEPTH && n < count) {
+      int blocks = count - n < per_io ? count - n : per_io;
+
+      ios[nios].write = 0;
+      ios[nios].buf = buf + cdata->blocksize * n;
+      ios[nios].len = cdata->blocksize * blocks;
+      ios[nios].offset = (off_t) cdata->blocksize * (index + n);
+      nios++;
+      n += blocks;
+    }
+    if (sfex_ctx_submit_pick (cdata->ctx, ios, nios, pick_lockdata, cdata) == -1) {
+      ret = -1;
+      break;
+    }
+    for (i = 0; i < n; i++) {
+      if (decode_lockdata (cdata, buf + cdata->blocksize * i, &ldata) == -1) {
+	cl_log(LOG_ERR, "lock data #%d is broken.\n", index + i);
+	ret = -1;
+	break;
+      }
+      if (fn (index + i, &ldata, arg)) {
+	ret = 1;
+	break;
+      }
+    }
+    index += n;
+    count -= n;
+  }
+  free (buf);
+  return ret;
 }
 
 /*
- * init_lockdata --- initialize lock data
+ * clear_lockmap --- write an empty lock map
  *
- * We initialize each member of sfex_lockdata structure.
+ * return value --- 0, or -1 on error. Nothing is done if the meta-data
+ * have no lock map.
  */
-void
-init_lockdata (sfex_lockdata * ldata)
+int
+clear_lockmap (const sfex_controldata * cdata)
 {
-  ldata->status = SFEX_STATUS_UNLOCK;
-  ldata->count = 0;
-  ldata->nodename[0] = 0;
+  int maps = lockmap_blocks (cdata);
+  uint8_t *buf;
+  sfex_io io;
+  int k, ret;
+
+  if (maps == 0)
+    return 0;
+  buf = alloc_iobuf (cdata->blocksize * maps);
+  if (buf == NULL)
+    return -1;
+  for (k = 0; k < maps; k++)
+    seal_lockmap_block (cdata, buf + cdata->blocksize * k, k);
+  io.write = 1;
+  io.buf = buf;
+  io.len = cdata->blocksize * maps;
+  io.offset = lockmap_offset (cdata, 0);
+  ret = sfex_ctx_submit (cdata->ctx, &io, 1);
+  free (buf);
+  return ret;
 }
 
 /*
- * write_controldata --- write control data into file
+ * read_lockmap --- read the lock map
  *
- * We write sfex_controldata struct into file. We open a file with 
- * synchronization mode and write out control data.
+ * The blocks of the lock map are read with one read, and their bits are
+ * copied into bits: bit (index - 1) % 8 of bits[(index - 1) / 8] is the bit
+ * of index.
  *
- * cdata --- pointer of control data
+ * bits --- (numlocks + 7) / 8 bytes
  *
- * device --- name of target file
+ * return value --- 0, or -1 if there is no lock map, it is broken, or on
+ * I/O error.
  */
-void
-write_controldata (const sfex_controldata * cdata)
+int
+read_lockmap (const sfex_controldata * cdata, uint8_t * bits)
 {
-  sfex_controldata_ondisk *block;
-  int fd;
+  size_t per_block = SFEX_LOCKMAP_BITS (cdata->blocksize) / 8;
+  size_t len = (cdata->numlocks + 7) / 8;
+  int maps = lockmap_blocks (cdata);
+  uint8_t *buf;
+  sfex_io io;
+  int k, ret = -1;
 
-  block = (sfex_controldata_ondisk *) (locked_mem);
+  if (maps == 0)
+    return -1;
+  buf = alloc_iobuf (cdata->blocksize * maps);
+  if (buf == NULL)
+    return -1;
+  io.write = 0;
+  io.buf = buf;
+  io.len = cdata->blocksize * maps;
+  io.offset = lockmap_offset (cdata, 0);
+  if (sfex_ctx_submit (cdata->ctx, &io, 1) == -1)
+    goto out;
 
-  /* We write control data into the buffer with given format. */
-  /* We write the offset value of each field of the control data directly.
-   * Because a point using this value is limited to two places, we do not 
-   * use macro. If you change the following offset values, you must change 
-   * values in the read_controldata() function.
-   */
-  memset (block, 0, cdata->blocksize);
-  memcpy (block->magic, cdata->magic, sizeof (block->magic));
-  snprintf ((char *) (block->version), sizeof (block->version), "%d",
-	    cdata->version);
-  snprintf ((char *) (block->revision), sizeof (block->revision), "%d",
-	    cdata->revision);
-  snprintf ((char *) (block->blocksize), sizeof (block->blocksize), "%u",
-	    (unsigned)cdata->blocksize);
-  snprintf ((char *) (block->numlocks), sizeof (block->numlocks), "%d",
-	    cdata->numlocks);
-
-  fd = dev_fd;
-  if (lseek (fd, 0, SEEK_SET) == -1) {
-    cl_log(LOG_ERR, "can't seek file pointer: %s\n",
-		  strerror (errno));
-    exit (3);
-  }
+  for (k = 0; k < maps; k++) {
+    uint8_t *block = buf + cdata->blocksize * k;
+    size_t off = per_block * k;
 
-  /* write buffer into a file  */
-  do {
-	  ssize_t s = write (fd, block, cdata->blocksize);
-	  if (s == -1) {
-		  if (errno == EINTR || errno == EAGAIN)
-			  continue;
-		  cl_log(LOG_ERR, "can't write meta-data: %s\n",
-				strerror (errno));
-		  exit (3);
-	  }
-	  else
-		  break;
+    if (check_lockmap_block (cdata, block, k) == -1) {
+      cl_log(LOG_ERR, "lock map block #%d is broken.\n", k);
+      goto out;
+    }
+    memcpy (bits + off, block + sizeof (sfex_lockmap_ondisk),
+	    len - off < per_block ? len - off : per_block);
   }
-  while (1);
+  ret = 0;
+
+out:
+  free (buf);
+  return ret;
 }
 
 /*
- * write_lockdata --- write lock data into file
- *
- * We write sfex_lockdata into file and seek file pointer to the given
- * position of lock data.
+ * update_lockmap --- set or clear the bits of a set of locks in the map
  *
- * cdata --- pointer for control data
+ * The blocks of the lock map holding the bits of the indexes are read
+ * with one read, and those which change are written back. A broken block
+ * is rebuilt with the bits of this update only. Nothing is done if the
+ * meta-data have no lock map.
  *
- * ldata --- pointer for lock data
+ * indexes --- array of count sorted index numbers
  *
- * device --- file name for write
+ * used --- 1 to set the bits, 0 to clear them
  *
- * index --- index number for lock data. 1 origine.
+ * return value --- 0, or -1 on error.
  */
 int
-write_lockdata (const sfex_controldata * cdata, const sfex_lockdata * ldata,
-		int index)
+update_lockmap (const sfex_controldata * cdata, const int *indexes,
+		int count, int used)
 {
-  sfex_lockdata_ondisk *block;
-  int fd;
+  size_t bits = SFEX_LOCKMAP_BITS (cdata->blocksize);
+  uint8_t *buf, *changed;
+  sfex_io *ios;
+  int first, maps, nios = 0;
+  int i, k, ret = -1;
 
-  block = (sfex_lockdata_ondisk *) locked_mem;
-  /* We write lock data into buffer with given format */
-  /* We write the offset value of each field of the control data directly.
-   * Because a point using this value is limited to two places, we do not 
-   * use macro. If you chage the following offset values, you must change 
-   * values in the read_lockdata() function.
-   */
-  memset (block, 0, cdata->blocksize);
-  block->status = ldata->status;
-  snprintf ((char *) (block->count), sizeof (block->count), "%d",
-	    ldata->count);
-  snprintf ((char *) (block->nodename), sizeof (block->nodename), "%s",
-	    ldata->nodename);
-
-  fd = dev_fd;
-
-  /* seek a file pointer to given position */
-  if (lseek (fd, cdata->blocksize * index, SEEK_SET) == -1) {
-    cl_log(LOG_ERR, "can't seek file pointer: %s\n",
-		  strerror (errno));
-    return -1;
+  if (lockmap_blocks (cdata) == 0 || count == 0)
+    return 0;
+  first = (indexes[0] - 1) / bits;
+  maps = (indexes[count - 1] - 1) / bits - first + 1;
+  buf = alloc_iobuf (cdata->blocksize * maps);
+  changed = calloc (maps, 1);
+  ios = malloc (sizeof (*ios) * maps);
+  if (buf == NULL || changed == NULL || ios == NULL)
+    goto out;
+
+  ios[0].write = 0;
+  ios[0].buf = buf;
+  ios[0].len = cdata->blocksize * maps;
+  ios[0].offset = lockmap_offset (cdata, first);
+  if (sfex_ctx_submit (cdata->ctx, ios, 1) == -1)
+    goto out;
+
+  for (k = 0; k < maps; k++) {
+    uint8_t *block = buf + cdata->blocksize * k;
+
+    if (check_lockmap_block (cdata, block, first + k) == -1) {
+      cl_log(LOG_WARNING, "lock map block #%d is broken. rebuilding it.\n", first + k);
+      memset (block, 0, cdata->blocksize);
+      changed[k] = 1;
+    }
   }
+  for (i = 0; i < count; i++) {
+    size_t b = (indexes[i] - 1) % bits;
+    int k = (indexes[i] - 1) / bits - first;
+    uint8_t *byte = buf + cdata->blocksize * k + sizeof (sfex_lockmap_ondisk) + b / 8;
+    uint8_t mask = 1 << (b % 8);
 
-  /* write buffer into file */
-  do {
-    ssize_t s = write (fd, block, cdata->blocksize);
-    if (s == -1) {
-      if (errno == EINTR || errno == EAGAIN)
-	continue;
-      cl_log(LOG_ERR, "can't write meta-data: %s\n",
-		    strerror (errno));
-      return -1;
+    if (!!(*byte & mask) != used) {
+      *byte ^= mask;
+      changed[k] = 1;
     }
-    else if (s != cdata->blocksize) {
-      /* if writing atomically failed, this process is error */
-      cl_log(LOG_ERR, "can't write meta-data atomically.\n");
-      return -1;
+  }
+
+  /* write back the changed blocks, each run of them with one request */
+  for (k = 0; k < maps; k++) {
+    uint8_t *block = buf + cdata->blocksize * k;
+
+    if (!changed[k])
+      continue;
+    seal_lockmap_block (cdata, block, first + k);
+    if (nios > 0 && k > 0 && changed[k - 1]) {
+      ios[nios - 1].len += cdata->blocksize;
+      continue;
     }
-    break;
+    ios[nios].write = 1;
+    ios[nios].buf = block;
+    ios[nios].len = cdata->blocksize;
+    ios[nios].offset = lockmap_offset (cdata, first + k);
+    nios++;
   }
-  while (1);
-  return 0;
+  ret = nios > 0 ? sfex_ctx_submit (cdata->ctx, ios, nios) : 0;
+
+out:
+  free (ios);
+  free (changed);
+  free (buf);
+  return ret;
 }
 
 /*
- * read_controldata --- read control data from file
+ * sfex_acquire --- acquire one lock
  *
- * read sfex_controldata structure from file.
+ * The lock is claimed, and after collision_timeout ms, when any other
+ * node claiming it at the same time has written it, it is checked to be
+ * still ours and extended. This does not wait for a lock held by another
+ * node. The caller waits lock_timeout and calls again with the same
+ * ldata, and the lock is taken over if its holder did not update it
+ * meanwhile.
  *
- * cdata --- pointer for control data
+ * ldata --- the lock data read by the last call, or initialized with
+ * init_lockdata() for the first one. It is set to the lock data read.
  *
- * device --- file name for reading
+ * return value --- 0 if acquired, 1 if the lock is held by another node
+ * or a collision was detected, -1 on error.
  */
 int
-read_controldata (sfex_controldata * cdata)
+sfex_acquire (const sfex_controldata * cdata, int index,
+	      const sfex_lease * lease, unsigned long collision_timeout,
+	      sfex_lockdata * ldata)
 {
-  sfex_controldata_ondisk *block;
-
-  block = (sfex_controldata_ondisk *) (locked_mem);
+  sfex_lockdata cur, check;
 
-  if (lseek (dev_fd, 0, SEEK_SET) == -1) {
-    cl_log(LOG_ERR, "can't seek file pointer: %s\n",
-		  strerror (errno));
+  if (read_lockdata (cdata, &cur, index) == -1)
     return -1;
+  if (cur.status == SFEX_STATUS_LOCK
+      && lockdata_owned_by (cdata, &cur, lease->nodename)
+      && strncmp (lease->nodename, cur.nodename, sizeof (cur.nodename))) {
+    /* two node names map to the same node ID */
+    cl_log(LOG_ERR, "can't acquire lock #%d: node ID of %s is the same as %s.\n",
+	   index, lease->nodename, cur.nodename);
+    *ldata = cur;
+    return 1;
   }
-
-  /* read data from file */
-  do {
-	  ssize_t s = read (dev_fd, block, sector_size);
-	  if (s == -1) {
-		  if (errno == EINTR || errno == EAGAIN)
-			  continue;
-		  cl_log(LOG_ERR,
-			  "can't read controldata meta-data: %s\n",
-			   strerror (errno));
-		  return -1;
-	  }
-	  else
-		  break;
-  } while (1);
-
-  /* read control data from buffer */
-  /* 1. check the magic number.  2. check null terminator of each field 
-     3. check the version number.  4. Unmuch of revision number is allowed  */
-  /* We write the offset value of each field of the control data directly.
-   * Because a point using this value is limited to two places, we do not 
-   * use macro. If you chage the following offset values, you must change 
-   * values in the write_controldata() function.
-   */
-  memcpy (cdata->magic, block->magic, 4);
-  if (memcmp (cdata->magic, SFEX_MAGIC, sizeof (cdata->magic))) {
-    cl_log(LOG_ERR, "magic number mismatched. %c%c%c%c <-> %s\n", block->magic[0], block->magic[1], block->magic[2], block->magic[3], SFEX_MAGIC);
-    return -1;
+  if (cur.status == SFEX_STATUS_LOCK
+      && !lockdata_owned_by (cdata, &cur, lease->nodename)
+      && (ldata->status != SFEX_STATUS_LOCK || ldata->count != cur.count
+	  || strncmp (ldata->nodename, cur.nodename, sizeof (cur.nodename)))) {
+    /* held, or updated since the last call */
+    *ldata = cur;
+    return 1;
   }
-  if (block->version[sizeof (block->version)-1]
-      || block->revision[sizeof (block->revision)-1]
-      || block->blocksize[sizeof (block->blocksize)-1]
-      || block->numlocks[sizeof (block->numlocks)-1]) {
-    cl_log(LOG_ERR, "control data format error.\n");
+
+  cur.status = SFEX_STATUS_LOCK;
+  cur.count = SFEX_NEXT_COUNT (cdata, cur.count);
+  cur.expiry = lease->expiry;
+  cur.interval = lease->interval;
+  cur.takeover = lease->takeover;
+  set_lockdata_owner (&cur, lease->nodename);
+  if (write_lockdata (cdata, &cur, index) == -1)
     return -1;
-  }
-  cdata->version = atoi ((char *) (block->version));
-  if (cdata->version != SFEX_VERSION) {
-    cl_log(LOG_ERR,
-      "version number mismatched. program is %d, data is %d.\n",
-       SFEX_VERSION, cdata->version);
+
+  /* detect the collision of lock */
+  sleep_msec (collision_timeout);
+  if (read_lockdata (cdata, &check, index) == -1)
     return -1;
+  if (!lockdata_owned_by (cdata, &check, lease->nodename)) {
+    cl_log(LOG_ERR, "can't acquire lock #%d: collision detected in the air.\n",
+	   index);
+    *ldata = check;
+    return 1;
   }
-  cdata->revision = atoi ((char *) (block->revision));
-  cdata->blocksize = atoi ((char *) (block->blocksize));
-  cdata->numlocks = atoi ((char *) (block->numlocks));
 
+  /* extension of lock */
+  cur.count = SFEX_NEXT_COUNT (cdata, cur.count);
+  if (write_lockdata (cdata, &cur, index) == -1)
+    return -1;
+  if (update_lockmap (cdata, &index, 1, 1) == -1)
+    cl_log(LOG_WARNING, "can't update the lock map.\n");
+  *ldata = cur;
   return 0;
 }
 
 /*
- * read_lockdata --- read lock data from file
- *
- * read sfex_lockdata from file and seek file pointer to head position of the 
- * file.
- *
- * cdata --- pointer for control data
- *
- * ldata --- pointer for lock data. Read lock data are stored into this 
- * pointed area.
+ * sfex_update --- update the held locks, the heartbeat
  *
- * device --- file name of source file
+ * The locks are read with one batch and written back with another.
  *
- * index --- index number. 1 origin.
+ * return value --- 0 on success, 1 if a lock is no longer ours, in which
+ * case nothing is written, -1 on error.
  */
 int
-read_lockdata (const sfex_controldata * cdata, sfex_lockdata * ldata,
-	       int index)
+sfex_update (const sfex_controldata * cdata, const int *indexes, int count,
+	     const sfex_lease * lease)
 {
-  sfex_lockdata_ondisk *block;
-  int fd;
-
-  block = (sfex_lockdata_ondisk *) (locked_mem);
+  sfex_lockdata *area;
+  int i, ret = -1;
 
-  fd = dev_fd;
-
-  /* seek a file pointer to given position */
-  if (lseek (fd, cdata->blocksize * index, SEEK_SET) == -1) {
-    cl_log(LOG_ERR, "can't seek file pointer: %s\n",
-		  strerror (errno));
+  area = malloc (sizeof (*area) * count);
+  if (area == NULL) {
+    cl_log(LOG_ERR, "%s\n", strerror (errno));
     return -1;
   }
+  if (read_lockdata_set (cdata, area, indexes, count) == -1)
+    goto out;
+  for (i = 0; i < count; i++) {
+    sfex_lockdata *l = &area[i];
 
-  /* read from file */
-  do {
-    ssize_t s = read (fd, block, cdata->blocksize);
-    if (s == -1) {
-      if (errno == EINTR || errno == EAGAIN)
-	continue;
-      cl_log(LOG_ERR, "can't read lockdata meta-data: %s\n",
-		    strerror (errno));
-      return -1;
-    }
-    else if (s != cdata->blocksize) {
-      cl_log(LOG_ERR, "can't read meta-data atomically.\n");
-      return -1;
+    if (l->status != SFEX_STATUS_LOCK
+	|| !lockdata_owned_by (cdata, l, lease->nodename)) {
+      cl_log(LOG_ERR, "can't update lock #%d.\n", indexes[i]);
+      ret = 1;
+      goto out;
     }
-    break;
+    l->count = SFEX_NEXT_COUNT (cdata, l->count);
+    l->expiry = lease->expiry;
+    l->interval = lease->interval;
+    l->takeover = lease->takeover;
   }
-  while (1);
+  ret = write_lockdata_set (cdata, area, indexes, 0, count);
 
-  /* read control data form buffer */
-  /* 1. check null terminator of each field 2. check the status */
-  /* We write the offset value of each field of the control data directly.
-   * Because a point using this value is limited to two places, we do not 
-   * use macro. If you chage the following offset values, you must change 
-   * values in the write_lockdata() function.
-   */
-  if (block->count[sizeof(block->count)-1] || block->nodename[sizeof(block->nodename)-1]) {
-    cl_log(LOG_ERR, "lock data format error.\n");
-    return -1;
+out:
+  free (area);
+  return ret;
+}
+
+/*
+ * sfex_release --- release held locks at once
+ *
+ * The locks still owned by nodename are written back unlocked with the
+ * writes submitted together. Locks already taken by another node are left
+ * alone.
+ *
+ * return value --- 0 if all locks were released, 1 if some were released
+ * already, -1 on error.
+ */
+int
+sfex_release (const sfex_controldata * cdata, const int *indexes, int count,
+	      const char *nodename)
+{
+  sfex_lockdata *area;
+  int *released;
+  int n = 0;
+  int i, ret = 0;
+
+  area = malloc (sizeof (*area) * count);
+  released = malloc (sizeof (*released) * count);
+  if (area == NULL || released == NULL) {
+    cl_log(LOG_ERR, "%s\n", strerror (errno));
+    ret = -1;
+    goto out;
   }
-  ldata->status = block->status;
-  if (ldata->status != SFEX_STATUS_UNLOCK
-      && ldata->status != SFEX_STATUS_LOCK) {
-    cl_log(LOG_ERR, "lock data format error.\n");
-    return -1;
+  if (read_lockdata_set (cdata, area, indexes, count) == -1) {
+    ret = -1;
+    goto out;
   }
-  ldata->count = atoi ((char *) (block->count));
-  strncpy ((char *) (ldata->nodename), (const char *) (block->nodename), sizeof(block->nodename));
 
-#ifdef SFEX_DEBUG
-  cl_log(LOG_INFO, "status: %c\n", ldata->status);
-  cl_log(LOG_INFO, "count: %d\n", ldata->count);
-  cl_log(LOG_INFO, "nodename: %s\n", ldata->nodename);
-#endif
-  return 0;
+  for (i = 0; i < count; i++) {
+    sfex_lockdata *l = &area[i];
+
+    /* if own node is not locking, we judge that lock has been released already */
+    if (l->status != SFEX_STATUS_LOCK || !lockdata_owned_by (cdata, l, nodename)) {
+      cl_log(LOG_ERR, "lock #%d was already released.\n", indexes[i]);
+      ret = 1;
+      continue;
+    }
+    area[n] = *l;
+    area[n].status = SFEX_STATUS_UNLOCK;
+    area[n].count = SFEX_NEXT_COUNT (cdata, l->count);
+    area[n].expiry = 0;
+    released[n++] = indexes[i];
+  }
+
+  if (n > 0 && write_lockdata_set (cdata, area, released, 0, n) == -1)
+    ret = -1;
+  else {
+    if (update_lockmap (cdata, released, n, 0) == -1)
+      cl_log(LOG_WARNING, "can't update the lock map.\n");
+    for (i = 0; i < n; i++)
+      cl_log(LOG_INFO, "lock #%d released\n", released[i]);
+  }
+
+out:
+  free (released);
+  free (area);
+  return ret;
 }
 
 /*
@@ -463,9 +2899,204 @@ lock_index_check(sfex_controldata * cdata, int index)
                 return -1;
         }
 
-        if (cdata->blocksize != sector_size) {
-                cl_log(LOG_ERR, "sector_size is not the same as the blocksize.\n");
-                return -1;
-        }
+        if (cdata->blocksize < cdata->ctx->physical_block_size)
+                cl_log(LOG_WARNING, "blocksize %lu is smaller than the physical block size %lu. "
+                                "each write of lock data makes the device read and write a whole physical block. "
+                                "see sfex_init -b.\n",
+                                (unsigned long)cdata->blocksize, cdata->ctx->physical_block_size);
         return 0;
 }
+
+/*
+ * histogram_reset --- empty a histogram
+ */
+void
+histogram_reset (sfex_histogram * h)
+{
+  memset (h, 0, sizeof (*h));
+}
+
+/* bucket of a value, see sfex_histogram */
+static int
+histogram_bucket (uint64_t v)
+{
+  int msb, shift, b;
+
+  if (v < SFEX_HIST_SUB)
+    return v;
+  msb = 63 - __builtin_clzll (v);
+  shift = msb - SFEX_HIST_SUB_BITS;
+  b = (shift + 1) * SFEX_HIST_SUB + (int) ((v >> shift) - SFEX_HIST_SUB);
+  return b < SFEX_HIST_BUCKETS ? b : SFEX_HIST_BUCKETS - 1;
+}
+
+/*
+ * histogram_bucket_limit --- the largest value counted in a bucket
+ */
+uint64_t
+histogram_bucket_limit (int bucket)
+{
+  int shift, sub;
+
+  if (bucket < SFEX_HIST_SUB)
+    return bucket;
+  shift = bucket / SFEX_HIST_SUB - 1;
+  sub = bucket % SFEX_HIST_SUB;
+  return ((uint64_t) (SFEX_HIST_SUB + sub + 1) << shift) - 1;
+}
+
+/*
+ * histogram_add --- count one value
+ */
+void
+histogram_add (sfex_histogram * h, uint64_t usec)
+{
+  h->buckets[histogram_bucket (usec)]++;
+  h->count++;
+  if (usec > h->max)
+    h->max = usec;
+}
+
+/*
+ * histogram_percentile --- the value below which percent of the values are
+ *
+ * The upper limit of the bucket is returned, but never more than the
+ * largest value counted. 0 if the histogram is empty.
+ */
+uint64_t
+histogram_percentile (const sfex_histogram * h, double percent)
+{
+  uint64_t rank, seen = 0;
+  int b;
+
+  if (h->count == 0)
+    return 0;
+  rank = (uint64_t) (h->count * percent / 100);
+  if (rank >= h->count)
+    rank = h->count - 1;
+  for (b = 0; b < SFEX_HIST_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen > rank) {
+      uint64_t limit = histogram_bucket_limit (b);
+      return limit < h->max ? limit : h->max;
+    }
+  }
+  return h->max;
+}
+
+/*
+ * status_page_create --- create the status page of sfex_daemon
+ *
+ * path is created or truncated, sized and mapped shared. The page starts
+ * in SFEX_STATE_STARTING.
+ *
+ * return value --- the mapped page, or NULL.
+ */
+sfex_status *
+status_page_create (const char *path)
+{
+  sfex_status *page;
+  int fd;
+
+  fd = open (path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1 || ftruncate (fd, sizeof (*page)) == -1) {
+    cl_log (LOG_ERR, "can't create status page %s: %s\n", path,
+	    strerror (errno));
+    if (fd != -1)
+      close (fd);
+    return NULL;
+  }
+  page = mmap (NULL, sizeof (*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (page == MAP_FAILED) {
+    cl_log (LOG_ERR, "can't map status page %s: %s\n", path, strerror (errno));
+    return NULL;
+  }
+  memcpy (page->magic, SFEX_STATUS_MAGIC, sizeof (page->magic));
+  page->version = SFEX_STATUS_VERSION;
+  page->pid = getpid ();
+  page->state = SFEX_STATE_STARTING;
+  return page;
+}
+
+/*
+ * status_page_open --- map a status page for reading
+ *
+ * return value --- the mapped page, or NULL if it is missing or is not a
+ * status page of this version.
+ */
+sfex_status *
+status_page_open (const char *path)
+{
+  sfex_status *page;
+  struct stat st;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1 || fstat (fd, &st) == -1 || st.st_size < (off_t) sizeof (*page)) {
+    cl_log (LOG_ERR, "can't open status page %s: %s\n", path,
+	    fd == -1 ? strerror (errno) : "too short");
+    if (fd != -1)
+      close (fd);
+    return NULL;
+  }
+  page = mmap (NULL, sizeof (*page), PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (page == MAP_FAILED) {
+    cl_log (LOG_ERR, "can't map status page %s: %s\n", path, strerror (errno));
+    return NULL;
+  }
+  if (memcmp (page->magic, SFEX_STATUS_MAGIC, sizeof (page->magic)) != 0
+      || page->version != SFEX_STATUS_VERSION) {
+    cl_log (LOG_ERR, "%s is not a status page of this version.\n", path);
+    munmap (page, sizeof (*page));
+    return NULL;
+  }
+  return page;
+}
+
+/*
+ * status_page_begin, status_page_end --- bracket a change of the page
+ *
+ * Only one writer, sfex_daemon, exists, so no lock is needed; readers
+ * never block it.
+ */
+void
+status_page_begin (sfex_status * page)
+{
+  page->seq++;
+  __sync_synchronize ();
+}
+
+void
+status_page_end (sfex_status * page)
+{
+  __sync_synchronize ();
+  page->seq++;
+}
+
+/*
+ * status_page_read --- take a consistent copy of the page
+ *
+ * return value --- 0, or -1 if the writer kept changing it.
+ */
+int
+status_page_read (const sfex_status * page, sfex_status * copy)
+{
+  int tries;
+
+  for (tries = 0; tries < 1000; tries++) {
+    uint32_t seq = page->seq;
+
+    if (seq & 1) {
+      sched_yield ();
+      continue;
+    }
+    __sync_synchronize ();
+    memcpy (copy, (const void *) page, sizeof (*copy));
+    __sync_synchronize ();
+    if (page->seq == seq)
+      return 0;
+  }
+  return -1;
+}
@@ -28,15 +28,139 @@
 #ifndef LIB_H
 #define LIB_H
 
+/*
+ * sfex_ctx --- the devices of one meta-data and how they are accessed
+ *
+ * The functions taking a sfex_ctx, or a sfex_controldata set up by
+ * sfex_ctx_read_controldata() or sfex_ctx_init_controldata(), may be
+ * called from several threads, with one context or several. They return
+ * an error instead of exiting. The older functions without a context,
+ * such as prepare_lock(), work on a default context for the programs of
+ * sfex and exit on errors.
+ */
+typedef struct sfex_ctx sfex_ctx;
+
+/*
+ * sfex_lease --- what a node writes with the locks it holds
+ */
+typedef struct sfex_lease {
+  const char *nodename;
+  uint32_t interval;		/* ms between the heartbeats; format 2 */
+  uint32_t takeover;		/* ms of missed heartbeats before a takeover; format 2 */
+  uint64_t expiry;		/* CLOCK_REALTIME ms; format 2 */
+} sfex_lease;
+
+/*
+ * sfex_io --- one positional I/O request for sfex_ctx_submit()
+ *
+ * buf must be aligned for direct I/O; use alloc_iobuf(). result is set to
+ * the number of bytes transferred, or a negative errno.
+ */
+typedef struct sfex_io {
+  int write;			/* 1 for write, 0 for read */
+  void *buf;
+  size_t len;
+  off_t offset;
+  ssize_t result;
+} sfex_io;
+
+/*
+ * sfex_pick --- make the result of a read from the copies of the devices
+ *
+ * With several devices, a read is done on each of them, and io->buf is
+ * filled from the ncopies copies of the devices which completed it.
+ */
+typedef void (*sfex_pick) (sfex_io *io, uint8_t **copies, int ncopies, const void *arg);
+
+/*
+ * sfex_scan --- called by scan_lockdata() for each lock data
+ *
+ * return value --- non-zero to stop the scan.
+ */
+typedef int (*sfex_scan) (int index, const sfex_lockdata *ldata, void *arg);
+
+/*
+ * sfex_histogram --- latency histogram in microseconds
+ *
+ * Below SFEX_HIST_SUB us every value has its own bucket; above, each power
+ * of two is split into SFEX_HIST_SUB buckets, so a value is kept within
+ * about 6%, up to days, in a few kilobytes.
+ */
+#define SFEX_HIST_SUB_BITS 4
+#define SFEX_HIST_SUB (1 << SFEX_HIST_SUB_BITS)
+#define SFEX_HIST_BUCKETS (SFEX_HIST_SUB * 40)
+
+typedef struct sfex_histogram {
+  uint32_t buckets[SFEX_HIST_BUCKETS];
+  uint64_t count;
+  uint64_t max;
+} sfex_histogram;
+
+void histogram_reset(sfex_histogram *h);
+void histogram_add(sfex_histogram *h, uint64_t usec);
+uint64_t histogram_percentile(const sfex_histogram *h, double percent);
+uint64_t histogram_bucket_limit(int bucket);
+
+sfex_ctx *sfex_ctx_new(void);
+void sfex_ctx_free(sfex_ctx *ctx);
+int sfex_ctx_set_io_backend(sfex_ctx *ctx, const char *name);
+const char *sfex_ctx_io_backend_name(const sfex_ctx *ctx);
+unsigned long sfex_ctx_io_syscalls(sfex_ctx *ctx);
+int sfex_ctx_io_reinit(sfex_ctx *ctx);
+void sfex_ctx_set_quorum(sfex_ctx *ctx, int n);
+unsigned long sfex_ctx_sector_size(const sfex_ctx *ctx, unsigned long *physical);
+uint64_t sfex_ctx_device_size(const sfex_ctx *ctx);
+int sfex_ctx_add_device(sfex_ctx *ctx, const char *device);
+int sfex_ctx_submit(sfex_ctx *ctx, sfex_io *ios, int n);
+int sfex_ctx_submit_pick(sfex_ctx *ctx, sfex_io *ios, int n, sfex_pick pick, const void *arg);
+int sfex_ctx_read_controldata(sfex_ctx *ctx, sfex_controldata *cdata);
+void sfex_ctx_init_controldata(sfex_ctx *ctx, sfex_controldata *cdata, size_t blocksize, int numlocks, int version);
+int sfex_acquire(const sfex_controldata *cdata, int index, const sfex_lease *lease, unsigned long collision_timeout, sfex_lockdata *ldata);
+int sfex_update(const sfex_controldata *cdata, const int *indexes, int count, const sfex_lease *lease);
+int sfex_release(const sfex_controldata *cdata, const int *indexes, int count, const char *nodename);
+char *sfex_get_nodename(void);
+
+int sfex_set_io_backend(const char *name);
+const char *sfex_io_backend_name(void);
+unsigned long sfex_io_syscalls(void);
+int sfex_io_reinit(void);
+void sfex_set_quorum(int n);
+int sfex_io_submit(sfex_io *ios, int n);
+int sfex_io_submit_pick(sfex_io *ios, int n, sfex_pick pick, const void *arg);
+void *alloc_iobuf(size_t size);
 const char *get_progname(const char *argv0);
+uint64_t get_monotonic_usec(void);
+void sleep_until_usec(uint64_t deadline);
+void sleep_msec(unsigned long msec);
+int parse_msec(const char *arg, unsigned long *msec);
 char *get_nodename(void);
-void init_controldata(sfex_controldata *cdata, size_t blocksize, int numlocks);
+void init_controldata(sfex_controldata *cdata, size_t blocksize, int numlocks, int version);
 void init_lockdata(sfex_lockdata *ldata);
-void write_controldata(const sfex_controldata *cdata);
+uint32_t crc32c(const void *buf, size_t len);
+uint32_t get_nodeid(const char *name);
+void set_lockdata_owner(sfex_lockdata *ldata, const char *name);
+int lockdata_owned_by(const sfex_controldata *cdata, const sfex_lockdata *ldata, const char *name);
+int write_controldata(const sfex_controldata *cdata);
+int write_metadata(const sfex_controldata *cdata, const sfex_lockdata *ldata);
+int verify_metadata(const sfex_controldata *cdata, const sfex_lockdata *ldata);
 int write_lockdata(const sfex_controldata *cdata, const sfex_lockdata *ldata, int index);
+int write_lockdata_range(const sfex_controldata *cdata, const sfex_lockdata *ldata, int index, int count);
+int write_lockdata_set(const sfex_controldata *cdata, const sfex_lockdata *ldata, const int *indexes, int first, int count);
 int read_controldata(sfex_controldata *cdata);
 int read_lockdata(const sfex_controldata *cdata, sfex_lockdata *ldata, int index);
+int read_lockdata_range(const sfex_controldata *cdata, sfex_lockdata *ldata, int index, int count);
+int read_lockdata_set(const sfex_controldata *cdata, sfex_lockdata *ldata, const int *indexes, int count);
+int scan_lockdata(const sfex_controldata *cdata, int index, int count, sfex_scan fn, void *arg);
+int lockmap_blocks(const sfex_controldata *cdata);
+int clear_lockmap(const sfex_controldata *cdata);
+int read_lockmap(const sfex_controldata *cdata, uint8_t *bits);
+int update_lockmap(const sfex_controldata *cdata, const int *indexes, int count, int used);
 int prepare_lock(const char *device);
 int lock_index_check(sfex_controldata * cdata, int index);
+sfex_status *status_page_create(const char *path);
+sfex_status *status_page_open(const char *path);
+void status_page_begin(sfex_status *page);
+void status_page_end(sfex_status *page);
+int status_page_read(const sfex_status *page, sfex_status *copy);
 
 #endif /* LIB_H */
@@ -25,15 +25,40 @@
  *
  *-------------------------------------------------------------------------
  *
- * sfex_stat [-i <index>] <device>
+ * sfex_stat [-i <index>] [-a] [-s] [-f] [-w <interval>] <device> [<device>...]
+ * sfex_stat -d <status_file>
  *
  * -i <index> --- The index is number of the resource that display the lock.
  * This number is specified by the integer of one or more. When two or more 
  * resources are exclusively controlled by one meta-data, this option is used. 
  * Default is 1.
  *
+ * -a, --all --- Display all the lock data on the device. They are read with
+ * a few large reads.
+ *
+ * -s, --summary --- Instead of each lock data, display the numbers of held
+ * and free locks and of the locks of each holder, read with a few large
+ * reads, and check the lock map of format version 2 against them.
+ *
+ * -f, --free --- Print the lowest index whose lock is not held, found with
+ * the lock map of format version 2 without reading the whole table. The
+ * exit code is 0 if one is found, 2 if all locks are held.
+ *
+ * -w, --watch <interval> --- Do not exit, but read the lock data every
+ * interval (seconds, or milliseconds with the "ms" suffix) and print only
+ * the changes as one JSON object per line. Combined with -a, the whole lock
+ * area is read with a few large reads per interval. See watch_locks() for
+ * the events.
+ *
+ * -d, --daemon <status_file> --- Instead of reading the device, display the
+ * status page which sfex_daemon -P <status_file> keeps. No device I/O is
+ * done. The exit code is 0 if the daemon is running and its last heartbeat
+ * is younger than lock_timeout, 2 if it is not running (or is starting or
+ * stopping), and 3 if it failed or its heartbeat is stale.
+ *
  * <device> --- This is file path which stored meta-data. It is usually 
  * expressed in "/dev/...", because it is partition on the shared disk.
+ * With several devices, the lock data are read from a majority of them.
  *
  * exit code --- 0 - Normal end. Own node is holding lock. 2 - Normal 
  * end. Own node does not hold a lock. 3 - Error occurs while processing 
@@ -49,6 +74,9 @@
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
+#include <getopt.h>
+#include <time.h>
+#include <signal.h>
 #if HAVE_UNISTD_H
 #  include <unistd.h>
 #endif
@@ -60,7 +88,16 @@ const char *progname;
 char *nodename;
 
 void print_controldata(const sfex_controldata *cdata);
-void print_lockdata(const sfex_lockdata *ldata, int index);
+void print_lockdata(const sfex_controldata *cdata, const sfex_lockdata *ldata, int index);
+
+/* what watch_locks() remembers about each lock between two reads */
+typedef struct watch_state {
+  sfex_lockdata last;		/* lock data of the previous read */
+  uint64_t changed;		/* monotonic usec when the count last moved */
+  double rate;			/* estimated heartbeats per second */
+  double reported_rate;		/* rate of the last printed event */
+  unsigned long missed;		/* missed heartbeats of the last printed event */
+} watch_state;
 
 /*
  * print_controldata --- print sfex control data to the display
@@ -86,17 +123,452 @@ print_controldata(const sfex_controldata *cdata)
  *
  * print sfex_lockdata to the display.
  *
+ * cdata --- pointer for control data
+ *
  * ldata --- pointer for lock data
  *
  * index --- index number
  */
 void
-print_lockdata(const sfex_lockdata *ldata, int index)
+print_lockdata(const sfex_controldata *cdata, const sfex_lockdata *ldata, int index)
 {
   printf("lock data #%d:\n", index);
   printf("  status: %s\n", ldata->status == SFEX_STATUS_UNLOCK ? "unlock" : "lock");
-  printf("  count: %d\n", ldata->count);
+  printf("  count: %llu\n", (unsigned long long)ldata->count);
   printf("  nodename: %s\n",ldata->nodename);
+  if (cdata->version >= SFEX_VERSION_V2) {
+    printf("  nodeid: 0x%08x\n", (unsigned)ldata->nodeid);
+    printf("  expiry: %llu\n", (unsigned long long)ldata->expiry);
+    printf("  interval: %lu\n", (unsigned long)ldata->interval);
+    printf("  takeover: %lu\n", (unsigned long)ldata->takeover);
+  }
+}
+
+/* what print_scanned_lock() needs for -a */
+typedef struct print_all {
+  const sfex_controldata *cdata;
+  int ret;			/* 0 if own node holds any lock, 2 otherwise */
+} print_all;
+
+/* sfex_scan callback of -a */
+static int
+print_scanned_lock(int index, const sfex_lockdata *ldata, void *arg)
+{
+  print_all *pa = arg;
+
+  print_lockdata(pa->cdata, ldata, index);
+  if (ldata->status == SFEX_STATUS_LOCK
+      && lockdata_owned_by(pa->cdata, ldata, nodename))
+    pa->ret = 0;
+  return 0;
+}
+
+/*
+ * print_json_string --- print a string as a JSON string literal
+ */
+static void
+print_json_string(const char *str)
+{
+  const unsigned char *p;
+
+  putchar('"');
+  for (p = (const unsigned char *)str; *p; p++) {
+    if (*p == '"' || *p == '\\')
+      printf("\\%c", *p);
+    else if (*p < 0x20)
+      printf("\\u%04x", *p);
+    else
+      putchar(*p);
+  }
+  putchar('"');
+}
+
+/*
+ * print_event --- print one watch event as a line of JSON
+ *
+ * event --- name of the event
+ *
+ * index --- index number
+ *
+ * ws --- state of the lock. ws->last is the current lock data.
+ */
+static void
+print_event(const char *event, int index, const watch_state *ws)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  printf("{\"ts\":%llu,\"index\":%d,\"event\":\"%s\",\"status\":\"%s\",\"node\":",
+	 (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000,
+	 index, event,
+	 ws->last.status == SFEX_STATUS_LOCK ? "lock" : "unlock");
+  print_json_string(ws->last.nodename);
+  printf(",\"count\":%llu,\"rate\":%.3f,\"missed\":%lu}\n",
+	 (unsigned long long)ws->last.count, ws->rate, ws->missed);
+}
+
+/*
+ * same_holder --- whether two lock data are held by the same node
+ */
+static int
+same_holder(const sfex_lockdata *a, const sfex_lockdata *b)
+{
+  return a->status == b->status && a->nodeid == b->nodeid
+    && strncmp(a->nodename, b->nodename, sizeof(a->nodename)) == 0;
+}
+
+/*
+ * watch_update --- compare one lock with its previous state
+ *
+ * The events are:
+ *   state    --- the first read of the lock
+ *   acquire, release, takeover --- the holder changed
+ *   rate     --- the heartbeat rate moved by more than a quarter
+ *   missed   --- the holder did not update the lock in time. missed is the
+ *                number of heartbeats overdue: with format version 2 the
+ *                holder's recorded interval is used, otherwise the rate
+ *                estimated so far.
+ *   resume   --- the counter moved again after missed heartbeats
+ *
+ * ws --- previous state, updated in place
+ *
+ * ldata --- lock data just read
+ *
+ * first --- whether this is the first read
+ */
+static void
+watch_update(watch_state *ws, const sfex_lockdata *ldata, int index,
+	     uint64_t now, int first)
+{
+  const char *event = NULL;
+  uint64_t period = 0;
+
+  if (first || !same_holder(&ws->last, ldata)) {
+    if (first)
+      event = "state";
+    else if (ldata->status != SFEX_STATUS_LOCK)
+      event = "release";
+    else if (ws->last.status != SFEX_STATUS_LOCK)
+      event = "acquire";
+    else
+      event = "takeover";
+    ws->last = *ldata;
+    ws->changed = now;
+    ws->rate = ws->reported_rate = 0;
+    ws->missed = 0;
+    print_event(event, index, ws);
+    return;
+  }
+
+  if (ldata->count != ws->last.count) {
+    double inst = (double)(ldata->count - ws->last.count) * 1000000 / (now - ws->changed);
+
+    ws->rate = ws->rate <= 0 ? inst : (ws->rate + inst) / 2;
+    ws->last = *ldata;
+    ws->changed = now;
+    if (ws->missed) {
+      ws->missed = 0;
+      ws->reported_rate = ws->rate;
+      print_event("resume", index, ws);
+    } else if (ws->rate > ws->reported_rate * 1.25
+	       || ws->rate < ws->reported_rate * 0.75) {
+      ws->reported_rate = ws->rate;
+      print_event("rate", index, ws);
+    }
+    return;
+  }
+
+  if (ldata->status != SFEX_STATUS_LOCK)
+    return;
+  if (ldata->interval)
+    period = (uint64_t)ldata->interval * 1000;
+  else if (ws->rate > 0)
+    period = 1000000 / ws->rate;
+  if (period && now - ws->changed > period) {
+    unsigned long missed = (now - ws->changed) / period - 1;
+
+    if (missed > ws->missed) {
+      ws->missed = missed;
+      print_event("missed", index, ws);
+    }
+  }
+}
+
+/* what watch_scanned_lock() needs for one read of the watched locks */
+typedef struct watch_pass {
+  watch_state *ws;		/* state of each watched lock */
+  int index;			/* index of ws[0] */
+  uint64_t now;
+  int first;
+} watch_pass;
+
+/* sfex_scan callback of watch_locks() */
+static int
+watch_scanned_lock(int index, const sfex_lockdata *ldata, void *arg)
+{
+  watch_pass *wp = arg;
+
+  watch_update(&wp->ws[index - wp->index], ldata, index, wp->now, wp->first);
+  return 0;
+}
+
+/*
+ * watch_locks --- print the changes of lock data until killed
+ *
+ * count lock data from index are read with scan_lockdata() every interval
+ * ms, and the changes are printed by watch_update(). A read error is
+ * reported and the lock data are read again at the next interval.
+ */
+static void
+watch_locks(const sfex_controldata *cdata, int index, int count,
+	    unsigned long interval)
+{
+  watch_pass wp;
+  uint64_t next;
+
+  wp.ws = calloc(count, sizeof(*wp.ws));
+  if (wp.ws == NULL) {
+    fprintf(stderr, "%s: ERROR: %s\n", progname, strerror(errno));
+    exit(3);
+  }
+  wp.index = index;
+  wp.first = 1;
+
+  next = get_monotonic_usec();
+  for (;;) {
+    wp.now = get_monotonic_usec();
+    if (scan_lockdata(cdata, index, count, watch_scanned_lock, &wp) == 0)
+      wp.first = 0;
+    fflush(stdout);
+    next += (uint64_t)interval * 1000;
+    sleep_until_usec(next);
+  }
+}
+
+/* what summarize_lock() counts over the lock table */
+#define SUMMARY_MAX_HOLDERS 16
+
+typedef struct summary {
+  const sfex_controldata *cdata;
+  const uint8_t *map;		/* lock map, NULL if there is none */
+  unsigned long locked;
+  unsigned long unlocked;
+  unsigned long own;		/* held by own node */
+  unsigned long map_stale;	/* bits of the lock map which are wrong */
+  unsigned long other_holders;	/* locks of the holders not in holders[] */
+  int nholders;
+  struct {
+    char nodename[sizeof(((sfex_lockdata *)0)->nodename)];
+    uint32_t nodeid;
+    unsigned long count;
+  } holders[SUMMARY_MAX_HOLDERS];
+} summary;
+
+/* sfex_scan callback of print_summary() */
+static int
+summarize_lock(int index, const sfex_lockdata *ldata, void *arg)
+{
+  summary *sum = arg;
+  int held = ldata->status == SFEX_STATUS_LOCK;
+  int i;
+
+  if (sum->map && !!(sum->map[(index - 1) / 8] & (1 << ((index - 1) % 8))) != held)
+    sum->map_stale++;
+  if (!held) {
+    sum->unlocked++;
+    return 0;
+  }
+  sum->locked++;
+  if (lockdata_owned_by(sum->cdata, ldata, nodename))
+    sum->own++;
+  for (i = 0; i < sum->nholders; i++) {
+    if (sum->holders[i].nodeid == ldata->nodeid
+	&& strcmp(sum->holders[i].nodename, ldata->nodename) == 0)
+      break;
+  }
+  if (i == sum->nholders) {
+    if (i == SUMMARY_MAX_HOLDERS) {
+      sum->other_holders++;
+      return 0;
+    }
+    strcpy(sum->holders[i].nodename, ldata->nodename);
+    sum->holders[i].nodeid = ldata->nodeid;
+    sum->holders[i].count = 0;
+    sum->nholders++;
+  }
+  sum->holders[i].count++;
+  return 0;
+}
+
+/*
+ * print_summary --- display the counts of the whole lock table
+ *
+ * The lock table is read with scan_lockdata(), a few large reads instead
+ * of one read per lock, and the lock map, if any, is checked against it.
+ *
+ * return value --- exit code, 0 if own node holds any lock.
+ */
+static int
+print_summary(const sfex_controldata *cdata)
+{
+  summary sum;
+  uint8_t *map;
+  uint64_t start = get_monotonic_usec();
+  unsigned long calls = sfex_io_syscalls();
+  int i;
+
+  memset(&sum, 0, sizeof(sum));
+  sum.cdata = cdata;
+  map = malloc((cdata->numlocks + 7) / 8);
+  if (map != NULL && lockmap_blocks(cdata) > 0 && read_lockmap(cdata, map) == 0)
+    sum.map = map;
+  if (scan_lockdata(cdata, 1, cdata->numlocks, summarize_lock, &sum) == -1)
+    return 3;
+
+  print_controldata(cdata);
+  printf("summary:\n");
+  printf("  locked: %lu\n", sum.locked);
+  printf("  unlocked: %lu\n", sum.unlocked);
+  printf("  held by own node: %lu\n", sum.own);
+  for (i = 0; i < sum.nholders; i++)
+    printf("  held by %s: %lu\n", sum.holders[i].nodename, sum.holders[i].count);
+  if (sum.other_holders)
+    printf("  held by other nodes: %lu\n", sum.other_holders);
+  if (sum.map)
+    printf("  lock map: %lu stale bits\n", sum.map_stale);
+  else
+    printf("  lock map: %s\n", lockmap_blocks(cdata) > 0 ? "broken" : "none");
+  printf("  read in %lu ms with %lu I/O calls\n",
+	 (unsigned long)((get_monotonic_usec() - start) / 1000),
+	 sfex_io_syscalls() - calls);
+  free(map);
+  return sum.own ? 0 : 2;
+}
+
+/* sfex_scan callback of find_free_lock(), stops at the first free lock */
+static int
+first_free_lock(int index, const sfex_lockdata *ldata, void *arg)
+{
+  if (ldata->status == SFEX_STATUS_LOCK)
+    return 0;
+  *(int *)arg = index;
+  return 1;
+}
+
+/*
+ * find_free_lock --- find the lowest index whose lock is not held
+ *
+ * With a lock map, the indexes whose bit is clear are read,
+ * FREE_CANDIDATES at a time with one read_lockdata_set(), and the first
+ * one found unlocked is taken; the lock data decide, as the map may be
+ * stale. Without a lock map, or if none of its candidates is free, the
+ * lock table is scanned.
+ *
+ * return value --- the index, 0 if all locks are held, -1 on error.
+ */
+#define FREE_CANDIDATES 64
+
+static int
+find_free_lock(const sfex_controldata *cdata)
+{
+  sfex_lockdata ldata[FREE_CANDIDATES];
+  int candidates[FREE_CANDIDATES];
+  uint8_t *map;
+  int found = 0;
+  int index = 1, r;
+
+  map = malloc((cdata->numlocks + 7) / 8);
+  if (map != NULL && lockmap_blocks(cdata) > 0 && read_lockmap(cdata, map) == 0) {
+    while (index <= cdata->numlocks && found == 0) {
+      int n = 0, i;
+
+      for (; index <= cdata->numlocks && n < FREE_CANDIDATES; index++) {
+	if (!(map[(index - 1) / 8] & (1 << ((index - 1) % 8))))
+	  candidates[n++] = index;
+      }
+      if (n > 0 && read_lockdata_set(cdata, ldata, candidates, n) == -1) {
+	free(map);
+	return -1;
+      }
+      for (i = 0; i < n && found == 0; i++) {
+	if (ldata[i].status != SFEX_STATUS_LOCK)
+	  found = candidates[i];
+      }
+    }
+  }
+  free(map);
+  if (found)
+    return found;
+  r = scan_lockdata(cdata, 1, cdata->numlocks, first_free_lock, &found);
+  return r == -1 ? -1 : found;
+}
+
+/*
+ * print_daemon_status --- display the status page of sfex_daemon
+ *
+ * return value --- exit code, see the top of this file.
+ */
+static int
+print_daemon_status(const char *path)
+{
+  static const char *states[] = {"unknown", "starting", "running", "stopping", "failed"};
+  const sfex_status *page;
+  sfex_status st;
+  uint64_t age;
+  int alive;
+  unsigned i;
+
+  page = status_page_open(path);
+  if (page == NULL) {
+    fprintf(stdout, "sfex_daemon is not running.\n");
+    return 2;
+  }
+  if (status_page_read(page, &st) == -1) {
+    fprintf(stderr, "%s: ERROR: status page %s is busy.\n", progname, path);
+    return 3;
+  }
+  alive = kill(st.pid, 0) == 0 || errno == EPERM;
+  age = get_monotonic_usec() - st.last_heartbeat;
+
+  printf("daemon status:\n");
+  printf("  pid: %lu%s\n", (unsigned long)st.pid, alive ? "" : " (not running)");
+  printf("  state: %s\n", st.state < sizeof(states) / sizeof(states[0]) ? states[st.state] : states[0]);
+  printf("  locks:");
+  for (i = 0; i < st.num_locks && i < SFEX_STATUS_MAX_INDEXES; i++)
+    printf(" %d", st.indexes[i]);
+  printf("%s\n", st.num_locks > SFEX_STATUS_MAX_INDEXES ? " ..." : "");
+  printf("  count: %llu\n", (unsigned long long)st.count);
+  printf("  last heartbeat: %llu (%llu ms ago)\n",
+	 (unsigned long long)st.last_heartbeat_ms,
+	 (unsigned long long)(age / 1000));
+  printf("  last I/O: %lu us\n", (unsigned long)st.last_io_usec);
+  printf("  I/O errors: %lu\n", (unsigned long)st.io_errors);
+  printf("  slow heartbeats: %lu\n", (unsigned long)st.slow_heartbeats);
+  for (i = 0; i < SFEX_LATENCY_KINDS; i++) {
+    static const char *names[SFEX_LATENCY_KINDS] = {"read", "write", "heartbeat"};
+    const sfex_latency *c = &st.latency[i], *l = &st.last_latency[i];
+
+    printf("  %s latency: p50 %lu us, p99 %lu us, max %lu us (%lu); last %lu s: p50 %lu us, p99 %lu us, max %lu us (%lu)\n",
+	   names[i], (unsigned long)c->p50, (unsigned long)c->p99,
+	   (unsigned long)c->max, (unsigned long)c->count,
+	   (unsigned long)st.window, (unsigned long)l->p50,
+	   (unsigned long)l->p99, (unsigned long)l->max, (unsigned long)l->count);
+  }
+
+  if (st.state == SFEX_STATE_FAILED) {
+    fprintf(stdout, "sfex_daemon failed.\n");
+    return 3;
+  }
+  if (!alive || st.state != SFEX_STATE_RUNNING) {
+    fprintf(stdout, "sfex_daemon is not running.\n");
+    return 2;
+  }
+  if (age >= (uint64_t)st.lock_timeout * 1000) {
+    fprintf(stdout, "heartbeat is stale.\n");
+    return 3;
+  }
+  fprintf(stdout, "status is LOCKED.\n");
+  return 0;
 }
 
 /*
@@ -110,7 +582,8 @@ print_lockdata(const sfex_lockdata *ldata, int index)
  * retrun value --- void
  */
 static void usage(FILE *dist) {
-  fprintf(dist, "usage: %s [-i <index>] <device>\n", progname);
+  fprintf(dist, "usage: %s [-i <index>] [-a] [-s] [-f] [-w <interval>] <device> [<device>...]\n", progname);
+  fprintf(dist, "       %s -d <status_file>\n", progname);
 }
 
 /*
@@ -128,10 +601,23 @@ main(int argc, char *argv[]) {
   sfex_controldata cdata;
   sfex_lockdata ldata;
   int ret = 0;
+  static const struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"index", required_argument, NULL, 'i'},
+    {"all", no_argument, NULL, 'a'},
+    {"summary", no_argument, NULL, 's'},
+    {"free", no_argument, NULL, 'f'},
+    {"watch", required_argument, NULL, 'w'},
+    {"daemon", required_argument, NULL, 'd'},
+    {NULL, 0, NULL, 0}
+  };
 
   /* command line parameter */
   int index = 1;		/* default 1st lock */
-  const char *device;
+  int all = 0;
+  int summarize = 0;
+  int free_lock = 0;
+  unsigned long watch = 0;	/* interval in ms, 0 if not watching */
 
   /*
    * startup process
@@ -148,7 +634,7 @@ main(int argc, char *argv[]) {
   /* read command line option */
   opterr = 0;
   while (1) {
-    int c = getopt(argc, argv, "hi:");
+    int c = getopt_long(argc, argv, "hi:asfw:d:", long_options, NULL);
     if (c == -1)
       break;
     switch (c) {
@@ -158,17 +644,35 @@ main(int argc, char *argv[]) {
     case 'i':			/* -i <index> */
       {
 	unsigned long l = strtoul(optarg, NULL, 10);
-	if (l < SFEX_MIN_NUMLOCKS || l > SFEX_MAX_NUMLOCKS) {
+	if (l < SFEX_MIN_NUMLOCKS || l > SFEX_MAX_NUMLOCKS_V2) {
 	  fprintf(stderr,
 		  "%s: ERROR: index %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
 		  progname, optarg,
 		  (unsigned long)SFEX_MIN_NUMLOCKS,
-		  (unsigned long)SFEX_MAX_NUMLOCKS);
+		  (unsigned long)SFEX_MAX_NUMLOCKS_V2);
 	  exit(4);
 	}
 	index = l;
       }
       break;
+    case 'a':			/* -a, --all */
+      all = 1;
+      break;
+    case 's':			/* -s, --summary */
+      summarize = 1;
+      break;
+    case 'f':			/* -f, --free */
+      free_lock = 1;
+      break;
+    case 'w':			/* -w, --watch <interval> */
+      if (parse_msec(optarg, &watch) == -1) {
+	fprintf(stderr, "%s: ERROR: watch interval %s is out of range or invalid.\n",
+		progname, optarg);
+	exit(4);
+      }
+      break;
+    case 'd':			/* -d, --daemon <status_file> */
+      exit(print_daemon_status(optarg));
     case '?':			/* error */
       usage(stderr);
       exit(4);
@@ -180,12 +684,7 @@ main(int argc, char *argv[]) {
     fprintf(stderr, "%s: ERROR: no device specified.\n", progname);
     usage(stderr);
     exit(4);
-  } else if (optind + 1 < argc) {
-    fprintf(stderr, "%s: ERROR: too many arguments.\n", progname);
-    usage(stderr);
-    exit(4);
   }
-  device = argv[optind];
 
   /*
    * main processes start 
@@ -194,21 +693,54 @@ main(int argc, char *argv[]) {
   /* get a node name */
   nodename = get_nodename();
 
-  prepare_lock(device);
+  for (; optind < argc; optind++)
+    prepare_lock(argv[optind]);
 
   ret = lock_index_check(&cdata, index);
   if (ret == -1)
     exit(EXIT_FAILURE);
 
+  if (summarize)
+    exit(print_summary(&cdata));
+
+  if (free_lock) {
+    int found = find_free_lock(&cdata);
+
+    if (found == -1)
+      exit(3);
+    if (found == 0) {
+      fprintf(stdout, "all locks are held.\n");
+      exit(2);
+    }
+    printf("%d\n", found);
+    exit(0);
+  }
+
+  if (watch)
+    watch_locks(&cdata, all ? 1 : index, all ? cdata.numlocks : 1, watch);
+
+  if (all) {
+    print_all pa;
+
+    pa.cdata = &cdata;
+    pa.ret = 2;
+    print_controldata(&cdata);
+    if (scan_lockdata(&cdata, 1, cdata.numlocks, print_scanned_lock, &pa) == -1)
+      exit(3);
+    /* 0 if own node holds any of the locks */
+    exit(pa.ret);
+  }
+
   /* read lock data */
-  read_lockdata(&cdata, &ldata, index);
+  if (read_lockdata(&cdata, &ldata, index) == -1)
+    exit(3);
 
   /* display status */
   print_controldata(&cdata);
-  print_lockdata(&ldata, index);
+  print_lockdata(&cdata, &ldata, index);
 
   /* check current lock status */
-  if (ldata.status != SFEX_STATUS_LOCK || strcmp(ldata.nodename, nodename)) {
+  if (ldata.status != SFEX_STATUS_LOCK || !lockdata_owned_by(&cdata, &ldata, nodename)) {
     fprintf(stdout, "status is UNLOCKED.\n");
     exit(2);
   } else {
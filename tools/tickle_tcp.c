@@ -19,12 +19,14 @@
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <config.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <netinet/tcp.h>
@@ -33,8 +35,6 @@
 #include <arpa/inet.h>
 #include <net/if.h>
 
-#define discard_const(ptr) ((void *)((intptr_t)(ptr)))
-
 typedef union {
 	struct sockaddr     sa;
 	struct sockaddr_in  ip;
@@ -51,55 +51,32 @@ int parse_ip_port(const char *addr, sock_addr *saddr);
 int send_tickle_ack(const sock_addr *dst, 
 		    const sock_addr *src, 
 		    uint32_t seq, uint32_t ack, int rst);
+int flush_tickle_acks(void);
 static void usage(void);
 
+/*
+ * The data is read a byte at a time: the headers summed hold 32 bit
+ * fields, which the compiler may assume a uint16_t pointer never reads.
+ */
 uint32_t uint16_checksum(uint16_t *data, size_t n)
 {
+	const uint8_t *p = (const uint8_t *)data;
 	uint32_t sum=0;
 	while (n >= 2) {
-		sum += (uint32_t)ntohs(*data);
-		data++;        
+		sum += ((uint32_t)p[0] << 8) | p[1];
+		p += 2;
 		n -= 2;
 	}                      
 	if (n == 1) {
-		sum += (uint32_t)ntohs(*(uint8_t *)data);
+		sum += (uint32_t)p[0] << 8;
 	}
 	return sum;
 }       
 
-static uint16_t tcp_checksum(uint16_t *data, size_t n, struct iphdr *ip)
+/* the TCP checksum of a sum of 16 bit words */
+static uint16_t fold_checksum(uint32_t sum)
 {
-	uint32_t sum = uint16_checksum(data, n);
 	uint16_t sum2;
-	sum += uint16_checksum((uint16_t *)(void *)&ip->saddr,
-				sizeof(ip->saddr));
-	sum += uint16_checksum((uint16_t *)(void *)&ip->daddr,
-				sizeof(ip->daddr));
-	sum += ip->protocol + n;
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum2 = htons(sum);
-	sum2 = ~sum2;
-	if (sum2 == 0) {
-		return 0xFFFF;
-	}
-	return sum2;
-}
-
-static uint16_t tcp_checksum6(uint16_t *data, size_t n, struct ip6_hdr *ip6)
-{
-	uint32_t phdr[2];
-	uint32_t sum = 0;
-	uint16_t sum2;
-
-	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_src, 16);
-	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_dst, 16);
-
-	phdr[0] = htonl(n);
-	phdr[1] = htonl(ip6->ip6_nxt);
-	sum += uint16_checksum((uint16_t *)phdr, 8);
-
-	sum += uint16_checksum(data, n);
 
 	sum = (sum & 0xFFFF) + (sum >> 16);
 	sum = (sum & 0xFFFF) + (sum >> 16);
@@ -204,133 +181,258 @@ int parse_ip_port(const char *addr, sock_addr *saddr)
 	return ret;
 }
 
-int send_tickle_ack(const sock_addr *dst, 
-		    const sock_addr *src, 
-		    uint32_t seq, uint32_t ack, int rst)
+/*
+ * The tickles are built from a template of the headers, whose checksum
+ * is computed once, and queued per family. A full queue is sent with
+ * one sendmmsg() on a raw socket, which is opened for the first packet
+ * of its family and kept.
+ */
+#define TICKLE_BATCH	64
+
+struct ip4_tcp_pkt {
+	struct iphdr ip;
+	struct tcphdr tcp;
+};
+
+struct ip6_tcp_pkt {
+	struct ip6_hdr ip6;
+	struct tcphdr tcp;
+};
+
+struct tickle_queue {
+	int		family;
+	int		fd;
+	unsigned	n;
+	union {
+		struct ip4_tcp_pkt ip4;
+		struct ip6_tcp_pkt ip6;
+	} pkt[TICKLE_BATCH];
+	sock_addr	dst[TICKLE_BATCH];
+};
+
+static struct tickle_queue queue4 = { AF_INET, -1, 0 };
+static struct tickle_queue queue6 = { AF_INET6, -1, 0 };
+static struct ip4_tcp_pkt template4;
+static struct ip6_tcp_pkt template6;
+/* the TCP header and pseudo header words which are the same in all */
+static uint32_t template_sum;
+static unsigned long tickles_sent;
+
+static void init_templates(void)
+{
+	struct tcphdr tcp;
+
+	memset(&tcp, 0, sizeof(tcp));
+	tcp.ack    = 1;
+	tcp.doff   = sizeof(tcp)/4;
+	tcp.window = htons(1234);
+	/* the pseudo headers of both add up to these */
+	template_sum = uint16_checksum((uint16_t *)&tcp, sizeof(tcp))
+		+ IPPROTO_TCP + sizeof(tcp);
+
+	memset(&template4, 0, sizeof(template4));
+	template4.ip.version  = 4;
+	template4.ip.ihl      = sizeof(template4.ip)/4;
+	template4.ip.tot_len  = htons(sizeof(template4));
+	template4.ip.ttl      = 255;
+	template4.ip.protocol = IPPROTO_TCP;
+	template4.tcp         = tcp;
+
+	memset(&template6, 0, sizeof(template6));
+	template6.ip6.ip6_vfc  = 0x60;
+	template6.ip6.ip6_plen = htons(sizeof(tcp));
+	template6.ip6.ip6_nxt  = IPPROTO_TCP;
+	template6.ip6.ip6_hlim = 64;
+	template6.tcp          = tcp;
+}
+
+static int open_raw_socket(int family)
 {
 	int s;
-	int ret;
 	uint32_t one = 1;
-	uint16_t tmpport;
-	sock_addr *tmpdest;
-	struct {
-		struct iphdr ip;
-		struct tcphdr tcp;
-	} ip4pkt;
-	struct {
-		struct ip6_hdr ip6;
-		struct tcphdr tcp;
-	} ip6pkt;
-
-	switch (src->ip.sin_family) {
-	case AF_INET:
-		memset(&ip4pkt, 0, sizeof(ip4pkt));
-		ip4pkt.ip.version  = 4;
-		ip4pkt.ip.ihl      = sizeof(ip4pkt.ip)/4;
-		ip4pkt.ip.tot_len  = htons(sizeof(ip4pkt));
-		ip4pkt.ip.ttl      = 255;
-		ip4pkt.ip.protocol = IPPROTO_TCP;
-		ip4pkt.ip.saddr    = src->ip.sin_addr.s_addr;
-		ip4pkt.ip.daddr    = dst->ip.sin_addr.s_addr;
-		ip4pkt.ip.check    = 0;
-
-		ip4pkt.tcp.source  = src->ip.sin_port;
-		ip4pkt.tcp.dest    = dst->ip.sin_port;
-		ip4pkt.tcp.seq     = seq;
-		ip4pkt.tcp.ack_seq = ack;
-		ip4pkt.tcp.ack     = 1;
-		if (rst)
-			ip4pkt.tcp.rst = 1;
-		ip4pkt.tcp.doff    = sizeof(ip4pkt.tcp)/4;
-		ip4pkt.tcp.window   = htons(1234);
-		ip4pkt.tcp.check    = tcp_checksum((uint16_t *)&ip4pkt.tcp, sizeof(ip4pkt.tcp), &ip4pkt.ip);
-
-		s = socket(AF_INET, SOCK_RAW, htons(IPPROTO_RAW));
-		if (s == -1) {
-			fprintf(stderr, "Failed to open raw socket (%s)\n", strerror(errno));
-			return -1;
-		}
 
-		ret = setsockopt(s, SOL_IP, IP_HDRINCL, &one, sizeof(one));
-		if (ret != 0) {
-			fprintf(stderr, "Failed to setup IP headers (%s)\n", strerror(errno));
-			close(s);
-			return -1;
-		}
+	/* IPPROTO_RAW sockets send the IP header given */
+	s = socket(family, SOCK_RAW, IPPROTO_RAW);
+	if (s == -1) {
+		fprintf(stderr, "Failed to open raw socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	if (family == AF_INET
+	    && setsockopt(s, SOL_IP, IP_HDRINCL, &one, sizeof(one)) != 0) {
+		fprintf(stderr, "Failed to setup IP headers (%s)\n", strerror(errno));
+		close(s);
+		return -1;
+	}
+	set_nonblocking(s);
+	set_close_on_exec(s);
+	return s;
+}
 
-		set_nonblocking(s);
-		set_close_on_exec(s);
+static int flush_queue(struct tickle_queue *q)
+{
+	struct mmsghdr msg[TICKLE_BATCH];
+	struct iovec iov[TICKLE_BATCH];
+	unsigned i, sent = 0;
+	int ret, fresh = 0;
+
+	memset(msg, 0, q->n * sizeof(msg[0]));
+	for (i = 0; i < q->n; i++) {
+		iov[i].iov_base = &q->pkt[i];
+		iov[i].iov_len = q->family == AF_INET
+			? sizeof(struct ip4_tcp_pkt) : sizeof(struct ip6_tcp_pkt);
+		msg[i].msg_hdr.msg_name = &q->dst[i];
+		msg[i].msg_hdr.msg_namelen = q->family == AF_INET
+			? sizeof(q->dst[i].ip) : sizeof(q->dst[i].ip6);
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
 
-		ret = sendto(s, &ip4pkt, sizeof(ip4pkt), 0, 
-			     (const struct sockaddr *)&dst->ip, sizeof(dst->ip));
-		close(s);
-		if (ret != sizeof(ip4pkt)) {
-			fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
+	while (sent < q->n) {
+#ifdef HAVE_SENDMMSG
+		ret = sendmmsg(q->fd, msg + sent, q->n - sent, 0);
+#else
+		ret = sendmsg(q->fd, &msg[sent].msg_hdr, 0) == -1 ? -1 : 1;
+#endif
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			/*
+			 * The packets to a neighbour being resolved stay
+			 * on the socket until it is, or fails, which may
+			 * take seconds. Go on with a new socket rather
+			 * than wait, unless a new one is full already.
+			 */
+			if ((errno == EAGAIN || errno == EWOULDBLOCK)
+			    && !fresh) {
+				close(q->fd);
+				if ((q->fd = open_raw_socket(q->family)) == -1) {
+					q->n = 0;
+					return -1;
+				}
+				fresh = 1;
+				continue;
+			}
+			fprintf(stderr, "Failed sendmmsg (%s)\n", strerror(errno));
+			q->n = 0;
 			return -1;
 		}
-		break;
-
-        case AF_INET6:
-		memset(&ip6pkt, 0, sizeof(ip6pkt));
-		ip6pkt.ip6.ip6_vfc  = 0x60;
-		ip6pkt.ip6.ip6_plen = htons(20);
-		ip6pkt.ip6.ip6_nxt  = IPPROTO_TCP;
-		ip6pkt.ip6.ip6_hlim = 64;
-		ip6pkt.ip6.ip6_src  = src->ip6.sin6_addr;
-		ip6pkt.ip6.ip6_dst  = dst->ip6.sin6_addr;
-
-		ip6pkt.tcp.source   = src->ip6.sin6_port;
-		ip6pkt.tcp.dest     = dst->ip6.sin6_port;
-		ip6pkt.tcp.seq      = seq;
-		ip6pkt.tcp.ack_seq  = ack;
-		ip6pkt.tcp.ack      = 1;
-		if (rst)
-			ip6pkt.tcp.rst      = 1;
-		ip6pkt.tcp.doff     = sizeof(ip6pkt.tcp)/4;
-		ip6pkt.tcp.window   = htons(1234);
-		ip6pkt.tcp.check    = tcp_checksum6((uint16_t *)&ip6pkt.tcp, sizeof(ip6pkt.tcp), &ip6pkt.ip6);
-
-		s = socket(PF_INET6, SOCK_RAW, IPPROTO_RAW);
-		if (s == -1) {
-			fprintf(stderr, "Failed to open sending socket\n");
-			return -1;
-                }
+		sent += ret;
+		fresh = 0;
+	}
+	tickles_sent += q->n;
+	q->n = 0;
+	return 0;
+}
 
-		tmpdest = discard_const(dst);
-		tmpport = tmpdest->ip6.sin6_port;
+/* queue a tickle; it is sent when the queue is full, or by flush_tickle_acks() */
+int send_tickle_ack(const sock_addr *dst, 
+		    const sock_addr *src, 
+		    uint32_t seq, uint32_t ack, int rst)
+{
+	struct tickle_queue *q;
+	struct tcphdr *tcp;
+	uint32_t sum;
 
-		tmpdest->ip6.sin6_port = 0;
-		ret = sendto(s, &ip6pkt, sizeof(ip6pkt), 0, (const struct sockaddr *)&dst->ip6, sizeof(dst->ip6));
-		tmpdest->ip6.sin6_port = tmpport;
-		close(s);
+	if (template_sum == 0) {
+		init_templates();
+	}
 
-		if (ret != sizeof(ip6pkt)) {
-			fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
-			return -1;
-		}
+	switch (src->ip.sin_family) {
+	case AF_INET:
+		q = &queue4;
+		break;
+	case AF_INET6:
+		q = &queue6;
 		break;
-
 	default:
 		fprintf(stderr, "Not an ipv4/v6 address\n");
 		return -1;
 	}
+	if (q->fd == -1 && (q->fd = open_raw_socket(q->family)) == -1) {
+		return -1;
+	}
 
+	sum = template_sum;
+	if (q->family == AF_INET) {
+		struct ip4_tcp_pkt *pkt = &q->pkt[q->n].ip4;
+
+		*pkt = template4;
+		pkt->ip.saddr = src->ip.sin_addr.s_addr;
+		pkt->ip.daddr = dst->ip.sin_addr.s_addr;
+		sum += uint16_checksum((uint16_t *)(void *)&pkt->ip.saddr, 8);
+		tcp = &pkt->tcp;
+		q->dst[q->n].ip = dst->ip;
+	}else{
+		struct ip6_tcp_pkt *pkt = &q->pkt[q->n].ip6;
+
+		*pkt = template6;
+		pkt->ip6.ip6_src = src->ip6.sin6_addr;
+		pkt->ip6.ip6_dst = dst->ip6.sin6_addr;
+		sum += uint16_checksum((uint16_t *)(void *)&pkt->ip6.ip6_src, 32);
+		tcp = &pkt->tcp;
+		q->dst[q->n].ip6 = dst->ip6;
+		/* a raw IPv6 socket takes the port for the protocol */
+		q->dst[q->n].ip6.sin6_port = 0;
+	}
+
+	tcp->source  = src->ip.sin_port;
+	tcp->dest    = dst->ip.sin_port;
+	tcp->seq     = seq;
+	tcp->ack_seq = ack;
+	/* the ports and sequence numbers are the 12 bytes from the source */
+	sum += uint16_checksum((uint16_t *)tcp, 12);
+	if (rst) {
+		tcp->rst = 1;
+		sum += TH_RST;
+	}
+	tcp->check = fold_checksum(sum);
+
+	if (++q->n == TICKLE_BATCH) {
+		return flush_queue(q);
+	}
 	return 0;
 }
 
+/* send the tickles queued */
+int flush_tickle_acks(void)
+{
+	int ret = 0;
+
+	if (queue4.n > 0 && flush_queue(&queue4) != 0) {
+		ret = -1;
+	}
+	if (queue6.n > 0 && flush_queue(&queue6) != 0) {
+		ret = -1;
+	}
+	return ret;
+}
+
 static void usage(void)
 {
-	printf("Usage: /usr/lib/heartbeat/tickle_tcp [ -n num ]\n");
+	printf("Usage: /usr/lib/heartbeat/tickle_tcp [ -n num ] [ -v ]\n");
 	printf("Please note that this program need to read the list of\n");
 	printf("{local_ip:port remote_ip:port} from stdin.\n");
+	printf("-n sends num tickles to each, and -v prints the number of\n");
+	printf("packets sent and the rate to stderr.\n");
 	exit(1);
 }
 
-#define OPTION_STRING "n:h"
+#define OPTION_STRING "n:hv"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 int main(int argc, char *argv[])
 {
-	int optchar, i, num = 1, cont = 1;
+	int optchar, i, num = 1, cont = 1, verbose = 0;
+	unsigned long conns = 0;
+	double start;
 	sock_addr src, dst;
 	char addrline[128], addr1[64], addr2[64];
 
@@ -344,6 +446,9 @@ int main(int argc, char *argv[])
 			usage();
 			exit(EXIT_SUCCESS);
 			break;
+		case 'v':
+			verbose = 1;
+			break;
 		case EOF:
 			cont = 0;
 			break;
@@ -354,15 +459,18 @@ int main(int argc, char *argv[])
 		};
 	}
 
+	start = now();
 	while(fgets(addrline, sizeof(addrline), stdin)) {
 		sscanf(addrline, "%s %s", addr1, addr2);
 
 		if (parse_ip_port(addr1, &src)) {
 			fprintf(stderr, "Bad IP:port '%s'\n", addr1);
+			flush_tickle_acks();
 			return -1;
 		}
 		if (parse_ip_port(addr2, &dst)) {
 			fprintf(stderr, "Bad IP:port '%s'\n", addr2);
+			flush_tickle_acks();
 			return -1;
 		}
 	
@@ -370,10 +478,22 @@ int main(int argc, char *argv[])
 			if (send_tickle_ack(&dst, &src, 0, 0, 0)) {
 				fprintf(stderr, "Error while sending tickle ack from '%s' to '%s'\n",
 					addr1, addr2);
+				flush_tickle_acks();
 				return -1;
 			}
 		}
+		conns++;
+	}
+	if (flush_tickle_acks()) {
+		fprintf(stderr, "Error while sending tickle acks\n");
+		return -1;
+	}
+	if (verbose) {
+		double secs = now() - start;
 
+		fprintf(stderr, "%lu packets to %lu connections in %.3f s"
+			" (%.0f packets/s)\n", tickles_sent, conns, secs,
+			secs > 0 ? tickles_sent / secs : 0);
 	}
 	return 0;
 }